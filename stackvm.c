@@ -2,6 +2,37 @@
  * stack machine
  *
    gcc -Wall -O3 -std=gnu11 -ostackvm stackvm.c
+   gcc -Wall -O3 -std=gnu11 -DVM_COUNT -ostackvm stackvm.c
+ *
+ * usage: stackvm [-e recursive|fast|jit] [-n repetitions] [-s stack words] [-O] [factorial|depth] [arg]
+ *
+ * The accumulator a is the top of the stack. CAL runs the function
+ * with the current stack and the value of a, and continues with its
+ * result in a and the stack as before. vm_run() does this by calling
+ * itself.
+ *
+ * vm_verify() checks code once before it runs: opcodes, operands,
+ * that jumps and calls go to instructions, and that every function
+ * has the same height of the stack wherever control meets, only
+ * uses the stack above the height at which it was called and never
+ * ends without RET. It computes how much stack each function needs
+ * and the whole program, unless it is recursive. vm_fast() then
+ * runs without checks, except for the room of the callee at CAL.
+ * It dispatches with computed goto and keeps the return address
+ * and the height of the stack on a return stack of its own, so
+ * that the depth of the recursion is only limited by the two
+ * stacks and not by the host.
+ *
+ * vm_jit() translates verified code into machine code for x86-64
+ * by copying and patching stencils compiled from C, jit_run() runs
+ * it with the same check at CAL and a limit for the machine stack.
+ *
+ * -O rewrites the code with vm_optimize() before: a LIT or a LOD
+ * followed by arithmetic becomes one instruction with the constant
+ * or the slot of the stack as operand, constants are folded and
+ * jumps to jumps go to the final target. Built with VM_COUNT, it
+ * prints how many instructions vm_run() executes before and after,
+ * the counter is not in vm_run() otherwise.
  *
  * Author: Martin Uecker <uecker@eecs.berkeley.edu>
  */
@@ -9,72 +40,1260 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#ifdef __x86_64__
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#endif
+
+#include "stackvm.h"
 
-enum byte_code {
+#define IMM(op)	(ADDI + (op) - ADD)
+#define SLOT(op) (ADDL + (op) - ADD)
+
+
+#ifdef VM_COUNT
+long vm_steps = 0;
+#endif
+
+
+/*
+ * verifier
+ */
 
-	ADD, SUB, MUL, DIV, 
-	AND, OR , XOR, NOT, 
-	JPC, JMP, CAL, RET,
-	LIT, INT, LOD, 
+struct vm_info {
+
+	int* frame;	// stack used by the function at each entry, else -1
+	int depth;	// stack used by the program, -1 if it recurses
+	int nest;	// calls active at the same time, -1 if it recurses
+};
+
+struct call {
+
+	int caller;
+	int callee;
+	int height;
 };
 
+static bool operand(int op)
+{
+	return (JPC == op) || (JMP == op) || (CAL == op) || (LIT == op) || (INT == op) || (LOD == op)
+		|| ((ADDI <= op) && (op <= XORL));
+}
+
+// heights of the stack in the function at f relative to its entry
+
+static const char* verify_fun(const int* code, int len, const bool* insn, int f, int* height,
+			int* frame, struct call** calls, int* ncalls, int* pc)
+{
+	int work[len];
+	int n = 0;
+	int max = 0;
+
+	for (int i = 0; i < len; i++)
+		height[i] = -1;
+
+	height[f] = 0;
+	work[n++] = f;
+
+#define SUCC(l, h)	do {							\
+		if (((l) < 0) || ((l) >= len) || !insn[l])			\
+			return "jump to no instruction";			\
+		if (-1 == height[l]) {						\
+			height[l] = (h);					\
+			work[n++] = (l);					\
+		} else if ((h) != height[l]) {					\
+			return "different heights of the stack";		\
+		}								\
+	} while (0)
+
+	while (n > 0) {
+
+		int i = work[--n];
+		int h = height[i];
+		int k = operand(code[i]) ? code[i + 1] : 0;
+
+		*pc = i;
+
+		switch (code[i]) {
+		case ADD ... XOR:
+
+			if (h < 1)
+				return "stack underflow";
+
+			SUCC(i + 1, h - 1);
+			break;
+
+		case NOT:
+			SUCC(i + 1, h);
+			break;
+
+		case JPC:
+			SUCC(k, h);
+			SUCC(i + 2, h);
+			break;
+
+		case JMP:
+			SUCC(k, h);
+			break;
+
+		case CAL:
+
+			if ((k < 0) || (k >= len) || !insn[k])
+				return "call to no instruction";
+
+			*calls = realloc(*calls, (*ncalls + 1) * sizeof(struct call));
+			(*calls)[(*ncalls)++] = (struct call){ f, k, h };
+
+			SUCC(i + 2, h);
+			break;
+
+		case RET:
+			break;
+
+		case LIT:
+		case LOD:
+
+			if ((LOD == code[i]) && ((k < 0) || (k > h)))
+				return "load below the frame";
+
+			if (h + 1 > max)
+				max = h + 1;
+
+			SUCC(i + 2, h + 1);
+			break;
+
+		case ADDI ... XORI:
+			SUCC(i + 2, h);
+			break;
+
+		case ADDL ... XORL:
+
+			if ((k < 1) || (k > h))
+				return "load below the frame";
+
+			SUCC(i + 2, h);
+			break;
+
+		case INT:
+
+			if (h - (long)k < 0)
+				return "stack underflow";
+
+			if (h - (long)k > INT_MAX / 2)
+				return "frame too large";
 
-int vm_run(int* code, int* stack, int i, int t, int a)
+			if (h - k > max)
+				max = h - k;
+
+			SUCC(i + 2, h - k);
+			break;
+		}
+	}
+#undef SUCC
+
+	frame[f] = max;
+
+	return NULL;
+}
+
+// stack and nesting of calls of f and its callees, -1 if recursive
+
+static void bound(int f, const int* frame, const struct call* calls, int ncalls,
+			int* state, int* depth, int* nest)
 {
-	int pop(void) { return stack[--t]; }
-	void push(int x) { stack[t++] = x; }
-	int load(void) { return code[i++]; }
+	if (2 == state[f])
+		return;
 
-	while (true) {
+	if (1 == state[f]) {
 
-		switch (load()) {
+		depth[f] = -1;
+		return;
+	}
 
-		case ADD: { a += pop(); } break;
-		case SUB: { a -= pop(); } break;
-		case MUL: { a *= pop(); } break;
-		case DIV: { a /= pop(); } break;
-		case AND: { a &= pop(); } break;
-		case OR : { a |= pop(); } break;
-		case XOR: { a ^= pop(); } break;
-		case NOT: { a = ~a; } break;
-		case JPC: { int l = load(); if (a) i = l; } break;
-		case JMP: { i = load(); } break;
-		case LIT: { push(a); a = load(); } break;
-		case INT: { t -= load(); } break;
-		case LOD: { push(a); a = stack[t - 1 - load()]; } break;
-		case CAL: { a = vm_run(code, stack, load(), t, a); } break;
-		case RET: { return a; } break;
+	state[f] = 1;
+	depth[f] = frame[f];
+	nest[f] = 0;
 
-		default: assert(0);
+	for (int j = 0; j < ncalls; j++) {
+
+		if (f != calls[j].caller)
+			continue;
+
+		int g = calls[j].callee;
+
+		bound(g, frame, calls, ncalls, state, depth, nest);
+
+		if ((-1 == depth[g]) || (-1 == depth[f])) {
+
+			depth[f] = -1;
+			continue;
 		}
 
-		assert(t >= 0);
-	} 
+		if (calls[j].height + depth[g] > depth[f])
+			depth[f] = calls[j].height + depth[g];
+
+		if (1 + nest[g] > nest[f])
+			nest[f] = 1 + nest[g];
+	}
+
+	state[f] = 2;
+}
+
+// NULL if the code is valid, else what is wrong at *pc
+
+const char* vm_verify(const int* code, int len, struct vm_info* info, int* pc)
+{
+	bool insn[len];
+	int height[len];
+	const char* err = NULL;
+
+	for (int i = 0; i < len; i++)
+		insn[i] = false;
+
+	for (int i = 0; i < len; i += operand(code[i]) ? 2 : 1) {
+
+		*pc = i;
+
+		if ((code[i] < 0) || (code[i] >= NUM_CODES))
+			return "bad opcode";
+
+		if (operand(code[i]) && (i + 1 >= len))
+			return "missing operand";
+
+		insn[i] = true;
+	}
+
+	*pc = 0;
+
+	if (0 == len)
+		return "no code";
+
+	info->frame = malloc(len * sizeof(int));
+
+	for (int i = 0; i < len; i++)
+		info->frame[i] = -1;
+
+	struct call* calls = NULL;
+	int ncalls = 0;
+
+	err = verify_fun(code, len, insn, 0, height, info->frame, &calls, &ncalls, pc);
+
+	// calls are added while we go
+
+	for (int j = 0; (NULL == err) && (j < ncalls); j++)
+		if (-1 == info->frame[calls[j].callee])
+			err = verify_fun(code, len, insn, calls[j].callee, height, info->frame, &calls, &ncalls, pc);
+
+	if (NULL == err) {
+
+		int state[len];
+		int depth[len];
+		int nest[len];
+
+		for (int i = 0; i < len; i++)
+			state[i] = 0;
+
+		bound(0, info->frame, calls, ncalls, state, depth, nest);
+
+		info->depth = depth[0];
+		info->nest = (-1 == depth[0]) ? -1 : nest[0];
+	}
+
+	free(calls);
+
+	if (NULL != err) {
+
+		free(info->frame);
+		info->frame = NULL;
+	}
+
+	return err;
 }
 
 
-int main(void)
+// runs verified code from 0 with nothing on the stack, checks only
+// at CAL that the callee finds room, false if it does not
+
+bool vm_fast(const int* code, const struct vm_info* info, int* stack, int size, int* rstack, int rsize, int* ap)
 {
-	int stack[100];
-	int factorial[] = {
+	static const void* ops[NUM_CODES] = {
 
-		LIT, 1,
-		LOD, 1,
-		SUB,
-		JPC, 10,
-		LIT, 1,
-		RET,
-		CAL, 0,	// 10:
-		LOD, 1,
-		MUL,
-		RET
+		[ADD] = &&add, [SUB] = &&sub, [MUL] = &&mul, [DIV] = &&div,
+		[AND] = &&and, [OR] = &&or, [XOR] = &&xor, [NOT] = &&not,
+		[JPC] = &&jpc, [JMP] = &&jmp, [CAL] = &&cal, [RET] = &&ret,
+		[LIT] = &&lit, [INT] = &&int_, [LOD] = &&lod,
+		[ADDI] = &&addi, [SUBI] = &&subi, [MULI] = &&muli, [DIVI] = &&divi,
+		[ANDI] = &&andi, [ORI] = &&ori, [XORI] = &&xori,
+		[ADDL] = &&addl, [SUBL] = &&subl, [MULL] = &&mull, [DIVL] = &&divl,
+		[ANDL] = &&andl, [ORL] = &&orl, [XORL] = &&xorl,
 	};
 
-	printf("%d\n", vm_run(factorial, stack, 0, 0, 7));
-	return 0;
+	const int* frame = info->frame;
+	int i = 0;
+	int t = 0;
+	int r = 0;
+	int a = *ap;
+
+	if (frame[0] > size)
+		return false;
+
+#define NEXT goto *ops[code[i++]]
+
+	NEXT;
+
+add:	a += stack[--t]; NEXT;
+sub:	a -= stack[--t]; NEXT;
+mul:	a *= stack[--t]; NEXT;
+div:	a /= stack[--t]; NEXT;
+and:	a &= stack[--t]; NEXT;
+or:	a |= stack[--t]; NEXT;
+xor:	a ^= stack[--t]; NEXT;
+not:	a = ~a; NEXT;
+jpc:	i = a ? code[i] : i + 1; NEXT;
+jmp:	i = code[i]; NEXT;
+lit:	stack[t++] = a; a = code[i++]; NEXT;
+int_:	t -= code[i++]; NEXT;
+lod:	stack[t] = a; a = stack[t - code[i++]]; t++; NEXT;
+addi:	a = code[i++] + a; NEXT;
+subi:	a = code[i++] - a; NEXT;
+muli:	a = code[i++] * a; NEXT;
+divi:	a = code[i++] / a; NEXT;
+andi:	a = code[i++] & a; NEXT;
+ori:	a = code[i++] | a; NEXT;
+xori:	a = code[i++] ^ a; NEXT;
+addl:	a = stack[t - code[i++]] + a; NEXT;
+subl:	a = stack[t - code[i++]] - a; NEXT;
+mull:	a = stack[t - code[i++]] * a; NEXT;
+divl:	a = stack[t - code[i++]] / a; NEXT;
+andl:	a = stack[t - code[i++]] & a; NEXT;
+orl:	a = stack[t - code[i++]] | a; NEXT;
+xorl:	a = stack[t - code[i++]] ^ a; NEXT;
+
+cal:
+	if ((frame[code[i]] > size - t) || (r + 2 > rsize))
+		return false;
+
+	rstack[r++] = i + 1;
+	rstack[r++] = t;
+	i = code[i];
+	NEXT;
+
+ret:
+	if (0 == r) {
+
+		*ap = a;
+		return true;
+	}
+
+	t = rstack[--r];
+	i = rstack[--r];
+	NEXT;
+#undef NEXT
+}
+
+
+/*
+ * optimizer
+ */
+
+struct insn {
+
+	int op;
+	int k;
+	int start;	// in the old code
+};
+
+static bool commutes(int op)
+{
+	return (ADD == op) || (MUL == op) || (AND == op) || (OR == op) || (XOR == op);
+}
+
+// k op a, false if it would trap
+
+static bool fold(int op, int k, int a, int* r)
+{
+	switch (op) {
+	case ADD: *r = (unsigned int)k + (unsigned int)a; break;
+	case SUB: *r = (unsigned int)k - (unsigned int)a; break;
+	case MUL: *r = (unsigned int)k * (unsigned int)a; break;
+	case DIV:
+
+		if ((0 == a) || ((INT_MIN == k) && (-1 == a)))
+			return false;
+
+		*r = k / a;
+		break;
+
+	case AND: *r = k & a; break;
+	case OR : *r = k | a; break;
+	case XOR: *r = k ^ a; break;
+	}
+
+	return true;
+}
+
+// merge x into the instruction p before it
+
+static bool merge(struct insn* p, const struct insn* x, const bool* target)
+{
+	int r;
+
+	if (target[x->start])
+		return false;
+
+	switch (x->op) {
+	case ADD ... XOR:
+
+		if (LIT == p->op) {
+
+			p->op = IMM(x->op);
+			return true;
+		}
+
+		// LOD 0 would be a op a
+		if ((LOD == p->op) && (p->k > 0)) {
+
+			p->op = SLOT(x->op);
+			return true;
+		}
+
+		break;
+
+	case NOT:
+
+		if (LIT == p->op) {
+
+			p->k = ~p->k;
+			return true;
+		}
+
+		break;
+
+	case ADDI ... XORI:;
+
+		int op = x->op - ADDI + ADD;
+
+		if ((LIT == p->op) && fold(op, x->k, p->k, &r)) {
+
+			p->k = r;
+			return true;
+		}
+
+		if ((x->op == p->op) && commutes(op) && fold(op, p->k, x->k, &r)) {
+
+			p->k = r;
+			return true;
+		}
+
+		break;
+	}
+
+	return false;
+}
+
+// rewrites valid code into out, which has room for len words,
+// returns the new length
+
+int vm_optimize(const int* code, int len, int* out)
+{
+	bool target[len];
+	struct insn ins[len];
+	int map[len];
+	int n = 0;
+
+	for (int i = 0; i < len; i++)
+		target[i] = false;
+
+	target[0] = true;
+
+	for (int i = 0; i < len; i += operand(code[i]) ? 2 : 1)
+		if ((JPC == code[i]) || (JMP == code[i]) || (CAL == code[i]))
+			target[code[i + 1]] = true;
+
+	// constants are folded into the instructions that follow
+
+	for (int i = 0; i < len; i += operand(code[i]) ? 2 : 1) {
+
+		ins[n++] = (struct insn){ code[i], operand(code[i]) ? code[i + 1] : 0, i };
+
+		while ((n > 1) && merge(&ins[n - 2], &ins[n - 1], target))
+			n--;
+	}
+
+	int m = 0;
+
+	for (int j = 0; j < n; j++) {
+
+		map[ins[j].start] = m;
+		out[m++] = ins[j].op;
+
+		if (operand(ins[j].op))
+			out[m++] = ins[j].k;
+	}
+
+	for (int j = 0; j < m; j += operand(out[j]) ? 2 : 1)
+		if ((JPC == out[j]) || (JMP == out[j]) || (CAL == out[j]))
+			out[j + 1] = map[out[j + 1]];
+
+	// jumps to jumps
+
+	for (int j = 0; j < m; j += operand(out[j]) ? 2 : 1) {
+
+		if ((JPC != out[j]) && (JMP != out[j]))
+			continue;
+
+		int l = out[j + 1];
+
+		for (int c = 0; (c < m) && (JMP == out[l]); c++)
+			l = out[l + 1];
+
+		out[j + 1] = l;
+	}
+
+	return m;
+}
+
+
+#ifdef __x86_64__
+/*
+ * copy-and-patch jit
+ *
+ * Every instruction is a stencil, a function in a section of its
+ * own which the linker brackets with __start_ and __stop_ symbols.
+ * Stencils take the stack pointer, the accumulator, the end of the
+ * stack and the limit of the machine stack in registers and
+ * continue by a tail call to hole_next() or hole_jump(), CAL calls
+ * hole_call(). The operand is a constant HOLE which the compiler
+ * cannot see through. The jit copies the stencils one after another
+ * and patches the rel32 of the jumps and calls to the holes and the
+ * constant. A jump to the next stencil at the end is dropped.
+ *
+ * Calls are native calls. CAL fails if the callee does not find
+ * room on the stack or the machine stack is below the limit, and
+ * the failure, -1 instead of the accumulator, returns through all
+ * calls, so that jit_run() can report it as vm_fast() does. The
+ * limit is RLIMIT_STACK below the frame of the first vm_jit(), which
+ * only holds on the main thread: the stacks of other threads have
+ * sizes of their own, so the jitted code must run on the main thread.
+ *
+ * jit_init() decodes the stencils and there is no jit if a stencil
+ * refers to anything outside of it but the holes, e.g. a part the
+ * compiler moved into .text.unlikely, as the copy would break. Nor
+ * is there one if the compiler did not turn the continuations into
+ * jumps, as without optimization.
+ */
+
+// the accumulator, zero extended, or -1 if the stack ran out
+
+typedef long jit_fun_t(int* s, int a, int* end, char* limit);
+
+#define MAGIC 0x5eed1e55
+
+#define HOLE ({ int k; __asm__ ("mov $0x5eed1e55, %0" : "=r" (k)); k; })
+
+#define RSP ({ char* sp; __asm__ volatile ("mov %%rsp, %0" : "=r" (sp)); sp; })
+
+// calls of the jitted code stop this far above the end of the
+// machine stack, see jit_init()
+
+#define JIT_MARGIN (256 << 10)
+
+static char* jit_limit;
+
+#define JIT_HEAD 16	// keeps the code aligned
+
+__attribute__((noipa)) static long hole_next(int* s, int a, int* end, char* limit) { __builtin_trap(); }
+__attribute__((noipa)) static long hole_jump(int* s, int a, int* end, char* limit) { __builtin_trap(); }
+__attribute__((noipa)) static long hole_call(int* s, int a, int* end, char* limit) { __builtin_trap(); }
+
+#define STENCIL(x)								\
+	extern const char __start_st_##x[], __stop_st_##x[];		\
+	__attribute__((section("st_" #x), used, noinline))			\
+	static long stencil_##x(int* s, int a, int* end, char* limit)
+
+#define NEXT return hole_next(s, a, end, limit)
+
+// slots are addressed with the operand as byte offset
+
+#define SLOT_AT(s) (*(int*)((char*)(s) + HOLE))
+
+STENCIL(add) { a += *--s; NEXT; }
+STENCIL(sub) { a -= *--s; NEXT; }
+STENCIL(mul) { a *= *--s; NEXT; }
+STENCIL(div) { a /= *--s; NEXT; }
+STENCIL(and) { a &= *--s; NEXT; }
+STENCIL(or) { a |= *--s; NEXT; }
+STENCIL(xor) { a ^= *--s; NEXT; }
+STENCIL(not) { a = ~a; NEXT; }
+STENCIL(jpc) { if (a) return hole_jump(s, a, end, limit); NEXT; }
+STENCIL(jmp) { return hole_jump(s, a, end, limit); }
+
+STENCIL(cal)
+{
+	if (((char*)end - (char*)s < HOLE) || (RSP < limit))
+		return -1;
+
+	long r = hole_call(s, a, end, limit);
+
+	if (r < 0)
+		return r;
+
+	a = r;
+	NEXT;
 }
 
+STENCIL(ret) { return (unsigned int)a; }
+STENCIL(lit) { *s++ = a; a = HOLE; NEXT; }
+STENCIL(int) { s = (int*)((char*)s + HOLE); NEXT; }
+STENCIL(lod) { *s = a; a = SLOT_AT(s); s++; NEXT; }
+STENCIL(addi) { a = HOLE + a; NEXT; }
+STENCIL(subi) { a = HOLE - a; NEXT; }
+STENCIL(muli) { a = HOLE * a; NEXT; }
+STENCIL(divi) { a = HOLE / a; NEXT; }
+STENCIL(andi) { a = HOLE & a; NEXT; }
+STENCIL(ori) { a = HOLE | a; NEXT; }
+STENCIL(xori) { a = HOLE ^ a; NEXT; }
+STENCIL(addl) { a = SLOT_AT(s) + a; NEXT; }
+STENCIL(subl) { a = SLOT_AT(s) - a; NEXT; }
+STENCIL(mull) { a = SLOT_AT(s) * a; NEXT; }
+STENCIL(divl) { a = SLOT_AT(s) / a; NEXT; }
+STENCIL(andl) { a = SLOT_AT(s) & a; NEXT; }
+STENCIL(orl) { a = SLOT_AT(s) | a; NEXT; }
+STENCIL(xorl) { a = SLOT_AT(s) ^ a; NEXT; }
 
+#undef NEXT
+#undef SLOT_AT
+#undef RSP
 
 
+enum hole { H_NEXT, H_JUMP, H_CALL, H_OPERAND, NUM_HOLES };
+
+static struct stencil {
+
+	const char* start;
+	const char* stop;
+	int at[NUM_HOLES];	// offset of the rel32 or constant, or -1
+	bool tail;		// ends with the jump to the next
+
+} stencils[NUM_CODES] = {
+
+#define ST(op, x) [op] = { __start_st_##x, __stop_st_##x }
+	ST(ADD, add), ST(SUB, sub), ST(MUL, mul), ST(DIV, div),
+	ST(AND, and), ST(OR, or), ST(XOR, xor), ST(NOT, not),
+	ST(JPC, jpc), ST(JMP, jmp), ST(CAL, cal), ST(RET, ret),
+	ST(LIT, lit), ST(INT, int), ST(LOD, lod),
+	ST(ADDI, addi), ST(SUBI, subi), ST(MULI, muli), ST(DIVI, divi),
+	ST(ANDI, andi), ST(ORI, ori), ST(XORI, xori),
+	ST(ADDL, addl), ST(SUBL, subl), ST(MULL, mull), ST(DIVL, divl),
+	ST(ANDL, andl), ST(ORL, orl), ST(XORL, xorl),
+#undef ST
+};
+
+static int32_t get32(const char* p)
+{
+	int32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static void put32(char* p, int32_t v)
+{
+	memcpy(p, &v, 4);
+}
+
+// length of the x86-64 instruction at p, and where a rel8 or rel32
+// of a branch or a RIP-relative displacement is in it. false for
+// instructions the compilers do not emit for the stencils
+
+struct x86 {
+
+	int len;
+	int rel;	// offset, or -1
+	int size;	// of the displacement
+	bool call;
+	bool branch;
+};
+
+static bool x86_decode(const unsigned char* p, int n, struct x86* x)
+{
+	int i = 0;
+	bool o16 = false;
+	bool rexw = false;
+
+	*x = (struct x86){ .rel = -1 };
+
+	while ((i < n) && ((0x66 == p[i]) || (0xf2 == p[i]) || (0xf3 == p[i]) || (0x2e == p[i]) || (0x3e == p[i])))
+		o16 |= (0x66 == p[i++]);
+
+	if ((i < n) && (0x40 == (p[i] & 0xf0)))
+		rexw = p[i++] & 8;
+
+	if (i >= n)
+		return false;
+
+	int op = p[i++];
+
+	if (0x0f == op) {
+
+		if (i >= n)
+			return false;
+
+		op = 0x100 | p[i++];
+	}
+
+	int z = o16 ? 2 : 4;
+	bool modrm = false;
+	int imm = 0;
+	int rel = 0;
+
+	switch (op) {
+	case 0x00 ... 0x3f:
+
+		switch (op & 7) {
+		case 0 ... 3: modrm = true; break;
+		case 4: imm = 1; break;
+		case 5: imm = z; break;
+		default: return false;
+		}
+
+		break;
+
+	case 0x50 ... 0x5f:
+	case 0x90 ... 0x99:
+	case 0xc3:
+	case 0xc9:
+	case 0xcc:
+	case 0x10b:			// ud2
+		break;
+	case 0x6a:
+	case 0xa8:
+	case 0xb0 ... 0xb7:
+		imm = 1;
+		break;
+	case 0x68:
+	case 0xa9:
+		imm = z;
+		break;
+	case 0xb8 ... 0xbf:
+		imm = rexw ? 8 : z;
+		break;
+	case 0x63:
+	case 0x84 ... 0x8b:
+	case 0x8d:
+	case 0x8f:
+	case 0xd0 ... 0xd3:
+	case 0xf6 ... 0xf7:		// immediate for test below
+	case 0xfe ... 0xff:
+	case 0x11e ... 0x11f:		// endbr64, nop
+	case 0x140 ... 0x14f:
+	case 0x190 ... 0x19f:
+	case 0x1af:
+	case 0x1b6 ... 0x1b7:
+	case 0x1be ... 0x1bf:
+		modrm = true;
+		break;
+	case 0x6b:
+	case 0x80:
+	case 0x83:
+	case 0xc0 ... 0xc1:
+	case 0xc6:
+		modrm = true;
+		imm = 1;
+		break;
+	case 0x69:
+	case 0x81:
+	case 0xc7:
+		modrm = true;
+		imm = z;
+		break;
+	case 0x70 ... 0x7f:
+	case 0xeb:
+		rel = 1;
+		break;
+	case 0xe8:
+	case 0xe9:
+	case 0x180 ... 0x18f:
+		rel = 4;
+		break;
+	default:
+		return false;
+	}
+
+	if (modrm) {
+
+		if (i >= n)
+			return false;
+
+		int m = p[i++];
+		int mod = m >> 6;
+		int rm = m & 7;
+
+		if ((0xf6 == op) || (0xf7 == op))
+			imm = (((m >> 3) & 7) < 2) ? ((0xf6 == op) ? 1 : z) : 0;
+
+		if (3 != mod) {
+
+			if (4 == rm) {
+
+				if (i >= n)
+					return false;
+
+				if ((0 == mod) && (5 == (p[i] & 7)))
+					i += 4;
+
+				i++;
+
+			} else if ((0 == mod) && (5 == rm)) {
+
+				x->rel = i;
+				x->size = 4;
+				i += 4;
+			}
+
+			i += (1 == mod) ? 1 : (2 == mod) ? 4 : 0;
+		}
+	}
+
+	if (0 != rel) {
+
+		x->rel = i;
+		x->size = rel;
+		x->call = (0xe8 == op);
+		x->branch = true;
+		i += rel;
+	}
+
+	x->len = i + imm;
+
+	return x->len <= n;
+}
+
+// finds the holes in the stencils, false if one is not as expected
+
+static bool jit_init(void)
+{
+	static jit_fun_t* const holes[] = { [H_NEXT] = hole_next, [H_JUMP] = hole_jump, [H_CALL] = hole_call };
+
+	for (int op = 0; op < NUM_CODES; op++) {
+
+		struct stencil* st = &stencils[op];
+		int len = st->stop - st->start;
+
+		for (int h = 0; h < NUM_HOLES; h++)
+			st->at[h] = -1;
+
+		for (int j = 0; j + 4 <= len; j++) {
+
+			if (MAGIC != get32(st->start + j))
+				continue;
+
+			if (-1 != st->at[H_OPERAND])
+				return false;
+
+			st->at[H_OPERAND] = j;
+		}
+
+		struct x86 x;
+
+		for (int j = 0; j < len; j += x.len) {
+
+			const char* p = st->start + j;
+
+			if (!x86_decode((const unsigned char*)p, len - j, &x))
+				return false;
+
+			if (-1 == x.rel)
+				continue;
+
+			const char* to = p + x.len + ((4 == x.size) ? get32(p + x.rel) : (signed char)p[x.rel]);
+
+			if ((to >= st->start) && (to < st->stop))
+				continue;
+
+			// only the holes are outside, continuations must be tail calls
+
+			int h = 0;
+
+			while ((h < H_OPERAND) && (to != (const char*)holes[h]))
+				h++;
+
+			if ((H_OPERAND == h) || !x.branch || (4 != x.size) || ((H_CALL == h) != x.call))
+				return false;
+
+			if (-1 != st->at[h])
+				return false;
+
+			st->at[h] = j + x.rel;
+		}
+
+		st->tail = (st->at[H_NEXT] == len - 4) && (0xe9 == (unsigned char)st->start[len - 5]);
+
+		bool need_next = (JMP != op) && (RET != op);
+
+		if (need_next != (-1 != st->at[H_NEXT]))
+			return false;
+
+		if (((JPC == op) || (JMP == op)) != (-1 != st->at[H_JUMP]))
+			return false;
+
+		if ((CAL == op) != (-1 != st->at[H_CALL]))
+			return false;
+
+		if ((operand(op) && (JPC != op) && (JMP != op)) != (-1 != st->at[H_OPERAND]))
+			return false;
+	}
+
+	// below the frames of the caller and what the environment takes
+
+	struct rlimit rl;
+	long size = 8l << 20;
+
+	if ((0 == getrlimit(RLIMIT_STACK, &rl)) && (RLIM_INFINITY != rl.rlim_cur))
+		size = rl.rlim_cur;
+
+	jit_limit = (char*)__builtin_frame_address(0) - size + JIT_MARGIN;
+
+	return true;
+}
+
+static int jit_size(int op, int next)
+{
+	const struct stencil* st = &stencils[op];
+
+	return st->stop - st->start - ((st->tail && next) ? 5 : 0);
+}
+
+// translates verified code, NULL if the stencils are not usable
+
+jit_fun_t* vm_jit(const int* code, int len, const struct vm_info* info)
+{
+	static bool init = false;
+	static bool ok = false;
+
+	if (!init) {
+
+		ok = jit_init();
+		init = true;
+	}
+
+	if (!ok)
+		return NULL;
+
+	// the end gets a RET for code which is never reached
+
+	int addr[len + 1];
+	int size = 0;
+
+	for (int i = 0; i < len; i += operand(code[i]) ? 2 : 1) {
+
+		int n = i + (operand(code[i]) ? 2 : 1);
+
+		addr[i] = size;
+		size += jit_size(code[i], n < len);
+	}
+
+	addr[len] = size;
+	size += jit_size(RET, false);
+
+	// the size of the mapping is kept in front for jit_free()
+
+	char* buf = mmap(NULL, JIT_HEAD + size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (MAP_FAILED == buf)
+		return NULL;
+
+	*(long*)buf = JIT_HEAD + size;
+	buf += JIT_HEAD;
+
+	memcpy(buf + addr[len], stencils[RET].start, jit_size(RET, false));
+
+	for (int i = 0; i < len; i += operand(code[i]) ? 2 : 1) {
+
+		int op = code[i];
+		int k = operand(op) ? code[i + 1] : 0;
+		int n = i + (operand(op) ? 2 : 1);
+		const struct stencil* st = &stencils[op];
+		char* p = buf + addr[i];
+
+		memcpy(p, st->start, jit_size(op, n < len));
+
+		int to = ((JPC == op) || (JMP == op) || (CAL == op)) ? addr[k] : 0;
+		int target[NUM_HOLES] = { [H_NEXT] = addr[n], [H_JUMP] = to, [H_CALL] = to };
+
+		for (int h = 0; h < H_OPERAND; h++)
+			if ((-1 != st->at[h]) && !((H_NEXT == h) && st->tail && (n < len)))
+				put32(p + st->at[h], target[h] - (addr[i] + st->at[h] + 4));
+
+		switch (op) {
+		case LIT:
+		case ADDI ... XORI:
+			put32(p + st->at[H_OPERAND], k);
+			break;
+		case LOD:
+		case INT:
+		case ADDL ... XORL:
+			put32(p + st->at[H_OPERAND], -k * (int)sizeof(int));
+			break;
+		case CAL:
+			put32(p + st->at[H_OPERAND], info->frame[k] * (int)sizeof(int));
+			break;
+		}
+	}
+
+	// never writable and executable at the same time
+
+	if (0 != mprotect(buf - JIT_HEAD, JIT_HEAD + size, PROT_READ | PROT_EXEC)) {
+
+		munmap(buf - JIT_HEAD, JIT_HEAD + size);
+		return NULL;
+	}
+
+	return (jit_fun_t*)buf;
+}
+
+void jit_free(jit_fun_t* jit)
+{
+	char* buf = (char*)jit - JIT_HEAD;
+
+	munmap(buf, *(long*)buf);
+}
+
+// runs code from vm_jit(), false if a stack is too small
+
+bool jit_run(jit_fun_t* jit, const struct vm_info* info, int* stack, int size, int* ap)
+{
+	if (info->frame[0] > size)
+		return false;
+
+	long r = jit(stack, *ap, stack + size, jit_limit);
+
+	if (r < 0)
+		return false;
+
+	*ap = r;
+	return true;
+}
+#endif
+
+
+static int factorial[] = {
+
+	LIT, 1,
+	LOD, 1,
+	SUB,
+	JPC, 10,
+	LIT, 1,
+	RET,
+	CAL, 0,	// 10:
+	LOD, 1,
+	MUL,
+	RET
+};
+
+// recursion as deep as its argument, which it returns
+
+static int depth[] = {
+
+	JPC, 3,
+	RET,
+	LIT, 1,	// 3:
+	LOD, 1,
+	SUB,
+	CAL, 0,
+	LIT, 1,
+	ADD,
+	RET
+};
+
+
+static double timestamp(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1.E-9;
+}
+
+
+int main(int argc, char* argv[])
+{
+	enum { RECURSIVE, FAST, JIT } engine = FAST;
+	long reps = 1;
+	long size = 1 << 22;
+	bool optimize = false;
+	int c;
+
+	while (-1 != (c = getopt(argc, argv, "e:n:s:O"))) {
+
+		switch (c) {
+		case 'e':
+			if (0 == strcmp(optarg, "recursive"))
+				engine = RECURSIVE;
+			else if (0 == strcmp(optarg, "fast"))
+				engine = FAST;
+#ifdef __x86_64__
+			else if (0 == strcmp(optarg, "jit"))
+				engine = JIT;
+#endif
+			else
+				goto usage;
+			break;
+		case 'n': reps = atol(optarg); break;
+		case 's': size = atol(optarg); break;
+		case 'O': optimize = true; break;
+		default:
+		usage:
+			fprintf(stderr, "usage: %s [-e recursive|fast|jit] [-n repetitions] [-s stack words] [-O] [factorial|depth] [arg]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	int* code = factorial;
+	int len = sizeof(factorial) / sizeof(int);
+	int arg = 7;
+
+	if (optind < argc) {
+
+		if (0 == strcmp(argv[optind], "depth")) {
+
+			code = depth;
+			len = sizeof(depth) / sizeof(int);
+
+		} else if (0 != strcmp(argv[optind], "factorial")) {
+
+			goto usage;
+		}
+
+		if (optind + 1 < argc)
+			arg = atoi(argv[optind + 1]);
+	}
+
+	struct vm_info info;
+	int pc;
+	const char* err = vm_verify(code, len, &info, &pc);
+
+	if (NULL != err) {
+
+		fprintf(stderr, "%s at %d\n", err, pc);
+		return 1;
+	}
+
+	int* opt = NULL;
+
+	if (optimize) {
+
+		opt = malloc(len * sizeof(int));
+
+		int olen = vm_optimize(code, len, opt);
+
+		free(info.frame);
+
+		if (NULL != (err = vm_verify(opt, olen, &info, &pc))) {
+
+			fprintf(stderr, "optimized: %s at %d\n", err, pc);
+			return 1;
+		}
+
+#ifdef VM_COUNT
+		int* tmp = malloc(size * sizeof(int));
+
+		vm_steps = 0;
+		vm_run(code, tmp, 0, 0, arg);
+
+		long before = vm_steps;
+
+		vm_steps = 0;
+		vm_run(opt, tmp, 0, 0, arg);
+
+		free(tmp);
+
+		printf("%d -> %d words, %ld -> %ld instructions\n", len, olen, before, vm_steps);
+#else
+		printf("%d -> %d words\n", len, olen);
+#endif
+
+		code = opt;
+		len = olen;
+	}
+
+	long rsize = 2 * size;
+
+	// without recursion we know what is needed
+
+	if (-1 != info.depth) {
+
+		size = info.depth;
+		rsize = 2 * info.nest;
+	}
+
+#ifdef __x86_64__
+	jit_fun_t* jit = NULL;
+
+	if ((JIT == engine) && (NULL == (jit = vm_jit(code, len, &info)))) {
+
+		fprintf(stderr, "jit not available\n");
+		return 1;
+	}
+#endif
+
+	int* stack = malloc((size + 1) * sizeof(int));
+	int* rstack = malloc((rsize + 1) * sizeof(int));
+	int res = 0;
+
+	double t0 = timestamp();
+
+	for (long k = 0; k < reps; k++) {
+
+		switch (engine) {
+		case RECURSIVE:
+			res = vm_run(code, stack, 0, 0, arg);
+			break;
+		case FAST:
+			res = arg;
+
+			if (!vm_fast(code, &info, stack, size, rstack, rsize, &res)) {
+
+				fprintf(stderr, "stack overflow\n");
+				return 1;
+			}
+
+			break;
+		case JIT:
+#ifdef __x86_64__
+			res = arg;
+
+			if (!jit_run(jit, &info, stack, size, &res)) {
+
+				fprintf(stderr, "stack overflow\n");
+				return 1;
+			}
+#endif
+			break;
+		}
+	}
+
+	double t1 = timestamp();
+
+	printf("%d\n", res);
+
+	if (reps > 1)
+		printf("%.1f ns per run\n", 1.E9 * (t1 - t0) / reps);
+
+#ifdef __x86_64__
+	if (NULL != jit)
+		jit_free(jit);
+#endif
+	free(stack);
+	free(rstack);
+	free(info.frame);
+	free(opt);
+
+	return 0;
+}
 
@@ -0,0 +1,94 @@
+/*
+ * byte code of the stack machine and its reference interpreter
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ *
+ * Shared by stackvm.c and the translator to tiny vm, whose names
+ * collide with these. There every name gets the prefix SVM_, as
+ * SVM_PREFIX is defined before this is included.
+ */
+
+#ifndef __STACKVM_H
+#define __STACKVM_H 1
+
+#include <stdbool.h>
+#include <assert.h>
+
+#ifdef SVM_PREFIX
+#define SVM(x) SVM_##x
+#else
+#define SVM(x) x
+#endif
+
+enum SVM(byte_code) {
+
+	SVM(ADD), SVM(SUB), SVM(MUL), SVM(DIV),
+	SVM(AND), SVM(OR) , SVM(XOR), SVM(NOT),
+	SVM(JPC), SVM(JMP), SVM(CAL), SVM(RET),
+	SVM(LIT), SVM(INT), SVM(LOD),
+
+	// made by vm_optimize(), a = k op a and a = stack[t - n] op a
+	SVM(ADDI), SVM(SUBI), SVM(MULI), SVM(DIVI),
+	SVM(ANDI), SVM(ORI) , SVM(XORI),
+	SVM(ADDL), SVM(SUBL), SVM(MULL), SVM(DIVL),
+	SVM(ANDL), SVM(ORL) , SVM(XORL),
+
+	SVM(NUM_CODES)
+};
+
+
+#ifdef VM_COUNT
+// instructions executed by vm_run()
+extern long vm_steps;
+#endif
+
+static inline int SVM(vm_run)(const int* code, int* stack, int i, int t, int a)
+{
+	int pop(void) { return stack[--t]; }
+	void push(int x) { stack[t++] = x; }
+	int load(void) { return code[i++]; }
+
+	while (true) {
+#ifdef VM_COUNT
+		vm_steps++;
+#endif
+		switch (load()) {
+
+		case SVM(ADD): { a += pop(); } break;
+		case SVM(SUB): { a -= pop(); } break;
+		case SVM(MUL): { a *= pop(); } break;
+		case SVM(DIV): { a /= pop(); } break;
+		case SVM(AND): { a &= pop(); } break;
+		case SVM(OR) : { a |= pop(); } break;
+		case SVM(XOR): { a ^= pop(); } break;
+		case SVM(NOT): { a = ~a; } break;
+		case SVM(JPC): { int l = load(); if (a) i = l; } break;
+		case SVM(JMP): { i = load(); } break;
+		case SVM(LIT): { push(a); a = load(); } break;
+		case SVM(INT): { t -= load(); } break;
+		case SVM(LOD): { push(a); a = stack[t - 1 - load()]; } break;
+		case SVM(CAL): { a = SVM(vm_run)(code, stack, load(), t, a); } break;
+		case SVM(RET): { return a; } break;
+		case SVM(ADDI): { a = load() + a; } break;
+		case SVM(SUBI): { a = load() - a; } break;
+		case SVM(MULI): { a = load() * a; } break;
+		case SVM(DIVI): { a = load() / a; } break;
+		case SVM(ANDI): { a = load() & a; } break;
+		case SVM(ORI) : { a = load() | a; } break;
+		case SVM(XORI): { a = load() ^ a; } break;
+		case SVM(ADDL): { a = stack[t - load()] + a; } break;
+		case SVM(SUBL): { a = stack[t - load()] - a; } break;
+		case SVM(MULL): { a = stack[t - load()] * a; } break;
+		case SVM(DIVL): { a = stack[t - load()] / a; } break;
+		case SVM(ANDL): { a = stack[t - load()] & a; } break;
+		case SVM(ORL) : { a = stack[t - load()] | a; } break;
+		case SVM(XORL): { a = stack[t - load()] ^ a; } break;
+
+		default: assert(0);
+		}
+
+		assert(t >= 0);
+	}
+}
+
+#endif
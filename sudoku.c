@@ -3,11 +3,29 @@
  *
    gcc -Wall -std=c11 -O3 -osudoku sudoku.c
  *
+ * usage: sudoku [-e naive|mrv] [-n repetitions] [puzzle]
+ *
+ * The puzzle is given as 81 digits row by row, 0 or . for empty.
+ *
+ * The naive engine fills the cells in order. The mrv engine keeps
+ * the candidates of every cell as a bit mask. After each placement
+ * it places naked singles (cells with one candidate) and hidden
+ * singles (digits with one place in a row, column or block) until
+ * nothing changes, and then branches on the cell with the fewest
+ * candidates. Changes go on a trail and are undone by popping it.
+ *
  * Author: Martin Uecker <uecker@eecs.berkeley.edu>
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
 
 // #define ALL
 
@@ -82,7 +100,7 @@ out:
 	return false;
 }
 
-bool sudoku(int board[9][9])
+static bool sudoku_naive(int board[9][9])
 {
 	int rows[9] = { 0 };
 	int cols[9] = { 0 };
@@ -106,8 +124,298 @@ bool sudoku(int board[9][9])
 	return sudoku_r(board, rows, cols, blks, 0, 0);
 }
 
-int main(void)
+
+
+// candidates use the bits 1 to 9 as the masks above
+
+#define DIGITS 0x3fe
+
+static int units[27][9];
+static int peers[81][20];
+
+static void init_tables(void)
+{
+	for (int i = 0; i < 9; i++) {
+
+		for (int j = 0; j < 9; j++) {
+
+			units[i][j] = i * 9 + j;
+			units[9 + j][i] = i * 9 + j;
+			units[18 + block(i, j)][(i % 3) * 3 + j % 3] = i * 9 + j;
+		}
+	}
+
+	for (int c = 0; c < 81; c++) {
+
+		int n = 0;
+
+		for (int d = 0; d < 81; d++)
+			if ((d != c) && ((d / 9 == c / 9) || (d % 9 == c % 9) || (block(d / 9, d % 9) == block(c / 9, c % 9))))
+				peers[c][n++] = d;
+	}
+}
+
+struct grid {
+
+	int* board;
+	uint16_t cand[81];	// of empty cells
+
+	int ntrail;
+	struct {
+
+		uint8_t cell;
+		bool placed;
+		uint16_t cand;
+
+	} trail[81 * 21];
+};
+
+static void undo(struct grid* g, int mark)
+{
+	while (g->ntrail > mark) {
+
+		g->ntrail--;
+
+		int c = g->trail[g->ntrail].cell;
+
+		g->cand[c] = g->trail[g->ntrail].cand;
+
+		if (g->trail[g->ntrail].placed)
+			g->board[c] = 0;
+	}
+}
+
+static void save(struct grid* g, int c, bool placed)
+{
+	g->trail[g->ntrail].cell = c;
+	g->trail[g->ntrail].placed = placed;
+	g->trail[g->ntrail].cand = g->cand[c];
+	g->ntrail++;
+}
+
+// false if a peer is left without candidates
+
+static bool assign(struct grid* g, int c, int n)
+{
+	if (!(g->cand[c] & (1 << n)))
+		return false;
+
+	save(g, c, true);
+	g->board[c] = n;
+	g->cand[c] = 0;
+
+	for (int i = 0; i < 20; i++) {
+
+		int p = peers[c][i];
+
+		if (!(g->cand[p] & (1 << n)))
+			continue;
+
+		save(g, p, false);
+		g->cand[p] &= ~(1 << n);
+
+		if (0 == g->cand[p])
+			return false;
+	}
+
+	return true;
+}
+
+static bool propagate(struct grid* g)
 {
+	bool changed;
+
+	do {
+		changed = false;
+
+		// naked singles
+
+		for (int c = 0; c < 81; c++) {
+
+			if ((0 != g->board[c]) || (1 != __builtin_popcount(g->cand[c])))
+				continue;
+
+			if (!assign(g, c, __builtin_ctz(g->cand[c])))
+				return false;
+
+			changed = true;
+		}
+
+		// hidden singles
+
+		for (int u = 0; u < 27; u++) {
+
+			int once = 0;
+			int twice = 0;
+			int placed = 0;
+
+			for (int i = 0; i < 9; i++) {
+
+				int c = units[u][i];
+
+				twice |= once & g->cand[c];
+				once |= g->cand[c];
+				placed |= 1 << g->board[c];
+			}
+
+			if (DIGITS != ((once | placed) & DIGITS))
+				return false;
+
+			for (int single = once & ~twice & ~placed; 0 != single; single &= single - 1) {
+
+				int n = __builtin_ctz(single);
+
+				for (int i = 0; i < 9; i++) {
+
+					int c = units[u][i];
+
+					if (g->cand[c] & (1 << n)) {
+
+						if (!assign(g, c, n))
+							return false;
+
+						break;
+					}
+				}
+
+				changed = true;
+			}
+		}
+
+	} while (changed);
+
+	return true;
+}
+
+static bool search(struct grid* g)
+{
+	if (!propagate(g))
+		return false;
+
+	int best = -1;
+
+	for (int c = 0; c < 81; c++) {
+
+		if (0 != g->board[c])
+			continue;
+
+		if ((-1 == best) || (__builtin_popcount(g->cand[c]) < __builtin_popcount(g->cand[best])))
+			best = c;
+	}
+
+	if (-1 == best) {
+#ifdef ALL
+		puts("--");
+		print_board((int(*)[9])g->board);
+		return false;
+#else
+		return true;
+#endif
+	}
+
+	for (int m = g->cand[best]; 0 != m; m &= m - 1) {
+
+		int mark = g->ntrail;
+
+		if (assign(g, best, __builtin_ctz(m)) && search(g))
+			return true;
+
+		undo(g, mark);
+	}
+
+	return false;
+}
+
+static bool sudoku_mrv(int board[9][9])
+{
+	static bool init = false;
+
+	if (!init) {
+
+		init_tables();
+		init = true;
+	}
+
+	static struct grid g;
+	int given[81];
+
+	g.board = &board[0][0];
+	g.ntrail = 0;
+
+	for (int c = 0; c < 81; c++) {
+
+		given[c] = g.board[c];
+		g.board[c] = 0;
+		g.cand[c] = DIGITS;
+	}
+
+	for (int c = 0; c < 81; c++) {
+
+		if ((0 != given[c]) && !assign(&g, c, given[c])) {
+
+			memcpy(g.board, given, sizeof(given));
+			return false;
+		}
+	}
+
+	if (search(&g))
+		return true;
+
+	undo(&g, 0);
+	memcpy(g.board, given, sizeof(given));
+
+	return false;
+}
+
+
+enum sudoku_engine { SUDOKU_NAIVE, SUDOKU_MRV };
+
+enum sudoku_engine sudoku_engine = SUDOKU_MRV;
+
+bool sudoku(int board[9][9])
+{
+	switch (sudoku_engine) {
+	case SUDOKU_NAIVE:
+		return sudoku_naive(board);
+	case SUDOKU_MRV:
+		return sudoku_mrv(board);
+	}
+
+	return false;
+}
+
+
+static double timestamp(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1.E-9;
+}
+
+int main(int argc, char* argv[])
+{
+	long reps = 1;
+	int c;
+
+	while (-1 != (c = getopt(argc, argv, "e:n:"))) {
+
+		switch (c) {
+		case 'e':
+			if (0 == strcmp(optarg, "naive"))
+				sudoku_engine = SUDOKU_NAIVE;
+			else if (0 == strcmp(optarg, "mrv"))
+				sudoku_engine = SUDOKU_MRV;
+			else
+				goto usage;
+			break;
+		case 'n': reps = atol(optarg); break;
+		default:
+		usage:
+			fprintf(stderr, "usage: %s [-e naive|mrv] [-n repetitions] [puzzle]\n", argv[0]);
+			return 1;
+		}
+	}
+
 	int board[9][9] = {
 
 		{ 5, 3, 0,  0, 7, 0,  0, 0, 0 },
@@ -123,10 +431,49 @@ int main(void)
 		{ 0, 0, 0,  0, 8, 0,  0, 7, 9 },
 	};
 
-	sudoku(board);
+	if (optind < argc) {
+
+		const char* p = argv[optind];
+
+		if (81 != strlen(p))
+			goto usage;
+
+		for (int i = 0; i < 81; i++) {
+
+			if ('.' == p[i])
+				board[i / 9][i % 9] = 0;
+			else if (('0' <= p[i]) && (p[i] <= '9'))
+				board[i / 9][i % 9] = p[i] - '0';
+			else
+				goto usage;
+		}
+	}
+
+	int puzzle[9][9];
+	memcpy(puzzle, board, sizeof(board));
+
+	bool ok = false;
+	double t0 = timestamp();
+
+	for (long k = 0; k < reps; k++) {
+
+		memcpy(board, puzzle, sizeof(board));
+		ok = sudoku(board);
+	}
+
+	double t1 = timestamp();
+
 #ifndef ALL
+	if (!ok)
+		puts("no solution");
+
 	print_board(board);
+#else
+	(void)ok;
 #endif
-	return 0;	
+	if (reps > 1)
+		printf("%.1f us per run\n", 1.E6 * (t1 - t0) / reps);
+
+	return 0;
 }
 
@@ -0,0 +1,179 @@
+/*
+ * run the factorial of stackvm.c translated to tiny vm
+ *
+   gcc -std=gnu11 -Wall -O2 -osvm2tvm svm2tvm.c tinyvm/cpu.c tinyvm/asm.c tinyvm/bbc.c tinyvm/jit.c tinyvm/engine.c tinyvm/progs.c tinyvm/cc.c tinyvm/svm.c
+ *
+ * usage: svm2tvm [-e engine] [-i isa] [-n repetitions] [arg]
+ *
+ * Only the built-in factorial is translated. The byte code runs
+ * under vm_run() of stackvm.c and, after the translation for the
+ * instruction set (2), under every engine or only the one given,
+ * all results must agree. Prints the time per run of each and the
+ * speedup over vm_run(). The block cache and the jit are created
+ * once, so that their caches are warm and only the translated code
+ * is timed. For the same reason the runs start at a second prelude
+ * on a page of its own: the first one shares its page with the
+ * stack, so every push would drop its translation.
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <time.h>
+
+#include "tinyvm/cpu.h"
+#include "tinyvm/asm.h"
+#include "tinyvm/progs.h"
+#include "tinyvm/bbc.h"
+#include "tinyvm/jit.h"
+#include "tinyvm/svm.h"
+
+
+#define MEM_SIZE 100000
+#define START 50000
+#define ENTRY (START - 80)	// on a page of its own
+#define SLICE 100000		// fuel of bbc-fuel
+
+
+static double timestamp(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1.E-9;
+}
+
+
+// the translated code under one engine, the time per run
+
+static double run(const struct vm_engine* e, mem_t* mem, long reps, int arg, reg_t* res)
+{
+	struct bbc* bbc = NULL;
+	struct jit* jit = NULL;
+
+	if ((vm_bbc == e->run) || (vm_bbc_fuel == e->run))
+		bbc = bbc_create(mem);
+#ifdef __x86_64__
+	if (vm_jit == e->run)
+		jit = jit_create(mem, false);
+#endif
+
+	reg_t regs[256];
+
+	double t0 = timestamp();
+
+	for (long k = 0; k < reps; k++) {
+
+		memset(regs, 0, sizeof(regs));
+		regs[IP] = ENTRY;
+		regs[RR] = arg;
+
+		if (vm_bbc_fuel == e->run) {
+
+			long fuel;
+
+			do {
+				fuel = SLICE;
+
+			} while (VM_FUEL == bbc_run_fuel(bbc, regs, &fuel));
+
+		} else if (NULL != bbc) {
+
+			bbc_run(bbc, regs);
+#ifdef __x86_64__
+		} else if (NULL != jit) {
+
+			jit_run(jit, regs);
+#endif
+		} else {
+
+			e->run(regs, mem);
+		}
+	}
+
+	double t1 = timestamp();
+
+	if (NULL != bbc)
+		bbc_free(bbc);
+#ifdef __x86_64__
+	if (NULL != jit)
+		jit_free(jit);
+#endif
+
+	*res = regs[RR];
+
+	return (t1 - t0) / reps;
+}
+
+
+int main(int argc, char* argv[])
+{
+	const char* engine = NULL;
+	long reps = 1000000;
+	int c;
+
+	asm_isa(2);
+
+	while (-1 != (c = getopt(argc, argv, "e:i:n:"))) {
+
+		switch (c) {
+		case 'e': engine = optarg; break;
+		case 'i': asm_isa(atoi(optarg)); break;
+		case 'n': reps = atol(optarg); break;
+		default:
+		usage:
+			fprintf(stderr, "usage: %s [-e engine] [-i isa] [-n repetitions] [arg]\n", argv[0]);
+			fprintf(stderr, "translates the built-in factorial only\n");
+			return 1;
+		}
+	}
+
+	if (((NULL != engine) && (NULL == vm_engine(engine))) || (reps < 1))
+		goto usage;
+
+	int arg = (optind < argc) ? atoi(argv[optind]) : 7;
+
+	static ins2_t mm[MEM_SIZE];
+	int words = assemble(mm, START, factorial_svm);
+
+	ins2_t* p = mm + ENTRY;
+	prelude(&p, START);
+
+	static int stack[MEM_SIZE];
+	int res = 0;
+
+	double t0 = timestamp();
+
+	for (long k = 0; k < reps; k++)
+		res = SVM_vm_run(svm_factorial, stack, 0, 0, arg);
+
+	double t = (timestamp() - t0) / reps;
+
+	printf("%d words of tiny vm code\n", words);
+	printf("vm_run:\t%d\t%.1f ns per run\n", res, 1.E9 * t);
+
+	bool ok = true;
+
+	for (const struct vm_engine* e = vm_engines; NULL != e->name; e++) {
+
+		if ((NULL != engine) && (0 != strcmp(engine, e->name)))
+			continue;
+
+		reg_t r;
+		double te = run(e, (mem_t*)mm, reps, arg, &r);
+
+		printf("%s:\t%ld\t%.1f ns per run\tspeedup: %.2f\n", e->name, (long)r, 1.E9 * te, t / te);
+
+		if (res != r) {
+
+			fprintf(stderr, "results differ\n");
+			ok = false;
+		}
+	}
+
+	return ok ? 0 : 1;
+}
@@ -28,22 +28,58 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
 
 #include "cpu.h"
 #include "asm.h"
 
 
+static void peep(ins2_t** p);
+
+static int isa = 1;
+
+// select the instruction set, 1 or 2
+
+void asm_isa(int v)
+{
+	assert((1 == v) || (2 == v));
+	isa = v;
+}
+
+static bool imm8(reg_t v)
+{
+	return (v >= -128) && (v < 128);
+}
+
+static void put(ins2_t** p, ins2_t i)
+{
+	*(*p)++ = i;
+	peep(p);
+}
+
 static void insn(ins2_t** p, unsigned char u, unsigned char v, unsigned char w, unsigned char x)
 {
-	(*p)->b[0] = u;
-	(*p)->b[1] = v;
-	(*p)->b[2] = w;
-	(*p)->b[3] = x;
-	(*p)++;
+	put(p, (ins2_t){ .b = { u, v, w, x } });
 }
 
+// the literal of a LIT, TVM_WORD - 16 bits
 
-const char* instr_names[] = { "stp", "add", "sub", "mul", "div", "mov", "and", "or", "xor", "lit", "sto", "lod", "mov" };
+static ureg_t lit_val(ins2_t i)
+{
+	return (ureg_t)i.w >> 16;
+}
+
+static void lit(ins2_t** p, unsigned char a, ureg_t l)
+{
+	put(p, (ins2_t){ .w = (ins_t)((l << 16) | (a << 8) | LIT) });
+}
+
+
+const char* instr_names[] = { "stp", "add", "sub", "mul", "div", "mod", "and", "or", "xor", "lit", "sto", "lod", "mov", "clo", "cal",
+				"addi", "ldd", "std", "bnz", "blz", "liw", "sys",
+				"cas", "xadd", "fence", "spawn" };
 const char* reg_names[] = { "ip", "sp", "ar", "c0", "c1", "fp", "rr", "--", "u0", "u1", "u2", "u3", "u4", "u5", "u6", "u7" };
 
 
@@ -51,14 +87,42 @@ void insn_print(ins2_t x)
 {
 	switch (x.b[0]) {
 	case STP:
-		printf("stp\n");
+	case FENCE:
+		printf("%s\n", instr_names[x.b[0]]);
 		break;
-	case STO ... MOV:
+	case STO ... CAL:
 	case ADD ... XOR:
-		printf("%s %s %s %s\n", instr_names[x.b[0]], reg_names[x.b[1]], reg_names[x.b[2]], reg_names[x.b[3]]);
+	case CAS:
+	case XADD:
+	case SPAWN:
+		if ((x.b[1] > 15) || (x.b[2] > 15) || (x.b[3] > 15))
+			printf("%s r%d r%d r%d\n", instr_names[x.b[0]], x.b[1], x.b[2], x.b[3]);
+		else
+			printf("%s %s %s %s\n", instr_names[x.b[0]], reg_names[x.b[1]], reg_names[x.b[2]], reg_names[x.b[3]]);
 		break;
 	case LIT:
-		printf("%s %s %d\n", instr_names[x.b[0]], reg_names[x.b[1]], (reg_t)(x.b[3]) * 256 + (reg_t)(x.b[2]));
+		if (x.b[1] > 15)
+			printf("%s r%d %llu\n", instr_names[x.b[0]], x.b[1], (unsigned long long)lit_val(x));
+		else
+			printf("%s %s %llu\n", instr_names[x.b[0]], reg_names[x.b[1]], (unsigned long long)lit_val(x));
+		break;
+	case ADDI ... STD:
+	case SYS:
+		if ((x.b[1] > 15) || (x.b[2] > 15))
+			printf("%s r%d r%d %d\n", instr_names[x.b[0]], x.b[1], x.b[2], (int8_t)x.b[3]);
+		else
+			printf("%s %s %s %d\n", instr_names[x.b[0]], reg_names[x.b[1]], reg_names[x.b[2]], (int8_t)x.b[3]);
+		break;
+	case BNZ ... LIW:
+		if (x.b[1] > 15)
+			printf("%s r%d", instr_names[x.b[0]], x.b[1]);
+		else
+			printf("%s %s", instr_names[x.b[0]], reg_names[x.b[1]]);
+
+		if (LIW != x.b[0])
+			printf(" %d", (int16_t)((x.b[3] << 8) | x.b[2]));
+
+		printf("\n");
 		break;
 	default:
 		printf("NOA %d %d %d %d\n", x.b[0], x.b[1], x.b[2], x.b[3]);
@@ -69,20 +133,764 @@ void insn_print(ins2_t x)
 
 
 void move(ins2_t** p, unsigned char a, unsigned char b) { insn(p, MOV, C1, a, b); }
+// if c, a = b
+void cmove(ins2_t** p, unsigned char c, unsigned char a, unsigned char b) { insn(p, MOV, c, a, b); }
 void peek(ins2_t** p, unsigned char a, unsigned char b) { insn(p, LOD, a, b, C0); }
 void poke(ins2_t** p, unsigned char a, unsigned char b) { insn(p, STO, a, b, C0); }
 
-void cnst(ins2_t** p, unsigned char a, unsigned int b) 
+/*
+ * peephole
+ *
+ * Each instruction emitted into the main stream is looked at
+ * together with the ones before it, back to the last barrier.
+ * Barriers are labels, here(), relative jumps, references to
+ * labels and instructions which read or write IP, so addresses
+ * which were handed out and the distance between a call and its
+ * return point never change. SYS, atomics and SPAWN are barriers
+ * too, the host or other threads work on memory behind them.
+ * Within such a window:
+ *
+ * push a; pop b		-> mov b a, the slot above SP is dead
+ * cnst r k			-> nothing if r is known to be k
+ * cnst r k; ...; cnst r j	-> the first goes if r is not read
+ * add r r s; sub r r s		-> nothing
+ * addi r r k; addi r r j	-> addi r r k+j, nothing if it is 0
+ * add r r s			-> nothing if s is known to be 0
+ * leave; ret			-> one pop less, FP is used as base
+ *
+ * C0 and C1 are assumed to hold 0 and 1, as the ABI requires.
+ * The first, the fourth and the last have forms for version 2.
+ * Chains of add r r C1 are only merged in version 2, as version 1
+ * has no register which holds 2.
+ */
+
+enum { P_PUSHPOP, P_CNST, P_DEAD, P_CANCEL, P_MERGE, P_ZERO, P_LEAVE, P_MAX };
+
+static const char* pnames[P_MAX] = {
+
+	[P_PUSHPOP] = "push/pop",
+	[P_CNST] = "cnst",
+	[P_DEAD] = "dead cnst",
+	[P_CANCEL] = "add/sub",
+	[P_MERGE] = "addi/addi",
+	[P_ZERO] = "add 0",
+	[P_LEAVE] = "leave/ret",
+};
+
+static struct {
+
+	bool on;
+	int off;	// writing outside of the stream
+	ins2_t* win;
+	ins2_t* tail;
+	ins2_t* def[256];	// last cnst not read since
+	int deflen[256];
+	long removed[P_MAX];
+
+} pp;
+
+struct known {
+
+	unsigned char kind[256];	// 0 unknown, 1 low half, 2 all
+	ureg_t val[256];
+};
+
+
+static void barrier_at(ins2_t* at)
+{
+	pp.win = at;
+	pp.tail = at;
+	memset(pp.def, 0, sizeof(pp.def));
+}
+
+static void barrier(ins2_t** p)
 {
-	if (0 == b) {
+	if (pp.on)
+		barrier_at(*p);
+}
 
-		insn(p, XOR, a, a, a);
+static void known_step(struct known* k, ins2_t i)
+{
+	unsigned char a = i.b[1];
+	unsigned char b = i.b[2];
+	unsigned char c = i.b[3];
 
-	} else {
+	ureg_t x = k->val[b];
+	ureg_t y = k->val[c];
+
+	switch (i.b[0]) {
+	case ADD ... XOR:
+
+		if ((XOR == i.b[0]) && (b == c)) {
+
+			k->kind[a] = 2;
+			k->val[a] = 0;
+			break;
+		}
+
+		if ((2 != k->kind[b]) || (2 != k->kind[c])
+		    || (((DIV == i.b[0]) || (MOD == i.b[0])) && ((0 == y) || ((ureg_t)-1 == y)))) {
+
+			k->kind[a] = 0;
+			break;
+		}
+
+		switch (i.b[0]) {
+		case ADD: x = x + y; break;
+		case SUB: x = x - y; break;
+		case MUL: x = x * y; break;
+		case DIV: x = (reg_t)x / (reg_t)y; break;
+		case MOD: x = (reg_t)x % (reg_t)y; break;
+		case AND: x = x & y; break;
+		case OR:  x = x | y; break;
+		case XOR: x = x ^ y; break;
+		}
+
+		k->kind[a] = 2;
+		k->val[a] = x;
+		break;
+
+	case LIT:
+
+		if (k->kind[a] > 0) {
+
+			k->val[a] = ((k->val[a] & 0xFFFF) << (TVM_WORD - 16)) + lit_val(i);
+			k->kind[a] = 2;
+
+		} else {
+
+			k->val[a] = lit_val(i);
+			k->kind[a] = 1;
+		}
+
+		break;
+
+	case MOV:
+
+		if (2 != k->kind[a]) {
+
+			k->kind[b] = 0;
+
+		} else if (0 != k->val[a]) {
+
+			k->kind[b] = k->kind[c];
+			k->val[b] = k->val[c];
+		}
+
+		break;
+
+	case ADDI:
+
+		k->kind[a] = (2 == k->kind[b]) ? 2 : 0;
+		k->val[a] = x + (int8_t)c;
+		break;
+
+	case LOD:
+	case CAL:
+	case LDD:
+	case LIW:
+	case SYS ... XADD:
+	case SPAWN:
+		k->kind[a] = 0;
+		break;
+	}
+}
+
+// what is known before the instruction at end
+
+static void known(struct known* k, ins2_t* end)
+{
+	memset(k->kind, 0, sizeof(k->kind));
+
+	k->kind[C0] = 2;
+	k->val[C0] = 0;
+	k->kind[C1] = 2;
+	k->val[C1] = 1;
+
+	for (ins2_t* i = pp.win; i < end; i++)
+		known_step(k, *i);
+}
+
+static bool match(ins2_t i, enum byte_code op, int a, int b, int c)
+{
+	return (op == i.b[0]) && ((-1 == a) || (a == i.b[1])) && ((-1 == b) || (b == i.b[2])) && ((-1 == c) || (c == i.b[3]));
+}
+
+// registers read, a conditional move also reads its target
+
+static bool reads(ins2_t i, unsigned char r)
+{
+	switch (i.b[0]) {
+	case ADD ... XOR:
+	case LOD:
+		return (r == i.b[2]) || (r == i.b[3]);
+	case LIT:
+		return (r == i.b[1]);
+	case MOV:
+	case STO:
+	case CLO:
+	case CAS:
+		return (r == i.b[1]) || (r == i.b[2]) || (r == i.b[3]);
+	case XADD:
+		return (r == i.b[2]) || (r == i.b[3]);
+	case SPAWN:
+		return true;	// all are copied
+	case CAL:
+	case STD:
+		return (r == i.b[1]) || (r == i.b[2]);
+	case ADDI:
+	case LDD:
+	case SYS:
+		return (r == i.b[2]);
+	case BNZ:
+	case BLZ:
+		return (r == i.b[1]) || (IP == r);
+	case LIW:
+		return (IP == r);
+	}
+
+	return false;
+}
+
+static bool writes(ins2_t i, unsigned char r)
+{
+	switch (i.b[0]) {
+	case ADD ... LIT:
+	case LOD:
+		return (r == i.b[1]);
+	case MOV:
+		return (r == i.b[2]);
+	case CAL:
+	case LIW:
+		return (r == i.b[1]) || (IP == r);
+	case ADDI:
+	case LDD:
+	case SYS ... XADD:
+	case SPAWN:
+		return (r == i.b[1]);
+	case BNZ:
+	case BLZ:
+		return (IP == r);
+	}
+
+	return false;
+}
+
+// cut off the stream at t
+
+static void truncate(ins2_t** p, ins2_t* t, int pattern)
+{
+	pp.removed[pattern] += *p - t;
+
+	for (int r = 0; r < 256; r++)
+		if (pp.def[r] >= t)
+			pp.def[r] = NULL;
+
+	*p = t;
+	pp.tail = t;
+}
+
+static void peep(ins2_t** p)
+{
+	if (!pp.on || pp.off)
+		return;
+
+	ins2_t* at = *p - 1;
 
-		insn(p, LIT, a, (b >> 16) % 256, (b >> 24) % 256);
-		insn(p, LIT, a, (b >> 0) % 256, (b >> 8) % 256);
+	if (at != pp.tail)	// somewhere else
+		barrier_at(at);
+
+	pp.tail = *p;
+
+	ins2_t i = *at;
+
+	if (reads(i, IP) || writes(i, IP) || (STP == i.b[0]) || ((SYS <= i.b[0]) && (i.b[0] <= SPAWN))) {
+
+		barrier_at(*p);
+		return;
+	}
+
+	long n = *p - pp.win;
+	ins2_t* t = *p;
+
+	if ((match(i, ADD, -1, i.b[1], -1) || match(i, SUB, -1, i.b[1], -1)) && (i.b[1] != i.b[3])) {
+
+		struct known k;
+		known(&k, at);
+
+		if ((2 == k.kind[i.b[3]]) && (0 == k.val[i.b[3]])) {
+
+			truncate(p, at, P_ZERO);
+			return;
+		}
+	}
+
+	for (int r = 0; r < 256; r++)
+		if ((NULL != pp.def[r]) && (reads(i, r) || writes(i, r)))
+			pp.def[r] = NULL;
+
+	if ((n >= 2) && (i.b[1] == i.b[2]) && (i.b[1] != i.b[3])
+	    && ((match(t[-2], ADD, i.b[1], i.b[1], i.b[3]) && match(i, SUB, -1, -1, -1))
+		|| (match(t[-2], SUB, i.b[1], i.b[1], i.b[3]) && match(i, ADD, -1, -1, -1)))) {
+
+		truncate(p, t - 2, P_CANCEL);
+		return;
+	}
+
+	if ((n >= 2) && match(i, ADDI, i.b[1], i.b[1], -1) && match(t[-2], ADDI, i.b[1], i.b[1], -1)) {
+
+		int k = (int8_t)t[-2].b[3] + (int8_t)i.b[3];
+		unsigned char a = i.b[1];
+
+		if (0 == k) {
+
+			truncate(p, t - 2, P_CANCEL);
+			return;
+		}
+
+		if (imm8(k)) {
+
+			truncate(p, t - 2, P_MERGE);
+
+			// may merge with the one before again
+			ins2_t* q = *p;
+			insn(&q, ADDI, a, a, (uint8_t)k);
+			pp.removed[P_MERGE]--;
+			*p = q;
+			return;
+		}
+	}
+
+	if ((n >= 4) && match(t[-4], ADD, SP, SP, C1) && match(t[-3], STO, SP, -1, C0)
+	    && match(t[-2], SUB, SP, SP, C1) && match(t[-1], LOD, -1, SP, C1)
+	    && (SP != t[-3].b[2]) && (SP != t[-1].b[1])) {
+
+		unsigned char a = t[-3].b[2];
+		unsigned char b = t[-1].b[1];
+
+		truncate(p, t - 4, P_PUSHPOP);
+
+		if (a != b) {
+
+			ins2_t* q = *p;
+			insn(&q, MOV, C1, b, a);
+			pp.removed[P_PUSHPOP]--;
+			*p = q;
+		}
+
+		return;
+	}
+
+	if ((n >= 4) && match(t[-4], ADDI, SP, SP, 1) && match(t[-3], STD, SP, -1, 0)
+	    && match(t[-2], ADDI, SP, SP, 255) && match(t[-1], LDD, -1, SP, 1)
+	    && (SP != t[-3].b[2]) && (SP != t[-1].b[1])) {
+
+		unsigned char a = t[-3].b[2];
+		unsigned char b = t[-1].b[1];
+
+		truncate(p, t - 4, P_PUSHPOP);
+
+		if (a != b) {
+
+			ins2_t* q = *p;
+			insn(&q, MOV, C1, b, a);
+			pp.removed[P_PUSHPOP]--;
+			*p = q;
+		}
+
+		return;
+	}
+
+	// move SP FP; pop FP; [move RR x]; pop AR
+
+	int m = ((n >= 6) && match(t[-3], MOV, C1, RR, -1)
+		&& (SP != t[-3].b[3]) && (FP != t[-3].b[3]) && (AR != t[-3].b[3])) ? 1 : 0;
+
+	if ((n >= 5 + m) && match(t[-5 - m], MOV, C1, SP, FP) && match(t[-4 - m], SUB, SP, SP, C1)
+	    && match(t[-3 - m], LOD, FP, SP, C1) && match(t[-2], SUB, SP, SP, C1) && match(t[-1], LOD, AR, SP, C1)) {
+
+		ins2_t mv = t[-3];
+
+		truncate(p, t - 5 - m, P_LEAVE);
+
+		ins2_t* q = *p;
+
+		pp.off++;
+		insn(&q, SUB, SP, FP, C1);
+		insn(&q, LOD, AR, SP, C0);
+		insn(&q, LOD, FP, FP, C0);
+		insn(&q, SUB, SP, SP, C1);
+
+		if (m)
+			*q++ = mv;
+
+		pp.off--;
+
+		pp.removed[P_LEAVE] -= q - *p;
+		*p = q;
+		pp.tail = q;
+		return;
+	}
+
+	if ((n >= 5 + m) && match(t[-5 - m], MOV, C1, SP, FP) && match(t[-4 - m], ADDI, SP, SP, 255)
+	    && match(t[-3 - m], LDD, FP, SP, 1) && match(t[-2], ADDI, SP, SP, 255) && match(t[-1], LDD, AR, SP, 1)) {
+
+		ins2_t mv = t[-3];
+
+		truncate(p, t - 5 - m, P_LEAVE);
+
+		ins2_t* q = *p;
+
+		pp.off++;
+		insn(&q, LDD, AR, FP, 255);
+		insn(&q, ADDI, SP, FP, 254);
+		insn(&q, LDD, FP, FP, 0);
+
+		if (m)
+			*q++ = mv;
+
+		pp.off--;
+
+		pp.removed[P_LEAVE] -= q - *p;
+		*p = q;
+		pp.tail = q;
+		return;
+	}
+}
+
+// true if the constant is not needed
+
+static bool peep_cnst(ins2_t** p, unsigned char a, ureg_t b, int size)
+{
+	if (!pp.on || pp.off)
+		return false;
+
+	if (*p != pp.tail)
+		barrier_at(*p);
+
+	if ((C0 == a) || (C1 == a))
+		return false;
+
+	struct known k;
+	known(&k, *p);
+
+	if ((2 == k.kind[a]) && (b == k.val[a])) {
+
+		pp.removed[P_CNST] += size;
+		return true;
 	}
+
+	ins2_t* d = pp.def[a];
+
+	if ((NULL != d) && (d >= pp.win)) {
+
+		int len = pp.deflen[a];
+
+		memmove(d, d + len, (*p - (d + len)) * sizeof(ins2_t));
+
+		for (int r = 0; r < 256; r++)
+			if (pp.def[r] > d)
+				pp.def[r] -= len;
+
+		pp.def[a] = NULL;
+		pp.removed[P_DEAD] += len;
+		*p -= len;
+		pp.tail = *p;
+	}
+
+	return false;
+}
+
+void peephole(bool on)
+{
+	pp.on = on;
+	pp.tail = NULL;
+	memset(pp.removed, 0, sizeof(pp.removed));
+}
+
+void peep_report(void)
+{
+	for (int i = 0; i < P_MAX; i++)
+		printf("%-10s %ld removed\n", pnames[i], pp.removed[i]);
+}
+
+
+/*
+ * relaxation
+ *
+ * In relaxed mode a program is assembled several times. Every
+ * cnst() is a site which is given the size that the value it had
+ * at the end of the previous pass needs, and branch offsets are
+ * computed from these sizes. Passes are repeated until no site
+ * changes its size. After a few passes sites may only grow, which
+ * ends oscillations.
+ *
+ * LIT shifts the old contents of its register, so a single LIT is
+ * only right if the low half of the register is known to be zero.
+ * The short forms therefore compute 0, 1, 2 and -1 from the ABI
+ * constants in C0 and C1 instead.
+ *
+ * Constants may only be patched through labels or from() in this
+ * mode, as sites are identified by the order of emission.
+ */
+
+#define FREEZE 4
+
+struct site {
+
+	ins2_t* at;
+	unsigned char reg;
+	ureg_t value;
+	int size;
+};
+
+static struct {
+
+	bool on;
+	int pass;
+	int n;		// sites in this pass
+	int last;	// sites in the previous pass
+	int max;
+	struct site* sites;
+
+} rx;
+
+static ins2_t* origin;
+
+static struct {
+
+	int n;
+	int max;
+	ins2_t** at;
+
+} rl;
+
+
+static bool small(unsigned char a, ureg_t b)
+{
+	if (2 == isa)
+		return imm8(b);
+
+	return (0 == b) || ((C0 != a) && (C1 != a) && ((1 == b) || (2 == b) || ((ureg_t)-1 == b)));
+}
+
+static void emit(ins2_t** p, unsigned char a, ureg_t b, int size)
+{
+	if (2 == isa) {
+
+		if (2 == size) {
+
+			insn(p, LIW, a, 0, 0);
+			(*p)++->w = b;	// not an instruction, LIW is a barrier
+
+		} else if (0 == b) {
+
+			insn(p, XOR, a, a, a);
+
+		} else {
+
+			insn(p, ADDI, a, C0, b % 256);	// wrong unless small, grows in the next pass
+		}
+
+		return;
+	}
+
+	if (2 == size) {
+
+		lit(p, a, b >> (TVM_WORD - 16));
+		lit(p, a, b & (((ureg_t)1 << (TVM_WORD - 16)) - 1));
+		return;
+	}
+
+	switch (b) {
+	case 1: insn(p, ADD, a, C0, C1); break;
+	case 2: insn(p, ADD, a, C1, C1); break;
+	case (ureg_t)-1: insn(p, SUB, a, C0, C1); break;
+	case 0:
+	default: insn(p, XOR, a, a, a); break; // wrong unless 0, grows in the next pass
+	}
+}
+
+// size of the next site
+
+static int next_size(void)
+{
+	if (!rx.on)
+		return 2;
+
+	return (rx.n < rx.last) ? rx.sites[rx.n].size : 2;
+}
+
+static int site(ins2_t* at, unsigned char a, ureg_t b)
+{
+	if (rx.n == rx.max) {
+
+		rx.max = rx.max ? 2 * rx.max : 256;
+		rx.sites = realloc(rx.sites, rx.max * sizeof(struct site));
+	}
+
+	struct site* s = &rx.sites[rx.n];
+
+	if (rx.n >= rx.last)
+		s->size = 2;
+
+	s->at = at;
+	s->reg = a;
+	s->value = b;
+
+	return rx.n++;
+}
+
+// constant of the size other code relies on
+
+static int cnst_fixed(ins2_t** p, unsigned char a, ureg_t b)
+{
+	if (!rx.on) {
+
+		emit(p, a, b, 2);
+		return -1;
+	}
+
+	int k = site(*p, a, b);
+	emit(p, a, b, rx.sites[k].size);
+
+	return k;
+}
+
+static void patch(ins2_t* at, int k, unsigned char a, ureg_t b)
+{
+	int size = 2;
+
+	if ((BNZ == at->b[0]) || (BLZ == at->b[0])) {
+
+		assert((int16_t)b == (reg_t)b);
+		at->b[2] = b % 256;
+		at->b[3] = (b >> 8) % 256;
+		return;
+	}
+
+	if (-1 != k) {
+
+		rx.sites[k].value = b;
+		size = rx.sites[k].size;
+	}
+
+	pp.off++;
+	emit(&at, a, b, size);
+	pp.off--;
+}
+
+
+void cnst(ins2_t** p, unsigned char a, ureg_t b)
+{
+	int size = ((0 == b) || ((2 == isa) && small(a, b))) ? 1 : 2;
+
+	if (rx.on) {
+
+		int k = site(*p, a, b);
+		size = rx.sites[k].size;
+	}
+
+	if (peep_cnst(p, a, b, size))
+		return;
+
+	ins2_t* d = *p;
+
+	emit(p, a, b, size);
+
+	if (pp.on) {
+
+		pp.def[a] = d;
+		pp.deflen[a] = *p - d;
+	}
+}
+
+
+void relax_begin(void)
+{
+	rx.on = true;
+	rx.pass = 0;
+	rx.n = 0;
+	rx.last = 0;
+}
+
+// end of a pass, returns true if another one is needed
+
+bool relax_next(void)
+{
+	bool changed = (rx.n != rx.last);
+
+	for (int k = 0; k < rx.n; k++) {
+
+		struct site* s = &rx.sites[k];
+
+		int size = small(s->reg, s->value) ? 1 : 2;
+
+		if ((rx.pass >= FREEZE) && (size < s->size))
+			size = s->size;
+
+		changed |= (size != s->size);
+		s->size = size;
+	}
+
+	rx.last = rx.n;
+	rx.n = 0;
+	rx.pass++;
+
+	return changed;
+}
+
+void relax_end(void)
+{
+	rx.on = false;
+	free(rx.sites);
+	rx.sites = NULL;
+	rx.max = 0;
+}
+
+// address 0 of the vm, for absolute addresses of labels
+
+void asm_origin(ins2_t* o)
+{
+	origin = o;
+	rl.n = 0;
+	peephole(pp.on);
+}
+
+
+/*
+ * relocations
+ *
+ * Absolute code addresses are loaded by cnsta() or cnstl() as a
+ * pair of LITs which is never shortened and recorded here, so an
+ * image can be moved by adding to both halves. In version 2 this
+ * is a LIW and the word after it.
+ */
+
+void cnsta(ins2_t** p, unsigned char a, ureg_t b)
+{
+	if (rl.n == rl.max) {
+
+		rl.max = rl.max ? 2 * rl.max : 64;
+		rl.at = realloc(rl.at, rl.max * sizeof(ins2_t*));
+	}
+
+	rl.at[rl.n++] = *p;
+
+	emit(p, a, b, 2);
+	barrier(p);
+}
+
+int asm_nrelocs(void)
+{
+	return rl.n;
+}
+
+// address of the i-th relocated pair relative to the origin
+
+int asm_reloc(int i)
+{
+	return rl.at[i] - origin;
 }
 
 void add(ins2_t** p, unsigned char a, unsigned char b, unsigned char c) { insn(p, ADD, a, b, c); }
@@ -95,35 +903,248 @@ void and(ins2_t** p, unsigned char a, unsigned char b, unsigned char c) { insn(p
 void or(ins2_t** p, unsigned char a, unsigned char b, unsigned char c) { insn(p, OR, a, b, c); }
 void xor(ins2_t** p, unsigned char a, unsigned char b, unsigned char c) { insn(p, XOR, a, b, c); }
 
-void push(ins2_t** p, unsigned char a) { add(p, SP, SP, C1); insn(p, STO, SP, a, C0); }
-void pop(ins2_t** p, unsigned char a) { sub(p, SP, SP, C1); insn(p, LOD, a, SP, C1); }
+// a = b + k, with AR as temporary in version 1
 
-void ret(ins2_t** p) { pop(p, AR); add(p, IP, AR, C1); };
-void retn(ins2_t** p, int s) { pop(p, AR); add(p, IP, AR, C1); if (s) { cnst(p, AR, s); sub(p, SP, SP, AR); } };
+void addi(ins2_t** p, unsigned char a, unsigned char b, int k)
+{
+	if ((2 == isa) && imm8(k)) {
+
+		if ((0 != k) || (a != b))
+			insn(p, ADDI, a, b, k % 256);
+
+		return;
+	}
+
+	if (k >= 0) {
+
+		cnst(p, AR, k);
+		add(p, a, b, AR);
+
+	} else {
+
+		cnst(p, AR, -k);
+		sub(p, a, b, AR);
+	}
+}
+
+// a = mem[b + k], mem[a + k] = b
+
+static void ldk(ins2_t** p, unsigned char a, unsigned char b, int k)
+{
+	if ((2 == isa) && imm8(k)) {
+
+		insn(p, LDD, a, b, k % 256);
+		return;
+	}
+
+	if (k >= 0) {
+
+		cnst(p, AR, k);
+
+	} else {
+
+		cnst(p, AR, -k);
+		sub(p, AR, C0, AR);
+	}
+
+	insn(p, LOD, a, b, AR);
+}
+
+static void stk(ins2_t** p, unsigned char a, int k, unsigned char b)
+{
+	if ((2 == isa) && imm8(k)) {
+
+		insn(p, STD, a, b, k % 256);
+		return;
+	}
+
+	cnst(p, AR, k);
+	insn(p, STO, a, b, AR);
+}
+
+void push(ins2_t** p, unsigned char a) { if (2 == isa) { addi(p, SP, SP, 1); stk(p, SP, 0, a); return; } add(p, SP, SP, C1); insn(p, STO, SP, a, C0); }
+void pop(ins2_t** p, unsigned char a) { if (2 == isa) { addi(p, SP, SP, -1); ldk(p, a, SP, 1); return; } sub(p, SP, SP, C1); insn(p, LOD, a, SP, C1); }
+
+void ret(ins2_t** p) { pop(p, AR); if (2 == isa) addi(p, IP, AR, 1); else add(p, IP, AR, C1); };
+void retn(ins2_t** p, int s) { ret(p); if (2 == isa) addi(p, SP, SP, -s); else if (s) { cnst(p, AR, s); sub(p, SP, SP, AR); } };
 
 // save old frame pointer, save stack pointer in frame pointer, make room for local variables
-void enter(ins2_t** p, int s) { push(p, FP); move(p, FP, SP); cnst(p, AR, s); add(p, SP, SP, AR); }
+void enter(ins2_t** p, int s) { push(p, FP); move(p, FP, SP); if (2 == isa) addi(p, SP, SP, s); else { cnst(p, AR, s); add(p, SP, SP, AR); } }
 // restore stack pointer, restore old frame pointer, move result into return register, return
 void leave(ins2_t** p, unsigned char a) { move(p, SP, FP); pop(p, FP); if (a != RR) move(p, RR, a); ret(p); }
 //void leave(ins2_t** p, unsigned char a) { move(p, SP, FP); pop(p, FP); move(p, RR, a); ret(p); }
 
 void stop(ins2_t** p) { insn(p, STP, 0, 0, 0); }
 
-void cjmp(ins2_t** p, unsigned char a, int b) { cnst(p, AR, b - 3); add(p, AR, IP, AR); insn(p, MOV, a, IP, AR); }
+// IP is behind the ADD when the offset is added, in version 2 behind the branch
+
+static void branch(ins2_t** p, enum byte_code op, unsigned char a, int o)
+{
+	assert((int16_t)o == o);
+
+	barrier(p);
+	insn(p, op, a, o % 256, (o >> 8) % 256);
+}
+
+void cjmp(ins2_t** p, unsigned char a, int b) { if (2 == isa) { branch(p, BNZ, a, b - 1); return; } barrier(p); cnst_fixed(p, AR, b - next_size() - 1); add(p, AR, IP, AR); insn(p, MOV, a, IP, AR); }
 void jump(ins2_t** p, int b) { cjmp(p, C1, b); }
 
-void call(ins2_t** p, int s, unsigned char a) { push(p, C0); push(p, IP); move(p, IP, a); if (s) { cnst(p, AR, s + 1); sub(p, SP, SP, AR); } else sub(p, SP, SP, C1); }
+// drop the static link slot and s arguments after a call
+static void drop(ins2_t** p, int s) { if (2 == isa) addi(p, SP, SP, -(s + 1)); else if (s) { cnst(p, AR, s + 1); sub(p, SP, SP, AR); } else sub(p, SP, SP, C1); }
+
+void call(ins2_t** p, int s, unsigned char a) { push(p, C0); push(p, IP); move(p, IP, a); drop(p, s); }
 //void call(ins2_t** p, int s, unsigned char a) { push(p, IP); move(p, IP, a); if (s) { cnst(p, AR, s); sub(p, SP, SP, AR); }  }
-void call2(ins2_t** p, int s, unsigned char a) { push(p, FP); push(p, IP); move(p, IP, a); if (s) { cnst(p, AR, s + 1); sub(p, SP, SP, AR); } else sub(p, SP, SP, C1); }
+void call2(ins2_t** p, int s, unsigned char a) { push(p, FP); push(p, IP); move(p, IP, a); drop(p, s); }
+// call the closure at a, CAL pushes its static link and the return address
+void callc(ins2_t** p, int s, unsigned char a) { insn(p, CAL, SP, a, C0); drop(p, s); }
 
-void load(ins2_t** p, unsigned char a, int v) { cnst(p, AR, v + 1); insn(p, LOD, a, FP, AR); }
-void store(ins2_t** p, int v, unsigned char a) { cnst(p, AR, v + 1); insn(p, STO, FP, a, AR); }
+void sys(ins2_t** p, unsigned char a, unsigned char b) { insn(p, SYS, a, b, C0); }
+
+void cas(ins2_t** p, unsigned char a, unsigned char b, unsigned char c) { insn(p, CAS, a, b, c); }
+void xadd(ins2_t** p, unsigned char a, unsigned char b, unsigned char c) { insn(p, XADD, a, b, c); }
+void fence(ins2_t** p) { insn(p, FENCE, 0, 0, 0); }
+void spawn(ins2_t** p, unsigned char a, unsigned char b, unsigned char c) { insn(p, SPAWN, a, b, c); }
+// closure of code f and static link e on the stack, its address in a
+void closure(ins2_t** p, unsigned char a, unsigned char f, unsigned char e) { if (2 == isa) { addi(p, a, SP, 1); insn(p, CLO, a, f, e); addi(p, SP, SP, 2); return; } add(p, a, SP, C1); insn(p, CLO, a, f, e); add(p, SP, SP, C1); add(p, SP, SP, C1); }
+
+void load(ins2_t** p, unsigned char a, int v) { if (2 == isa) { ldk(p, a, FP, v + 1); return; } cnst(p, AR, v + 1); insn(p, LOD, a, FP, AR); }
+void store(ins2_t** p, int v, unsigned char a) { if (2 == isa) { stk(p, FP, v + 1, a); return; } cnst(p, AR, v + 1); insn(p, STO, FP, a, AR); }
 //void arg(ins2_t** p, unsigned char a, int v) { cnst(p, AR, v + 2); sub(p, AR, C0, AR); insn(p, LOD, a, FP, AR); }
-void arg(ins2_t** p, unsigned char a, int v) { cnst(p, AR, v + 3); sub(p, AR, C0, AR); insn(p, LOD, a, FP, AR); }
+void arg(ins2_t** p, unsigned char a, int v) { if (2 == isa) { ldk(p, a, FP, -(v + 3)); return; } cnst(p, AR, v + 3); sub(p, AR, C0, AR); insn(p, LOD, a, FP, AR); }
+
+ins2_t* here(ins2_t**p) { barrier(p); return *p; }
+
+// patch the cjmp at j to jump here
+
+void from(ins2_t**p, ins2_t* j)
+{
+	int k = -1;
+	int size = ((BNZ == j->b[0]) || (BLZ == j->b[0])) ? 0 : 2;	// the offset is in the branch
+
+	for (int i = rx.on ? rx.n - 1 : -1; i >= 0; i--) {
+
+		if (j == rx.sites[i].at) {
+
+			k = i;
+			size = rx.sites[i].size;
+			break;
+		}
+	}
+
+	patch(j, k, AR, here(p) - (j + size + 1));
+}
+
 
-ins2_t* here(ins2_t**p) { return *p; }
-void from(ins2_t**p, ins2_t* j) { ins2_t* l = j; cnst(&l, AR, (here(p) - j) - 3); }
-// we overwrite the cnst here: FIXME: cnst may change in size
+// labels
+
+static void fixup(struct label* l, const struct fixup* f)
+{
+	patch(f->at, f->site, f->reg, (NULL != f->ip) ? l->at - f->ip : l->at - origin);
+}
+
+static void label_ref(ins2_t** p, unsigned char a, struct label* l, ins2_t* ip)
+{
+	ureg_t v = -1;
+	struct fixup* f = NULL;
+
+	if (NULL != l->at) {
+
+		v = (NULL != ip) ? l->at - ip : l->at - origin;
+
+	} else {
+
+		assert(l->n < LABEL_FIXUPS);
+
+		f = &l->fix[l->n++];
+		f->at = *p;
+		f->ip = ip;
+		f->reg = a;
+	}
+
+	int k = -1;
+
+	if (NULL != ip)
+		k = cnst_fixed(p, a, v);
+	else
+		cnsta(p, a, v);
+
+	if (NULL != f)
+		f->site = k;
+
+	barrier(p);
+}
+
+void bind(ins2_t** p, struct label* l)
+{
+	barrier(p);
+	l->at = *p;
+
+	for (int i = 0; i < l->n; i++)
+		fixup(l, &l->fix[i]);
+
+	l->n = 0;
+}
+
+// in version 2 a branch op, the offset is patched like a constant
+
+static void branchl(ins2_t** p, enum byte_code op, unsigned char a, struct label* l)
+{
+	int o = 0;
+
+	if (NULL != l->at) {
+
+		o = l->at - (*p + 1);
+
+	} else {
+
+		assert(l->n < LABEL_FIXUPS);
+
+		struct fixup* f = &l->fix[l->n++];
+		f->at = *p;
+		f->ip = *p + 1;
+		f->reg = a;
+		f->site = -1;
+	}
+
+	branch(p, op, a, o);
+}
+
+void cjmpl(ins2_t** p, unsigned char a, struct label* l)
+{
+	if (2 == isa) {
+
+		branchl(p, BNZ, a, l);
+		return;
+	}
+
+	barrier(p);
+	label_ref(p, AR, l, *p + next_size() + 1);
+	add(p, AR, IP, AR);
+	insn(p, MOV, a, IP, AR);
+}
+
+void jumpl(ins2_t** p, struct label* l) { cjmpl(p, C1, l); }
+
+// jump if a is negative, a is changed in version 1
+
+void cjmpnl(ins2_t** p, unsigned char a, struct label* l)
+{
+	if (2 == isa) {
+
+		branchl(p, BLZ, a, l);
+		return;
+	}
+
+	cnst(p, AR, SIGN_BIT);
+	and(p, a, a, AR);
+	cjmpl(p, a, l);
+}
+
+// absolute address of a label
+
+void cnstl(ins2_t** p, unsigned char a, struct label* l) { label_ref(p, a, l, NULL); }
+
+void closurel(ins2_t** p, unsigned char a, struct label* l, unsigned char e) { cnstl(p, AR, l); closure(p, a, AR, e); }
 
 
 void fp(ins2_t** p, int i)
@@ -135,35 +1156,37 @@ void fp(ins2_t** p, int i)
 
 int tramp(ins2_t** p, char r, int v) 
 { 
-	// return address of trampoline in reg r
-
-	move(p, r, SP);
-	add(p, r, r, C1);
-
 	// create code on stack which loads the constant
-	// corresponding to the current frame pointer into RR
+	// corresponding to the current frame pointer into RR,
+	// r is a temporary until the end
 
 //	cnst(&tp, RR, [FP]);
 
+	cnst(p, AR, (ureg_t)1 << (TVM_WORD - 16));
+	adiv(p, r, FP, AR);
 	cnst(p, AR, 256 * 256);
-	mul(p, AR, AR, FP);
-	insn(p, LIT, AR, LIT, RR);
+	mul(p, r, r, AR);
+	cnst(p, AR, RR * 256 + LIT);
+	add(p, AR, AR, r);
 	push(p, AR);
 
 	cnst(p, AR, 256 * 256);
-	mod(p, AR, FP, AR);
-	insn(p, LIT, AR, LIT, RR);
+	mul(p, r, FP, AR);
+	cnst(p, AR, RR * 256 + LIT);
+	add(p, AR, AR, r);
 	push(p, AR);
 
 	// create code to load the static link pointer
 	// and jump to address given in v
 
+	// the address follows the code, so that it can be relocated
+
 	ins2_t t[10];
 	ins2_t* tp = &t[0];
 
 	sub(&tp, AR, C0, C1);
 	insn(&tp, STO, SP, RR, AR);	// we use RR here
-	cnst(&tp, AR, v);
+	insn(&tp, LOD, AR, IP, C1);
 	move(&tp, IP, AR);
 
 	int ts = (int)(tp - &t[0]);
@@ -174,9 +1197,19 @@ int tramp(ins2_t** p, char r, int v)
 		push(p, AR);
 	}		
 
+	cnsta(p, AR, v);
+	push(p, AR);
+
+	// return address of trampoline in reg r
+
+	int size = 2 + ts + 1;
+
+	cnst(p, AR, size - 1);
+	sub(p, r, SP, AR);
+
 	// return the size of the trampoline
 
-	return 2 + ts;
+	return size;
 }
 
 
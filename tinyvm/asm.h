@@ -2,7 +2,12 @@
 
 
 
-typedef union ins2_u ins2_t;
+#include <stdbool.h>
+
+#include "cpu.h"
+
+// sign bit of a word
+#define SIGN_BIT ((ureg_t)1 << (TVM_WORD - 1))
 
 // instruction pointer
 #define IP 0u
@@ -30,17 +35,22 @@ typedef union ins2_u ins2_t;
 #define A4 15u
 
 
-extern void cnst(ins2_t** p, unsigned char a, unsigned int b);
+extern void cnst(ins2_t** p, unsigned char a, ureg_t b);
 extern void move(ins2_t** p, unsigned char a, unsigned char b);
+extern void cmove(ins2_t** p, unsigned char c, unsigned char a, unsigned char b);
+extern void peek(ins2_t** p, unsigned char a, unsigned char b);
+extern void poke(ins2_t** p, unsigned char a, unsigned char b);
 
 extern void add(ins2_t** p, unsigned char a, unsigned char b, unsigned char c);
 extern void sub(ins2_t** p, unsigned char a, unsigned char b, unsigned char c);
 extern void mul(ins2_t** p, unsigned char a, unsigned char b, unsigned char c);
 extern void adiv(ins2_t** p, unsigned char a, unsigned char b, unsigned char c);
+extern void mod(ins2_t** p, unsigned char a, unsigned char b, unsigned char c);
 
 extern void and(ins2_t** p, unsigned char a, unsigned char b, unsigned char c);
 extern void or(ins2_t** p, unsigned char a, unsigned char b, unsigned char c);
 extern void xor(ins2_t** p, unsigned char a, unsigned char b, unsigned char c);
+extern void addi(ins2_t** p, unsigned char a, unsigned char b, int k);
 
 extern void push(ins2_t** p, unsigned char a);
 extern void pop(ins2_t** p, unsigned char a);
@@ -55,6 +65,14 @@ extern void jump(ins2_t** p, int b);
 
 extern void call(ins2_t** p, int s, unsigned char a);
 extern void call2(ins2_t** p, int s, unsigned char a);
+extern void callc(ins2_t** p, int s, unsigned char a);
+extern void closure(ins2_t** p, unsigned char a, unsigned char f, unsigned char e);
+extern void sys(ins2_t** p, unsigned char a, unsigned char b);
+
+extern void cas(ins2_t** p, unsigned char a, unsigned char b, unsigned char c);
+extern void xadd(ins2_t** p, unsigned char a, unsigned char b, unsigned char c);
+extern void fence(ins2_t** p);
+extern void spawn(ins2_t** p, unsigned char a, unsigned char b, unsigned char c);
 
 extern void load(ins2_t** p, unsigned char a, int v);
 extern void store(ins2_t** p, int v, unsigned char a);
@@ -63,6 +81,39 @@ extern void arg(ins2_t** p, unsigned char a, int v);
 extern ins2_t* here(ins2_t**p);
 extern void from(ins2_t**p, ins2_t* j);
 
+#define LABEL_FIXUPS 8
+
+struct label {
+
+	ins2_t* at;		// NULL until bound
+	int n;
+	struct fixup {
+
+		ins2_t* at;	// constant to patch
+		ins2_t* ip;	// relative to, NULL for absolute
+		unsigned char reg;
+		int site;
+	} fix[LABEL_FIXUPS];
+};
+
+extern void bind(ins2_t** p, struct label* l);
+extern void cjmpl(ins2_t** p, unsigned char a, struct label* l);
+extern void jumpl(ins2_t** p, struct label* l);
+extern void cjmpnl(ins2_t** p, unsigned char a, struct label* l);
+extern void cnstl(ins2_t** p, unsigned char a, struct label* l);
+extern void closurel(ins2_t** p, unsigned char a, struct label* l, unsigned char e);
+
+extern void asm_isa(int v);
+extern void asm_origin(ins2_t* o);
+extern void cnsta(ins2_t** p, unsigned char a, ureg_t b);
+extern int asm_nrelocs(void);
+extern int asm_reloc(int i);
+extern void relax_begin(void);
+extern bool relax_next(void);
+extern void relax_end(void);
+extern void peephole(bool on);
+extern void peep_report(void);
+
 extern void fp(ins2_t** p, int i);
 
 
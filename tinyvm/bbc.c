@@ -0,0 +1,849 @@
+/*
+ * basic block cache for tiny cpu
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ *
+ * Code is decoded into basic blocks of pre-decoded instructions
+ * with register operands resolved to pointers. The idioms emitted
+ * by the assembler are fused into superinstructions:
+ *
+ * li32		LIT a, hi; LIT a, lo
+ * push		ADD x, x, y; STO x, v, z
+ * pushi	ADD x, x, y; STO x, IP, z
+ * pop		SUB x, x, y; LOD v, x, z
+ * cjmp		li32 r (or XOR r, r, r); ADD r, IP, r; MOV c, IP, r
+ * call		push; pushi; MOV c, IP, f
+ * ret		pop; ADD IP, v, w
+ * jump		ADD IP, v, w
+ *
+ * The pushes and pops of version 2 with ADDI, STD and LDD fuse
+ * into call and ret too, their immediates are kept in the decoded
+ * instruction and the operands point to them. ADDI IP, v, k is a
+ * jump, which ends the leave of the peephole optimizer.
+ *
+ * CAL ends a block as a call does, and so do the branches of
+ * version 2. LIW becomes li32.
+ *
+ * Other instructions which use IP as an operand, SYS and the
+ * instructions for threads end a block and are executed by the
+ * interpreter. Blocks never cross
+ * a page of 64 words. Pages which contain decoded code are marked in a
+ * bitmap and a store into such a page drops all blocks of the
+ * page, so that code generated at run time (tramp) works.
+ *
+ * bbc_run_fuel() runs at most *fuel instructions. A block is
+ * charged all its instructions when it is entered, and gets back
+ * the ones it did not run if it is left early after a store into
+ * code. If the rest of the fuel does not cover the next block,
+ * its instructions are run one by one by the interpreter. The
+ * result VM_FUEL means the fuel is used up exactly and IP is at
+ * the next instruction, so that the run can be continued.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "asm.h"
+#include "bbc.h"
+
+#if 32 != TVM_WORD
+#error "only for 32 bit words"
+#endif
+
+
+#define PAGE_BITS 6
+#define PAGE_SIZE (1 << PAGE_BITS)
+#define HASH_BITS 12
+#define HASH_SIZE (1 << HASH_BITS)
+#define CHUNK_BITS 16
+#define BBC_SLICE 100000
+
+enum kind {
+
+	K_ADD, K_SUB, K_MUL, K_DIV, K_MOD, K_AND, K_OR, K_XOR,
+	K_LIT, K_MOV, K_LOD, K_STO, K_CLO, K_CAL,
+	K_ADDI, K_LDD, K_STD, K_BNZ, K_BLZ,
+	K_LI32, K_PUSH, K_PUSHI, K_POP,
+	K_CJMP, K_CALL, K_RET, K_JUMP,
+	K_IPOP, K_STOP, K_FALL,
+	K_NUM
+};
+
+struct dins {
+
+	const void* op;
+	reg_t *a, *b, *c, *d, *e, *f;
+	reg_t imm;
+	reg_t k[3];		// immediates as operands
+	reg_t addr;
+	reg_t end;
+	int done;		// instructions of the block up to here
+};
+
+struct block {
+
+	struct block* next;
+	reg_t addr;
+	int n;
+	int cost;		// instructions
+	struct dins ins[];
+};
+
+struct bbc {
+
+	mem_t* mem;
+	reg_t* regs;		// operands point into this register file
+	uint64_t* code[1 << (32 - PAGE_BITS - CHUNK_BITS)];	// pages with decoded code
+	struct block* dead;	// invalidated but maybe still running
+	struct block* tmp;	// room for the longest block
+	struct block* tab[HASH_SIZE];
+};
+
+
+static unsigned int hash(reg_t addr)
+{
+	return ((uint32_t)addr * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static uint32_t page(reg_t addr)
+{
+	return (uint32_t)addr >> PAGE_BITS;
+}
+
+static bool is_code(const struct bbc* c, reg_t addr)
+{
+	uint32_t p = page(addr);
+	const uint64_t* m = c->code[p >> CHUNK_BITS];
+
+	return (NULL != m) && (m[(p % (1 << CHUNK_BITS)) / 64] & (1ull << (p % 64)));
+}
+
+static void mark_code(struct bbc* c, reg_t addr, bool set)
+{
+	uint32_t p = page(addr);
+	uint64_t** m = &c->code[p >> CHUNK_BITS];
+
+	if (NULL == *m) {
+
+		if (!set)
+			return;
+
+		*m = calloc((1 << CHUNK_BITS) / 64, sizeof(uint64_t));
+	}
+
+	uint64_t* w = &(*m)[(p % (1 << CHUNK_BITS)) / 64];
+
+	*w = set ? (*w | (1ull << (p % 64))) : (*w & ~(1ull << (p % 64)));
+}
+
+
+struct bbc* bbc_create(mem_t* mem)
+{
+	struct bbc* c = calloc(1, sizeof(struct bbc));
+
+	c->mem = mem;
+	c->tmp = malloc(sizeof(struct block) + (PAGE_SIZE + 1) * sizeof(struct dins));
+
+	return c;
+}
+
+static void reap(struct bbc* c)
+{
+	while (NULL != c->dead) {
+
+		struct block* b = c->dead;
+		c->dead = b->next;
+		free(b);
+	}
+}
+
+static void flush(struct bbc* c)
+{
+	for (int i = 0; i < HASH_SIZE; i++) {
+
+		while (NULL != c->tab[i]) {
+
+			struct block* b = c->tab[i];
+			c->tab[i] = b->next;
+			free(b);
+		}
+	}
+
+	reap(c);
+}
+
+void bbc_free(struct bbc* c)
+{
+	flush(c);
+
+	for (unsigned int i = 0; i < sizeof(c->code) / sizeof(c->code[0]); i++)
+		free(c->code[i]);
+
+	free(c->tmp);
+	free(c);
+}
+
+// drop all blocks starting in the page of addr
+
+static void invalidate(struct bbc* c, reg_t addr)
+{
+	uint32_t p = page(addr);
+
+	mark_code(c, addr, false);
+
+	for (uint32_t a = p << PAGE_BITS; a < (p + 1) << PAGE_BITS; a++) {
+
+		struct block** bp = &c->tab[hash(a)];
+
+		while (NULL != *bp) {
+
+			struct block* b = *bp;
+
+			if (b->addr == (reg_t)a) {
+
+				*bp = b->next;
+				b->next = c->dead;
+				c->dead = b;
+
+			} else {
+
+				bp = &b->next;
+			}
+		}
+	}
+}
+
+
+
+static bool uses_ip(ins2_t i)
+{
+	switch (i.b[0]) {
+	case ADD ... XOR:
+	case MOV:
+	case LOD:
+	case STO:
+	case CLO:
+		return (IP == i.b[1]) || (IP == i.b[2]) || (IP == i.b[3]);
+	case CAL:
+	case ADDI ... STD:
+		return (IP == i.b[1]) || (IP == i.b[2]);
+	case LIT:
+	case BNZ ... LIW:
+		return (IP == i.b[1]);
+	default:
+		return false;
+	}
+}
+
+static bool is(ins2_t i, enum byte_code op, int a, int b, int c)
+{
+	return (op == i.b[0])
+		&& ((-1 == a) || (a == i.b[1]))
+		&& ((-1 == b) || (b == i.b[2]))
+		&& ((-1 == c) || (c == i.b[3]));
+}
+
+static reg_t lit32(ins2_t hi, ins2_t lo)
+{
+	return (reg_t)((((uint32_t)hi.b[3] << 8 | hi.b[2]) << 16) | ((uint32_t)lo.b[3] << 8 | lo.b[2]));
+}
+
+
+// a copy of t with room for its instructions only, operands
+// which are immediates move with it
+
+static struct block* shrink(const struct block* t)
+{
+	size_t size = sizeof(struct block) + t->n * sizeof(struct dins);
+	struct block* b = malloc(size);
+
+	memcpy(b, t, size);
+
+	for (int i = 0; i < b->n; i++) {
+
+		struct dins* d = &b->ins[i];
+		const reg_t* k = t->ins[i].k;
+		reg_t** o[] = { &d->a, &d->b, &d->c, &d->d, &d->e, &d->f };
+
+		for (int j = 0; j < 6; j++)
+			if ((*o[j] >= k) && (*o[j] < k + 3))
+				*o[j] = d->k + (*o[j] - k);
+	}
+
+	return b;
+}
+
+static struct block* decode(struct bbc* c, reg_t regs[256], reg_t pc, const void* const h[K_NUM])
+{
+	struct block* b = c->tmp;
+
+	b->addr = pc;
+	b->n = 0;
+	b->cost = 0;
+
+	mem_t* mem = c->mem;
+	uint64_t end = ((uint64_t)page(pc) + 1) << PAGE_BITS;
+
+	// at least k words left in this page
+#define AVAIL(k) (end - (uint32_t)pc >= (uint64_t)(k))
+#define W(k) ((ins2_t){ .w = mem[pc + (k)] })
+#define R(k, j) (&regs[W(k).b[j]])
+
+	while (true) {
+
+		struct dins* d = &b->ins[b->n++];
+		enum kind k;
+
+		*d = (struct dins){ .addr = pc, .end = pc + 1 };
+
+		if (!AVAIL(1)) {
+
+			d->imm = pc;
+			k = K_FALL;
+			goto out;
+		}
+
+		ins2_t i = W(0);
+		int len = 1;
+
+		// jump
+		if ((is(i, ADD, IP, -1, -1) || is(i, ADDI, IP, -1, -1)) && (IP != i.b[2])
+		    && ((ADDI == i.b[0]) || (IP != i.b[3]))) {
+
+			d->b = R(0, 2);
+			d->c = (ADD == i.b[0]) ? R(0, 3) : &d->k[0];
+			d->k[0] = (int8_t)i.b[3];
+			k = K_JUMP;
+			goto fused;
+		}
+
+		if (uses_ip(i))
+			goto ipop;
+
+		switch (i.b[0]) {
+		case LIT:
+
+			if (AVAIL(2) && is(W(1), LIT, i.b[1], -1, -1)) {
+
+				// cjmp
+				if (AVAIL(4) && (IP != i.b[1])
+				    && is(W(2), ADD, i.b[1], IP, i.b[1])
+				    && is(W(3), MOV, -1, IP, i.b[1]) && (IP != W(3).b[1])) {
+
+					d->a = R(0, 1);
+					d->c = R(3, 1);
+					d->imm = (reg_t)((uint32_t)pc + 3 + (uint32_t)lit32(i, W(1)));
+					k = K_CJMP;
+					len = 4;
+					break;
+				}
+
+				d->a = R(0, 1);
+				d->imm = lit32(i, W(1));
+				k = K_LI32;
+				len = 2;
+				break;
+			}
+
+			d->a = R(0, 1);
+			d->imm = ((reg_t)i.b[3] << 8) + i.b[2];
+			k = K_LIT;
+			break;
+
+		case XOR:
+
+			if (AVAIL(3) && (i.b[1] == i.b[2]) && (i.b[1] == i.b[3])
+			    && is(W(1), ADD, i.b[1], IP, i.b[1])
+			    && is(W(2), MOV, -1, IP, i.b[1]) && (IP != W(2).b[1])) {
+
+				d->a = R(0, 1);
+				d->c = R(2, 1);
+				d->imm = (reg_t)((uint32_t)pc + 2);
+				k = K_CJMP;
+				len = 3;
+				break;
+			}
+
+			goto plain;
+
+		case ADD:
+
+			if (!(AVAIL(2) && (i.b[1] == i.b[2]) && is(W(1), STO, i.b[1], -1, -1) && (IP != W(1).b[3])))
+				goto plain;
+
+			d->a = R(0, 1);
+			d->b = R(0, 3);
+			d->d = R(1, 3);
+
+			if (IP != W(1).b[2]) {
+
+				d->c = R(1, 2);
+				k = K_PUSH;
+				len = 2;
+
+				// call
+				if (AVAIL(5) && is(W(2), ADD, i.b[1], i.b[1], i.b[3])
+				    && is(W(3), STO, i.b[1], IP, W(1).b[3])
+				    && is(W(4), MOV, -1, IP, -1) && (IP != W(4).b[1]) && (IP != W(4).b[3])) {
+
+					d->e = R(4, 1);
+					d->f = R(4, 3);
+					d->imm = pc + 4;
+					k = K_CALL;
+					len = 5;
+				}
+
+			} else {
+
+				d->imm = pc + 2;
+				k = K_PUSHI;
+				len = 2;
+			}
+
+			break;
+
+		case SUB:
+
+			if (!(AVAIL(2) && (i.b[1] == i.b[2]) && is(W(1), LOD, -1, i.b[1], -1)
+			      && (IP != W(1).b[1]) && (IP != W(1).b[3])))
+				goto plain;
+
+			d->a = R(0, 1);
+			d->b = R(0, 3);
+			d->c = R(1, 1);
+			d->d = R(1, 3);
+			k = K_POP;
+			len = 2;
+
+			// ret
+			if (AVAIL(3) && is(W(2), ADD, IP, W(1).b[1], -1) && (IP != W(2).b[3])) {
+
+				d->e = R(2, 3);
+				k = K_RET;
+				len = 3;
+			}
+
+			break;
+
+		case ADDI ... STD:
+
+			d->a = R(0, 1);
+			d->b = R(0, 2);
+			d->imm = (int8_t)i.b[3];
+			k = (ADDI == i.b[0]) ? K_ADDI : (LDD == i.b[0]) ? K_LDD : K_STD;
+
+			if ((ADDI != i.b[0]) || (i.b[1] != i.b[2]))
+				break;
+
+			// call
+			if (AVAIL(5) && is(W(1), STD, i.b[1], -1, -1) && (IP != W(1).b[2])
+			    && is(W(2), ADDI, i.b[1], i.b[1], i.b[3])
+			    && is(W(3), STD, i.b[1], IP, W(1).b[3])
+			    && is(W(4), MOV, -1, IP, -1) && (IP != W(4).b[1]) && (IP != W(4).b[3])) {
+
+				d->k[0] = (int8_t)i.b[3];
+				d->k[1] = (int8_t)W(1).b[3];
+				d->b = &d->k[0];
+				d->c = R(1, 2);
+				d->d = &d->k[1];
+				d->e = R(4, 1);
+				d->f = R(4, 3);
+				d->imm = pc + 4;
+				k = K_CALL;
+				len = 5;
+			}
+
+			// ret
+			if (AVAIL(3) && is(W(1), LDD, -1, i.b[1], -1) && (IP != W(1).b[1])
+			    && is(W(2), ADDI, IP, W(1).b[1], -1)) {
+
+				d->k[0] = -(reg_t)(int8_t)i.b[3];
+				d->k[1] = (int8_t)W(1).b[3];
+				d->k[2] = (int8_t)W(2).b[3];
+				d->b = &d->k[0];
+				d->c = R(1, 1);
+				d->d = &d->k[1];
+				d->e = &d->k[2];
+				k = K_RET;
+				len = 3;
+			}
+
+			break;
+
+		case BNZ:
+		case BLZ:
+
+			d->a = R(0, 1);
+			d->imm = (reg_t)((uint32_t)pc + 1 + (uint32_t)(int16_t)((i.b[3] << 8) | i.b[2]));
+			k = (BNZ == i.b[0]) ? K_BNZ : K_BLZ;
+			break;
+
+		case LIW:
+
+			if (!AVAIL(2))
+				goto ipop;
+
+			d->a = R(0, 1);
+			d->imm = W(1).w;
+			k = K_LI32;
+			len = 2;
+			break;
+
+		case MUL ... MOD:
+		case AND ... OR:
+		case MOV:
+		case LOD:
+		case STO:
+		case CLO:
+		case CAL:
+		plain:
+			d->a = R(0, 1);
+			d->b = R(0, 2);
+			d->c = R(0, 3);
+
+			switch (i.b[0]) {
+			case ADD: k = K_ADD; break;
+			case SUB: k = K_SUB; break;
+			case MUL: k = K_MUL; break;
+			case DIV: k = K_DIV; break;
+			case MOD: k = K_MOD; break;
+			case AND: k = K_AND; break;
+			case OR:  k = K_OR; break;
+			case XOR: k = K_XOR; break;
+			case MOV: k = K_MOV; break;
+			case LOD: k = K_LOD; break;
+			case CLO: k = K_CLO; break;
+			case CAL: k = K_CAL; break;
+			default:  k = K_STO; break;
+			}
+
+			break;
+
+		case SYS ... SPAWN:
+			goto ipop;
+
+		default:
+			k = K_STOP;
+			goto out;
+		}
+
+	fused:
+		d->op = h[k];
+		pc += len;
+		d->end = pc;
+		b->cost += (LIW == i.b[0]) ? 1 : len;
+		d->done = b->cost;
+
+		if ((K_CJMP == k) || (K_CALL == k) || (K_RET == k) || (K_JUMP == k)
+		    || (K_CAL == k) || (K_BNZ == k) || (K_BLZ == k))
+			goto out2;
+
+		continue;
+
+	ipop:
+		k = K_IPOP;
+	out:
+		d->op = h[k];
+		b->cost += (K_FALL != k) ? 1 : 0;
+		d->done = b->cost;
+	out2:
+		break;
+	}
+
+#undef AVAIL
+#undef W
+#undef R
+
+	b = shrink(b);
+
+	mark_code(c, b->addr, true);
+
+	unsigned int x = hash(b->addr);
+	b->next = c->tab[x];
+	c->tab[x] = b;
+
+	return b;
+}
+
+
+
+// one instruction by the interpreter, drops code it stores into
+
+static bool step(struct bbc* c, reg_t regs[256])
+{
+	mem_t* mem = c->mem;
+	reg_t pc = regs[0];
+	ins2_t i = { .w = mem[pc] };
+
+	regs[0] = pc + 1;	// as seen by the instruction
+
+	reg_t x = 0;
+	int n = 0;		// words stored at x
+
+	switch (i.b[0]) {
+	case STO: x = regs[i.b[1]] + regs[i.b[3]]; n = 1; break;
+	case STD: x = regs[i.b[1]] + (int8_t)i.b[3]; n = 1; break;
+	case CAS:
+	case XADD: x = regs[i.b[2]]; n = 1; break;
+	case CLO: x = regs[i.b[1]]; n = 2; break;
+	case CAL: x = regs[i.b[1]] + 1; n = 2; break;
+	}
+
+	regs[0] = pc;
+
+	bool r = vm_step(regs, mem);
+
+	for (int k = 0; k < n; k++)
+		if (is_code(c, x + k))
+			invalidate(c, x + k);
+
+	return r;
+}
+
+
+enum vm_status bbc_run_fuel(struct bbc* c, reg_t regs[256], long* fuel)
+{
+	static const void* const h[K_NUM] = {
+
+		[K_ADD] = &&add, [K_SUB] = &&sub, [K_MUL] = &&mul, [K_DIV] = &&div,
+		[K_MOD] = &&mod, [K_AND] = &&and, [K_OR] = &&or, [K_XOR] = &&xor,
+		[K_LIT] = &&lit, [K_MOV] = &&mov, [K_LOD] = &&lod, [K_STO] = &&sto,
+		[K_CLO] = &&clo, [K_CAL] = &&cal,
+		[K_ADDI] = &&addi, [K_LDD] = &&ldd, [K_STD] = &&std, [K_BNZ] = &&bnz, [K_BLZ] = &&blz,
+		[K_LI32] = &&li32, [K_PUSH] = &&push, [K_PUSHI] = &&pushi, [K_POP] = &&pop,
+		[K_CJMP] = &&cjmp, [K_CALL] = &&call, [K_RET] = &&ret, [K_JUMP] = &&jump,
+		[K_IPOP] = &&ipop, [K_STOP] = &&stop, [K_FALL] = &&fall,
+	};
+
+	if (c->regs != regs) {
+
+		flush(c);
+		c->regs = regs;
+	}
+
+	mem_t* mem = c->mem;
+	reg_t pc = regs[0];
+	const struct dins* d;
+	long f = *fuel;
+
+#define A (*d->a)
+#define B (*d->b)
+#define C (*d->c)
+#define D (*d->d)
+#define NEXT d++; goto *d->op
+
+	// store, leave the block if it was code
+#define STORE(x, v)				\
+	do {					\
+		reg_t _x = (x);			\
+		VM_STORE(mem[_x], (v));		\
+		if (is_code(c, _x)) {		\
+			invalidate(c, _x);	\
+			f += b->cost - d->done;	\
+			pc = d->end;		\
+			goto enter;		\
+		}				\
+	} while (0)
+
+enter:
+	reap(c);
+
+	struct block* b;
+
+	for (b = c->tab[hash(pc)]; NULL != b; b = b->next)
+		if (b->addr == pc)
+			break;
+
+	if (NULL == b)
+		b = decode(c, regs, pc, h);
+
+	if (b->cost > f)
+		goto slow;
+
+	f -= b->cost;
+
+	d = &b->ins[0];
+	goto *d->op;
+
+add:	A = B + C; NEXT;
+sub:	A = B - C; NEXT;
+mul:	A = B * C; NEXT;
+div:	A = B / C; NEXT;
+mod:	A = B % C; NEXT;
+and:	A = B & C; NEXT;
+or:	A = B | C; NEXT;
+xor:	A = B ^ C; NEXT;
+lit:	A = (A << 16) + d->imm; NEXT;
+mov:	if (A) B = C; NEXT;
+lod:	A = VM_LOAD(mem[B + C]); NEXT;
+sto:	STORE(A + C, B); NEXT;
+
+addi:	A = B + d->imm; NEXT;
+ldd:	A = VM_LOAD(mem[B + d->imm]); NEXT;
+std:	STORE(A + d->imm, B); NEXT;
+
+li32:	A = d->imm; NEXT;
+push:	A = A + B; STORE(A + D, C); NEXT;
+pushi:	A = A + B; STORE(A + D, d->imm); NEXT;
+pop:	A = A - B; C = VM_LOAD(mem[A + D]); NEXT;
+
+cjmp:
+	A = d->imm;
+	pc = C ? d->imm : d->end;
+	goto enter;
+
+bnz:
+	pc = A ? d->imm : d->end;
+	goto enter;
+
+blz:
+	pc = (A < 0) ? d->imm : d->end;
+	goto enter;
+
+call:
+	{
+		A = A + B;
+		reg_t x = A + D;
+		VM_STORE(mem[x], C);
+
+		A = A + B;
+		reg_t y = A + D;
+		VM_STORE(mem[y], d->imm);
+
+		pc = (*d->e) ? *d->f : d->end;
+
+		if (is_code(c, x))
+			invalidate(c, x);
+
+		if (is_code(c, y))
+			invalidate(c, y);
+	}
+
+	goto enter;
+
+clo:
+	{
+		reg_t x = A;
+
+		VM_STORE(mem[x], B);
+		VM_STORE(mem[x + 1], C);
+
+		if (is_code(c, x) || is_code(c, x + 1)) {
+
+			invalidate(c, x);
+			invalidate(c, x + 1);
+			f += b->cost - d->done;
+			pc = d->end;
+			goto enter;
+		}
+	}
+
+	NEXT;
+
+cal:
+	{
+		reg_t f = B;
+		reg_t e = VM_LOAD(mem[f + 1]);
+
+		pc = VM_LOAD(mem[f]);
+
+		reg_t x = A + 1;
+
+		VM_STORE(mem[x], e);
+		VM_STORE(mem[x + 1], d->addr);
+		A = x + 1;
+
+		if (is_code(c, x))
+			invalidate(c, x);
+
+		if (is_code(c, x + 1))
+			invalidate(c, x + 1);
+	}
+
+	goto enter;
+
+ret:
+	A = A - B;
+	C = VM_LOAD(mem[A + D]);
+	pc = C + *d->e;
+	goto enter;
+
+jump:
+	pc = B + C;
+	goto enter;
+
+ipop:
+	// the interpreter executes instructions which use IP
+	regs[0] = d->addr;
+	step(c, regs);
+	pc = regs[0];
+	goto enter;
+
+fall:
+	pc = d->imm;
+	goto enter;
+
+slow:
+	// the rest of the fuel does not cover the block
+	regs[0] = pc;
+
+	while (f > 0) {
+
+		f--;
+
+		if (!step(c, regs)) {
+
+			*fuel = f;
+			return VM_STOPPED;
+		}
+	}
+
+	*fuel = f;
+	return VM_FUEL;
+
+stop:
+	regs[0] = d->addr + 1;
+	*fuel = f;
+	return VM_STOPPED;
+
+#undef A
+#undef B
+#undef C
+#undef D
+#undef NEXT
+#undef STORE
+}
+
+
+void bbc_run(struct bbc* c, reg_t regs[256])
+{
+	long fuel = LONG_MAX;
+	bbc_run_fuel(c, regs, &fuel);
+}
+
+void vm_bbc(reg_t regs[256], mem_t* mem)
+{
+	struct bbc* c = bbc_create(mem);
+	bbc_run(c, regs);
+	bbc_free(c);
+}
+
+// in slices of fuel, as a scheduler would run it
+
+void vm_bbc_fuel(reg_t regs[256], mem_t* mem)
+{
+	struct bbc* c = bbc_create(mem);
+	long fuel;
+
+	do {
+		fuel = BBC_SLICE;
+
+	} while (VM_FUEL == bbc_run_fuel(c, regs, &fuel));
+
+	bbc_free(c);
+}
+
@@ -0,0 +1,19 @@
+/*
+ * basic block cache for tiny cpu
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ */
+
+#ifndef __BBC_H
+#define __BBC_H 1
+
+#include "cpu.h"
+
+struct bbc;
+
+extern struct bbc* bbc_create(mem_t* mem);
+extern void bbc_free(struct bbc* c);
+extern void bbc_run(struct bbc* c, reg_t regs[256]);
+extern enum vm_status bbc_run_fuel(struct bbc* c, reg_t regs[256], long* fuel);
+
+#endif
@@ -0,0 +1,1483 @@
+/*
+ * compiler for a tiny language, on top of the assembler
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ *
+ * prog		func*
+ * func		name ( [name {, name}] ) { stmt* }
+ * stmt		var name [= expr] ; | name = expr ; | expr ;
+ *		| if ( expr ) stmt [else stmt] | while ( expr ) stmt
+ *		| return expr ; | { stmt* }
+ * expr		| ^ & == != < <= > >= + - * / % as in C and unary -
+ *		on numbers, variables and calls name ( [expr {, expr}] )
+ *
+ * Values are words, comparisons give 0 or 1 and look at the sign
+ * of the difference. Variables belong to the function, a function
+ * without return returns 0.
+ *
+ * A function is translated into three address code on virtual
+ * registers, which linear scan over the live intervals maps to
+ * U1-U4 and A1-A4. Only if more values are live than fit, the one
+ * which lives longest goes to the frame. Calls destroy all these
+ * registers, so values which are live across a call are stored
+ * in the frame before it and loaded after it.
+ *
+ * Up to four arguments are passed in A1-A4 and the result in RR,
+ * a call pushes only the return address. The first function is
+ * called by a stub in front of it which takes its arguments from
+ * the stack, as arg() does, so that call() and the prelude can
+ * call the program.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <ctype.h>
+
+#include "cpu.h"
+#include "asm.h"
+#include "cc.h"
+
+
+// scratch registers for values in the frame
+#define S0 16u
+#define S1 17u
+
+#define MAX_FUNS 32
+#define MAX_VARS 64
+#define MAX_ARGS 4
+#define MAX_NAME 32
+
+static const unsigned char regs[] = { U1, U2, U3, U4, A4, A3, A2, A1 };
+static const unsigned char argr[MAX_ARGS] = { A1, A2, A3, A4 };
+
+#define NREGS (int)(sizeof(regs) / sizeof(regs[0]))
+
+
+enum tok { T_END = 0, T_NUM = 256, T_NAME, T_VAR, T_IF, T_ELSE, T_WHILE, T_RETURN, T_LE, T_GE, T_EQ, T_NE };
+
+// expression nodes, arithmetic uses the byte codes ADD ... XOR
+
+enum { N_NUM = 256, N_VAR, N_CALL, N_EQ, N_NE, N_LT, N_LE, N_GT, N_GE };
+
+struct node {
+
+	int op;
+	int l, r;
+	reg_t k;	// N_NUM
+	int v;		// N_VAR
+	int fun;	// N_CALL
+	int nargs;
+	int args[MAX_ARGS];
+};
+
+// three address code, virtual register 0 is C0 and 1 is C1
+
+enum ir_op { IR_ENTRY, IR_ARITH, IR_ADDK, IR_CONST, IR_MOV, IR_NOT, IR_BOOL, IR_SIGN,
+		IR_CALL, IR_RET, IR_JMP, IR_JNZ, IR_JLZ, IR_LABEL };
+
+struct ir {
+
+	enum ir_op op;
+	enum byte_code code;	// IR_ARITH
+	int d, a, b;
+	reg_t k;		// IR_ADDK, IR_CONST
+	int label;
+	int fun;
+	int nargs;
+	int args[MAX_ARGS];
+};
+
+struct fun {
+
+	char name[MAX_NAME];
+	int nparams;		// -1 if not known yet
+	bool defined;
+	struct label at;
+};
+
+struct lex {
+
+	const char* s;
+	int line;
+	int tok;
+	reg_t num;
+	char name[MAX_NAME];
+};
+
+static struct {
+
+	struct lex lx;
+
+	int nfuns;
+	struct fun funs[MAX_FUNS];
+
+	// the current function
+	int nparams;
+	int nvars;
+	struct { char name[MAX_NAME]; int v; } vars[MAX_VARS];
+
+	int nv, mv;
+	bool* isvar;
+
+	int nlabels;
+
+	int nir, mir;
+	struct ir* ir;
+
+	int nnodes, mnodes;
+	struct node* nodes;
+
+} cc;
+
+
+static void error(const char* msg)
+{
+	fprintf(stderr, "cc: line %d: %s\n", cc.lx.line, msg);
+	exit(1);
+}
+
+
+// lexer
+
+static void next(void)
+{
+	struct lex* l = &cc.lx;
+	const char* s = l->s;
+
+	while (true) {
+
+		while (isspace((unsigned char)*s))
+			if ('\n' == *s++)
+				l->line++;
+
+		if (('/' != s[0]) || ('/' != s[1]))
+			break;
+
+		while (('\0' != *s) && ('\n' != *s))
+			s++;
+	}
+
+	if (isdigit((unsigned char)*s)) {
+
+		ureg_t n = 0;
+
+		while (isdigit((unsigned char)*s))
+			n = 10 * n + (*s++ - '0');
+
+		l->num = n;
+		l->tok = T_NUM;
+
+	} else if (isalpha((unsigned char)*s) || ('_' == *s)) {
+
+		int n = 0;
+
+		while (isalnum((unsigned char)*s) || ('_' == *s)) {
+
+			if (n < MAX_NAME - 1)
+				l->name[n++] = *s;
+			s++;
+		}
+
+		l->name[n] = '\0';
+
+		static const struct { const char* name; int tok; } keywords[] = {
+
+			{ "var", T_VAR }, { "if", T_IF }, { "else", T_ELSE },
+			{ "while", T_WHILE }, { "return", T_RETURN },
+		};
+
+		l->tok = T_NAME;
+
+		for (int i = 0; i < (int)(sizeof(keywords) / sizeof(keywords[0])); i++)
+			if (0 == strcmp(l->name, keywords[i].name))
+				l->tok = keywords[i].tok;
+
+	} else if (('=' == s[1]) && (NULL != strchr("<>=!", *s))) {
+
+		l->tok = ('<' == *s) ? T_LE : ('>' == *s) ? T_GE : ('=' == *s) ? T_EQ : T_NE;
+		s += 2;
+
+	} else {
+
+		l->tok = *s;
+
+		if ('\0' != *s)
+			s++;
+	}
+
+	l->s = s;
+}
+
+static void expect(int tok, const char* msg)
+{
+	if (tok != cc.lx.tok)
+		error(msg);
+
+	next();
+}
+
+
+// names
+
+static int fun(const char* name)
+{
+	for (int i = 0; i < cc.nfuns; i++)
+		if (0 == strcmp(cc.funs[i].name, name))
+			return i;
+
+	if (MAX_FUNS == cc.nfuns)
+		error("too many functions");
+
+	struct fun* f = &cc.funs[cc.nfuns];
+
+	memset(f, 0, sizeof(struct fun));
+	strcpy(f->name, name);
+	f->nparams = -1;
+
+	return cc.nfuns++;
+}
+
+static void arity(int i, int n)
+{
+	if (-1 == cc.funs[i].nparams)
+		cc.funs[i].nparams = n;
+
+	if (n != cc.funs[i].nparams)
+		error("wrong number of arguments");
+}
+
+static int vreg(bool var)
+{
+	if (cc.nv == cc.mv) {
+
+		cc.mv = cc.mv ? 2 * cc.mv : 64;
+		cc.isvar = realloc(cc.isvar, cc.mv * sizeof(bool));
+	}
+
+	cc.isvar[cc.nv] = var;
+
+	return cc.nv++;
+}
+
+static int lookup(const char* name)
+{
+	for (int i = 0; i < cc.nvars; i++)
+		if (0 == strcmp(cc.vars[i].name, name))
+			return cc.vars[i].v;
+
+	return -1;
+}
+
+static int declare(const char* name)
+{
+	if (-1 != lookup(name))
+		error("variable declared twice");
+
+	if (MAX_VARS == cc.nvars)
+		error("too many variables");
+
+	strcpy(cc.vars[cc.nvars].name, name);
+
+	return cc.vars[cc.nvars++].v = vreg(true);
+}
+
+static bool temp(int v)
+{
+	return (v >= 2) && !cc.isvar[v];
+}
+
+
+// three address code
+
+static int emit(enum ir_op op, int d, int a, int b)
+{
+	if (cc.nir == cc.mir) {
+
+		cc.mir = cc.mir ? 2 * cc.mir : 256;
+		cc.ir = realloc(cc.ir, cc.mir * sizeof(struct ir));
+	}
+
+	struct ir* i = &cc.ir[cc.nir];
+
+	memset(i, 0, sizeof(struct ir));
+	i->op = op;
+	i->d = d;
+	i->a = a;
+	i->b = b;
+
+	return cc.nir++;
+}
+
+static int arith(enum byte_code code, int a, int b)
+{
+	int d = vreg(false);
+	cc.ir[emit(IR_ARITH, d, a, b)].code = code;
+	return d;
+}
+
+static int addk(int a, reg_t k)
+{
+	if (0 == k)
+		return a;
+
+	int d = vreg(false);
+	cc.ir[emit(IR_ADDK, d, a, -1)].k = k;
+	return d;
+}
+
+static int konst(reg_t k)
+{
+	if ((0 == k) || (1 == k))
+		return k;
+
+	int d = vreg(false);
+	cc.ir[emit(IR_CONST, d, -1, -1)].k = k;
+	return d;
+}
+
+static int unary(enum ir_op op, int a)
+{
+	int d = vreg(false);
+	emit(op, d, a, -1);
+	return d;
+}
+
+static void ir_jump(enum ir_op op, int a, int label)
+{
+	cc.ir[emit(op, -1, a, -1)].label = label;
+}
+
+static void ir_label(int label)
+{
+	cc.ir[emit(IR_LABEL, -1, -1, -1)].label = label;
+}
+
+static void assign(int v, int t)
+{
+	// the expression computes its value into v directly
+
+	if (temp(t) && (cc.nir > 0) && (cc.ir[cc.nir - 1].d == t)) {
+
+		cc.ir[cc.nir - 1].d = v;
+		return;
+	}
+
+	emit(IR_MOV, v, t, -1);
+}
+
+
+// expressions
+
+static int node(int op, int l, int r)
+{
+	if (cc.nnodes == cc.mnodes) {
+
+		cc.mnodes = cc.mnodes ? 2 * cc.mnodes : 64;
+		cc.nodes = realloc(cc.nodes, cc.mnodes * sizeof(struct node));
+	}
+
+	struct node* n = &cc.nodes[cc.nnodes];
+
+	memset(n, 0, sizeof(struct node));
+	n->op = op;
+	n->l = l;
+	n->r = r;
+
+	return cc.nnodes++;
+}
+
+static int expr(int prec);
+
+static int primary(void)
+{
+	int n;
+
+	switch (cc.lx.tok) {
+	case T_NUM:
+
+		n = node(N_NUM, -1, -1);
+		cc.nodes[n].k = cc.lx.num;
+		next();
+		return n;
+
+	case '-':
+
+		next();
+		n = primary();
+		return node(SUB, node(N_NUM, -1, -1), n);
+
+	case '(':
+
+		next();
+		n = expr(1);
+		expect(')', "')' expected");
+		return n;
+
+	case T_NAME:
+		break;
+
+	default:
+		error("expression expected");
+	}
+
+	char name[MAX_NAME];
+	strcpy(name, cc.lx.name);
+	next();
+
+	if ('(' != cc.lx.tok) {
+
+		n = node(N_VAR, -1, -1);
+
+		if (-1 == (cc.nodes[n].v = lookup(name)))
+			error("unknown variable");
+
+		return n;
+	}
+
+	next();
+
+	int f = fun(name);
+	int args[MAX_ARGS];
+	int nargs = 0;
+
+	while (')' != cc.lx.tok) {
+
+		if (MAX_ARGS == nargs)
+			error("too many arguments");
+
+		args[nargs++] = expr(1);
+
+		if (',' != cc.lx.tok)
+			break;
+
+		next();
+	}
+
+	expect(')', "')' expected");
+	arity(f, nargs);
+
+	n = node(N_CALL, -1, -1);
+	cc.nodes[n].fun = f;
+	cc.nodes[n].nargs = nargs;
+	memcpy(cc.nodes[n].args, args, sizeof(args));
+
+	return n;
+}
+
+static const struct { int tok; int op; int prec; } binops[] = {
+
+	{ '|', OR, 1 }, { '^', XOR, 2 }, { '&', AND, 3 },
+	{ T_EQ, N_EQ, 4 }, { T_NE, N_NE, 4 },
+	{ '<', N_LT, 5 }, { T_LE, N_LE, 5 }, { '>', N_GT, 5 }, { T_GE, N_GE, 5 },
+	{ '+', ADD, 6 }, { '-', SUB, 6 },
+	{ '*', MUL, 7 }, { '/', DIV, 7 }, { '%', MOD, 7 },
+};
+
+static int expr(int prec)
+{
+	int l = primary();
+
+	while (true) {
+
+		int b = 0;
+		int nb = (int)(sizeof(binops) / sizeof(binops[0]));
+
+		while ((b < nb) && (binops[b].tok != cc.lx.tok))
+			b++;
+
+		if ((b == nb) || (binops[b].prec < prec))
+			return l;
+
+		next();
+
+		int r = expr(binops[b].prec + 1);
+
+		l = node(binops[b].op, l, r);
+	}
+}
+
+static bool small(int n, reg_t* k)
+{
+	if ((N_NUM != cc.nodes[n].op) || (cc.nodes[n].k < INT_MIN / 2) || (cc.nodes[n].k > INT_MAX / 2))
+		return false;
+
+	*k = cc.nodes[n].k;
+	return true;
+}
+
+static int gen(int n);
+
+// l - r + k
+
+static int diff(int l, int r, reg_t k)
+{
+	reg_t c;
+
+	if (small(r, &c))
+		return addk(gen(l), k - c);
+
+	if (small(l, &c))
+		return arith(SUB, konst(c + k), gen(r));
+
+	int a = gen(l);
+
+	return addk(arith(SUB, a, gen(r)), k);
+}
+
+// t such that the comparison is true if t < 0, for == and != if t == 0
+
+static int compare(int op, int l, int r)
+{
+	switch (op) {
+	case N_LT: return diff(l, r, 0);
+	case N_GT: return diff(r, l, 0);
+	case N_LE: return diff(l, r, -1);
+	case N_GE: return diff(r, l, -1);
+	default: return diff(l, r, 0);
+	}
+}
+
+static int gen(int n)
+{
+	struct node x = cc.nodes[n];
+	reg_t k;
+
+	switch (x.op) {
+	case N_NUM:
+		return konst(x.k);
+
+	case N_VAR:
+		return x.v;
+
+	case N_CALL:
+	{
+		int args[MAX_ARGS];
+
+		for (int i = 0; i < x.nargs; i++)
+			args[i] = gen(x.args[i]);
+
+		int d = vreg(false);
+		int i = emit(IR_CALL, d, -1, -1);
+
+		cc.ir[i].fun = x.fun;
+		cc.ir[i].nargs = x.nargs;
+		memcpy(cc.ir[i].args, args, sizeof(args));
+
+		return d;
+	}
+
+	case N_EQ:
+		return unary(IR_NOT, compare(x.op, x.l, x.r));
+
+	case N_NE:
+		return unary(IR_BOOL, compare(x.op, x.l, x.r));
+
+	case N_LT ... N_GE:
+		return unary(IR_SIGN, compare(x.op, x.l, x.r));
+
+	case ADD:
+
+		if (small(x.l, &k))
+			return addk(gen(x.r), k);
+
+		if (small(x.r, &k))
+			return addk(gen(x.l), k);
+
+		break;
+
+	case SUB:
+		return diff(x.l, x.r, 0);
+	}
+
+	int a = gen(x.l);
+
+	return arith(x.op, a, gen(x.r));
+}
+
+// jump to label if the value of n is true, or false
+
+static void cond(int n, int l, bool sense)
+{
+	static const int negate[] = {
+
+		[N_EQ - N_EQ] = N_NE, [N_NE - N_EQ] = N_EQ,
+		[N_LT - N_EQ] = N_GE, [N_GE - N_EQ] = N_LT,
+		[N_GT - N_EQ] = N_LE, [N_LE - N_EQ] = N_GT,
+	};
+
+	struct node x = cc.nodes[n];
+
+	if ((N_EQ <= x.op) && (x.op <= N_GE)) {
+
+		int op = sense ? x.op : negate[x.op - N_EQ];
+		int t = compare(op, x.l, x.r);
+
+		switch (op) {
+		case N_EQ:
+			ir_jump(IR_JNZ, unary(IR_NOT, t), l);
+			break;
+		case N_NE:
+			ir_jump(IR_JNZ, t, l);
+			break;
+		default:
+			// changes its register in version 1
+			if (!temp(t))
+				t = unary(IR_MOV, t);
+
+			ir_jump(IR_JLZ, t, l);
+			break;
+		}
+
+		return;
+	}
+
+	int v = gen(n);
+
+	ir_jump(IR_JNZ, sense ? v : unary(IR_NOT, v), l);
+}
+
+static int top(void)
+{
+	cc.nnodes = 0;
+	return expr(1);
+}
+
+
+// statements
+
+static void stmt(void)
+{
+	switch (cc.lx.tok) {
+	case '{':
+
+		next();
+
+		while ('}' != cc.lx.tok) {
+
+			if (T_END == cc.lx.tok)
+				error("'}' expected");
+
+			stmt();
+		}
+
+		next();
+		break;
+
+	case T_VAR:
+	{
+		next();
+
+		if (T_NAME != cc.lx.tok)
+			error("name expected");
+
+		int v = declare(cc.lx.name);
+		next();
+
+		if ('=' == cc.lx.tok) {
+
+			next();
+			assign(v, gen(top()));
+
+		} else {
+
+			assign(v, 0);
+		}
+
+		expect(';', "';' expected");
+		break;
+	}
+
+	case T_IF:
+	{
+		next();
+		expect('(', "'(' expected");
+
+		int e = cc.nlabels++;
+
+		cond(top(), e, false);
+		expect(')', "')' expected");
+		stmt();
+
+		if (T_ELSE == cc.lx.tok) {
+
+			int j = cc.nlabels++;
+
+			ir_jump(IR_JMP, -1, j);
+			ir_label(e);
+			next();
+			stmt();
+			ir_label(j);
+
+		} else {
+
+			ir_label(e);
+		}
+
+		break;
+	}
+
+	case T_WHILE:
+	{
+		next();
+		expect('(', "'(' expected");
+
+		int b = cc.nlabels++;
+		int t = cc.nlabels++;
+
+		// the condition is parsed before the body, but goes after it
+
+		int c = top();
+		struct node* nodes = malloc(cc.nnodes * sizeof(struct node));
+		int nnodes = cc.nnodes;
+		memcpy(nodes, cc.nodes, nnodes * sizeof(struct node));
+
+		expect(')', "')' expected");
+
+		ir_jump(IR_JMP, -1, t);
+		ir_label(b);
+		stmt();
+		ir_label(t);
+
+		memcpy(cc.nodes, nodes, nnodes * sizeof(struct node));
+		cc.nnodes = nnodes;
+		free(nodes);
+
+		cond(c, b, true);
+		break;
+	}
+
+	case T_RETURN:
+
+		next();
+		emit(IR_RET, -1, gen(top()), -1);
+		expect(';', "';' expected");
+		break;
+
+	case T_NAME:
+	{
+		struct lex save = cc.lx;
+		int v = lookup(cc.lx.name);
+
+		next();
+
+		if ('=' == cc.lx.tok) {
+
+			if (-1 == v)
+				error("unknown variable");
+
+			next();
+			assign(v, gen(top()));
+			expect(';', "';' expected");
+			break;
+		}
+
+		cc.lx = save;
+	}
+		// fall through
+
+	default:
+
+		gen(top());
+		expect(';', "';' expected");
+		break;
+	}
+}
+
+
+/*
+ * register allocation
+ *
+ * Positions are twice the index of an instruction for its uses
+ * and one more for its definitions, so that a value may get the
+ * register of one which dies where it is defined.
+ */
+
+typedef uint64_t set_t;
+
+#define IN(s, v) (0 != ((s)[(v) / 64] & ((set_t)1 << ((v) % 64))))
+#define INCL(s, v) ((s)[(v) / 64] |= ((set_t)1 << ((v) % 64)))
+
+static int uses(const struct ir* i, int u[])
+{
+	int n = 0;
+
+	switch (i->op) {
+	case IR_ARITH:
+		u[n++] = i->b;
+		// fall through
+	case IR_ADDK:
+	case IR_MOV:
+	case IR_NOT:
+	case IR_BOOL:
+	case IR_SIGN:
+	case IR_RET:
+	case IR_JNZ:
+	case IR_JLZ:
+		u[n++] = i->a;
+		break;
+	case IR_CALL:
+		for (int j = 0; j < i->nargs; j++)
+			u[n++] = i->args[j];
+		break;
+	default:
+		break;
+	}
+
+	int m = 0;
+
+	for (int j = 0; j < n; j++)
+		if (u[j] >= 2)
+			u[m++] = u[j];
+
+	return m;
+}
+
+static int defs(const struct ir* i, int d[])
+{
+	if (IR_ENTRY == i->op) {
+
+		for (int j = 0; j < cc.nparams; j++)
+			d[j] = 2 + j;
+
+		return cc.nparams;
+	}
+
+	d[0] = i->d;
+
+	return (-1 == i->d) ? 0 : 1;
+}
+
+static int succs(const struct ir* i, int pc, const int pos[], int s[])
+{
+	switch (i->op) {
+	case IR_RET:
+		return 0;
+	case IR_JMP:
+		s[0] = pos[i->label];
+		return 1;
+	case IR_JNZ:
+	case IR_JLZ:
+		s[0] = pc + 1;
+		s[1] = pos[i->label];
+		return 2;
+	default:
+		s[0] = pc + 1;
+		return 1;
+	}
+}
+
+struct alloc {
+
+	int* reg;	// or -1 if in the frame
+	int* slot;	// or -1
+	int nslots;
+	set_t* out;	// live after each instruction
+	int nw;
+};
+
+static void live(struct alloc* al, int start[], int end[])
+{
+	int n = cc.nir;
+	int nw = al->nw;
+
+	int pos[cc.nlabels + 1];
+
+	for (int i = 0; i < n; i++)
+		if (IR_LABEL == cc.ir[i].op)
+			pos[cc.ir[i].label] = i;
+
+	set_t* in = calloc(n * nw, sizeof(set_t));
+	set_t* out = al->out;
+	set_t tmp[nw];
+
+	bool changed = true;
+
+	while (changed) {
+
+		changed = false;
+
+		for (int i = n - 1; i >= 0; i--) {
+
+			const struct ir* x = &cc.ir[i];
+			int s[2];
+			int ns = succs(x, i, pos, s);
+
+			memset(tmp, 0, sizeof(tmp));
+
+			for (int j = 0; j < ns; j++)
+				if (s[j] < n)
+					for (int w = 0; w < nw; w++)
+						tmp[w] |= in[s[j] * nw + w];
+
+			memcpy(&out[i * nw], tmp, sizeof(tmp));
+
+			int d[MAX_VARS];
+			int nd = defs(x, d);
+
+			for (int j = 0; j < nd; j++)
+				tmp[d[j] / 64] &= ~((set_t)1 << (d[j] % 64));
+
+			int u[MAX_ARGS + 1];
+			int nu = uses(x, u);
+
+			for (int j = 0; j < nu; j++)
+				INCL(tmp, u[j]);
+
+			if (0 != memcmp(&in[i * nw], tmp, sizeof(tmp))) {
+
+				memcpy(&in[i * nw], tmp, sizeof(tmp));
+				changed = true;
+			}
+		}
+	}
+
+	for (int v = 0; v < cc.nv; v++) {
+
+		start[v] = INT_MAX;
+		end[v] = -1;
+	}
+
+#define SEEN(v, p) do { if ((p) < start[v]) start[v] = (p); if ((p) > end[v]) end[v] = (p); } while (0)
+
+	for (int i = 0; i < n; i++) {
+
+		int u[MAX_ARGS + 1];
+		int nu = uses(&cc.ir[i], u);
+
+		for (int j = 0; j < nu; j++)
+			SEEN(u[j], 2 * i);
+
+		int d[MAX_VARS];
+		int nd = defs(&cc.ir[i], d);
+
+		for (int j = 0; j < nd; j++)
+			SEEN(d[j], 2 * i + 1);
+
+		for (int v = 2; v < cc.nv; v++) {
+
+			if (IN(&in[i * nw], v))
+				SEEN(v, 2 * i);
+
+			if (IN(&out[i * nw], v))
+				SEEN(v, 2 * i + 1);
+		}
+	}
+#undef SEEN
+
+	free(in);
+}
+
+static void linear_scan(struct alloc* al, const int start[], const int end[])
+{
+	int nv = cc.nv;
+	int order[nv];
+	int n = 0;
+
+	// by start, insertion sort is good enough here
+
+	for (int v = 2; v < nv; v++) {
+
+		if (INT_MAX == start[v])
+			continue;
+
+		int j = n++;
+
+		while ((j > 0) && (start[order[j - 1]] > start[v])) {
+
+			order[j] = order[j - 1];
+			j--;
+		}
+
+		order[j] = v;
+	}
+
+	// parameters and arguments would like to be in their register
+
+	int hint[nv];
+
+	for (int v = 0; v < nv; v++)
+		hint[v] = (2 <= v) && (v < 2 + cc.nparams) ? argr[v - 2] : -1;
+
+	for (int i = 0; i < cc.nir; i++)
+		if (IR_CALL == cc.ir[i].op)
+			for (int j = 0; j < cc.ir[i].nargs; j++)
+				if ((cc.ir[i].args[j] >= 2) && (-1 == hint[cc.ir[i].args[j]]))
+					hint[cc.ir[i].args[j]] = argr[j];
+
+	int active[NREGS];	// value in regs[r], or -1
+
+	for (int r = 0; r < NREGS; r++)
+		active[r] = -1;
+
+	for (int k = 0; k < n; k++) {
+
+		int v = order[k];
+
+		for (int r = 0; r < NREGS; r++) {
+
+			if ((-1 != active[r]) && (end[active[r]] < start[v])) {
+
+				active[r] = -1;
+			}
+		}
+
+		int r = -1;
+
+		for (int q = 0; q < NREGS; q++)
+			if ((-1 == active[q]) && ((-1 == r) || (hint[v] == regs[q])))
+				r = q;
+
+		if (-1 == r) {
+
+			// spill the value which lives longest
+
+			int s = 0;
+
+			for (int q = 1; q < NREGS; q++)
+				if (end[active[q]] > end[active[s]])
+					s = q;
+
+			if (end[active[s]] <= end[v]) {
+
+				al->reg[v] = -1;
+				al->slot[v] = al->nslots++;
+				continue;
+			}
+
+			al->reg[active[s]] = -1;
+			al->slot[active[s]] = al->nslots++;
+			r = s;
+		}
+
+		active[r] = v;
+		al->reg[v] = regs[r];
+	}
+}
+
+
+// code generation
+
+static unsigned char src(const struct alloc* al, ins2_t** p, int v, unsigned char t)
+{
+	if (v < 2)
+		return (0 == v) ? C0 : C1;
+
+	if (-1 != al->reg[v])
+		return al->reg[v];
+
+	load(p, t, al->slot[v]);
+	return t;
+}
+
+static unsigned char dst(const struct alloc* al, int v)
+{
+	return (-1 != al->reg[v]) ? al->reg[v] : S0;
+}
+
+static void put(const struct alloc* al, ins2_t** p, int v)
+{
+	if (-1 == al->reg[v])
+		store(p, al->slot[v], S0);
+}
+
+// moves which happen at the same time
+
+static void pmove(ins2_t** p, int n, unsigned char d[], unsigned char s[])
+{
+	int m = 0;
+
+	for (int i = 0; i < n; i++) {
+
+		if (d[i] != s[i]) {
+
+			d[m] = d[i];
+			s[m] = s[i];
+			m++;
+		}
+	}
+
+	while (m > 0) {
+
+		int j = 0;
+
+		for (; j < m; j++) {
+
+			bool blocked = false;
+
+			for (int k = 0; k < m; k++)
+				if ((k != j) && (s[k] == d[j]))
+					blocked = true;
+
+			if (!blocked)
+				break;
+		}
+
+		if (j < m) {
+
+			move(p, d[j], s[j]);
+			m--;
+			d[j] = d[m];
+			s[j] = s[m];
+			continue;
+		}
+
+		// a cycle
+
+		unsigned char c = s[0];
+
+		move(p, S1, c);
+
+		for (int k = 0; k < m; k++)
+			if (c == s[k])
+				s[k] = S1;
+	}
+}
+
+static void call_fun(ins2_t** p, int f)
+{
+	cnstl(p, AR, &cc.funs[f].at);
+	push(p, IP);
+	move(p, IP, AR);
+}
+
+static void lower(const struct alloc* al, ins2_t** p, int pc, struct label labels[])
+{
+	const struct ir* x = &cc.ir[pc];
+
+	switch (x->op) {
+	case IR_ENTRY:
+	{
+		unsigned char d[MAX_ARGS];
+		unsigned char s[MAX_ARGS];
+		int n = 0;
+
+		for (int j = 0; j < cc.nparams; j++) {
+
+			if (-1 == al->reg[2 + j]) {
+
+				store(p, al->slot[2 + j], argr[j]);
+				continue;
+			}
+
+			d[n] = al->reg[2 + j];
+			s[n] = argr[j];
+			n++;
+		}
+
+		pmove(p, n, d, s);
+		break;
+	}
+
+	case IR_ARITH:
+	{
+		unsigned char a = src(al, p, x->a, S0);
+		unsigned char b = src(al, p, x->b, S1);
+		unsigned char d = dst(al, x->d);
+
+		switch (x->code) {
+		case ADD: add(p, d, a, b); break;
+		case SUB: sub(p, d, a, b); break;
+		case MUL: mul(p, d, a, b); break;
+		case DIV: adiv(p, d, a, b); break;
+		case MOD: mod(p, d, a, b); break;
+		case AND: and(p, d, a, b); break;
+		case OR: or(p, d, a, b); break;
+		case XOR: xor(p, d, a, b); break;
+		default: break;
+		}
+
+		put(al, p, x->d);
+		break;
+	}
+
+	case IR_ADDK:
+
+		addi(p, dst(al, x->d), src(al, p, x->a, S0), x->k);
+		put(al, p, x->d);
+		break;
+
+	case IR_CONST:
+
+		cnst(p, dst(al, x->d), x->k);
+		put(al, p, x->d);
+		break;
+
+	case IR_MOV:
+	{
+		unsigned char a = src(al, p, x->a, S0);
+		unsigned char d = dst(al, x->d);
+
+		if (a != d)
+			move(p, d, a);
+
+		put(al, p, x->d);
+		break;
+	}
+
+	case IR_NOT:
+	{
+		unsigned char a = src(al, p, x->a, S0);
+		unsigned char d = dst(al, x->d);
+
+		move(p, S1, C1);
+		cmove(p, a, S1, C0);
+		move(p, d, S1);
+		put(al, p, x->d);
+		break;
+	}
+
+	case IR_BOOL:
+	{
+		unsigned char a = src(al, p, x->a, S0);
+		unsigned char d = dst(al, x->d);
+
+		if (a != d)
+			move(p, d, a);
+
+		cmove(p, d, d, C1);
+		put(al, p, x->d);
+		break;
+	}
+
+	case IR_SIGN:
+	{
+		unsigned char a = src(al, p, x->a, S0);
+		unsigned char d = dst(al, x->d);
+
+		cnst(p, S1, SIGN_BIT);
+		and(p, d, a, S1);
+		cmove(p, d, d, C1);
+		put(al, p, x->d);
+		break;
+	}
+
+	case IR_CALL:
+	{
+		// save what is live across the call
+
+		const set_t* out = &al->out[pc * al->nw];
+
+		for (int v = 2; v < cc.nv; v++)
+			if (IN(out, v) && (v != x->d) && (-1 != al->reg[v]))
+				store(p, al->slot[v], al->reg[v]);
+
+		unsigned char d[MAX_ARGS];
+		unsigned char s[MAX_ARGS];
+		int n = 0;
+
+		for (int j = 0; j < x->nargs; j++) {
+
+			int v = x->args[j];
+
+			if ((v >= 2) && (-1 == al->reg[v]))
+				continue;
+
+			d[n] = argr[j];
+			s[n] = src(al, p, v, S0);
+			n++;
+		}
+
+		pmove(p, n, d, s);
+
+		for (int j = 0; j < x->nargs; j++)
+			if ((x->args[j] >= 2) && (-1 == al->reg[x->args[j]]))
+				load(p, argr[j], al->slot[x->args[j]]);
+
+		call_fun(p, x->fun);
+
+		if (-1 == al->reg[x->d])
+			store(p, al->slot[x->d], RR);
+		else
+			move(p, al->reg[x->d], RR);
+
+		for (int v = 2; v < cc.nv; v++)
+			if (IN(out, v) && (v != x->d) && (-1 != al->reg[v]))
+				load(p, al->reg[v], al->slot[v]);
+
+		break;
+	}
+
+	case IR_RET:
+
+		leave(p, src(al, p, x->a, S0));
+		break;
+
+	case IR_JMP:
+
+		jumpl(p, &labels[x->label]);
+		break;
+
+	case IR_JNZ:
+
+		cjmpl(p, src(al, p, x->a, S0), &labels[x->label]);
+		break;
+
+	case IR_JLZ:
+
+		cjmpnl(p, src(al, p, x->a, S0), &labels[x->label]);
+		break;
+
+	case IR_LABEL:
+
+		bind(p, &labels[x->label]);
+		break;
+	}
+}
+
+static void function(ins2_t** p)
+{
+	if (T_NAME != cc.lx.tok)
+		error("function expected");
+
+	int f = fun(cc.lx.name);
+
+	if (cc.funs[f].defined)
+		error("function defined twice");
+
+	cc.funs[f].defined = true;
+	cc.nvars = 0;
+	cc.nparams = 0;
+	cc.nv = 0;
+	cc.nir = 0;
+	cc.nlabels = 0;
+
+	vreg(false);	// C0
+	vreg(false);	// C1
+
+	next();
+	expect('(', "'(' expected");
+
+	while (T_NAME == cc.lx.tok) {
+
+		if (MAX_ARGS == cc.nparams)
+			error("too many parameters");
+
+		declare(cc.lx.name);
+		cc.nparams++;
+		next();
+
+		if (',' != cc.lx.tok)
+			break;
+
+		next();
+	}
+
+	expect(')', "')' expected");
+	arity(f, cc.nparams);
+
+	emit(IR_ENTRY, -1, -1, -1);
+
+	if ('{' != cc.lx.tok)
+		error("'{' expected");
+
+	stmt();
+	emit(IR_RET, -1, 0, -1);
+
+	// allocate
+
+	int nv = cc.nv;
+	int start[nv];
+	int end[nv];
+	int reg[nv];
+	int slot[nv];
+
+	struct alloc al = { .reg = reg, .slot = slot, .nw = (nv + 63) / 64 };
+
+	al.out = calloc(cc.nir * al.nw, sizeof(set_t));
+
+	for (int v = 0; v < nv; v++) {
+
+		reg[v] = -1;
+		slot[v] = -1;
+	}
+
+	live(&al, start, end);
+	linear_scan(&al, start, end);
+
+	// frame slots for values which are saved across calls
+
+	for (int i = 0; i < cc.nir; i++)
+		if (IR_CALL == cc.ir[i].op)
+			for (int v = 2; v < nv; v++)
+				if (IN(&al.out[i * al.nw], v) && (v != cc.ir[i].d) && (-1 == slot[v]))
+					slot[v] = al.nslots++;
+
+	struct label labels[cc.nlabels + 1];
+	memset(labels, 0, sizeof(labels));
+
+	bind(p, &cc.funs[f].at);
+	enter(p, al.nslots);
+
+	for (int i = 0; i < cc.nir; i++)
+		lower(&al, p, i, labels);
+
+	free(al.out);
+}
+
+
+// the number of parameters of the first function
+
+static int first_arity(void)
+{
+	struct lex save = cc.lx;
+	int n = 0;
+
+	next();
+
+	if ('(' == cc.lx.tok) {
+
+		next();
+
+		while (T_NAME == cc.lx.tok) {
+
+			n++;
+			next();
+
+			if (',' != cc.lx.tok)
+				break;
+
+			next();
+		}
+	}
+
+	cc.lx = save;
+
+	return n;
+}
+
+void cc_compile(ins2_t** p, const char* src)
+{
+	cc.nfuns = 0;
+	cc.lx.s = src;
+	cc.lx.line = 1;
+
+	next();
+
+	if (T_NAME != cc.lx.tok)
+		error("function expected");
+
+	// stub which calls the first function with arguments from the stack
+
+	int n = first_arity();
+	int f = fun(cc.lx.name);
+
+	enter(p, 0);
+
+	for (int j = 0; j < n; j++)
+		arg(p, argr[j], j);
+
+	call_fun(p, f);
+	leave(p, RR);
+
+	while (T_END != cc.lx.tok)
+		function(p);
+
+	for (int i = 0; i < cc.nfuns; i++)
+		if (!cc.funs[i].defined)
+			error("function called but not defined");
+}
+
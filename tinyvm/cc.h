@@ -0,0 +1,14 @@
+/*
+ * compiler for a tiny language, on top of the assembler
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ */
+
+#ifndef __CC_H
+#define __CC_H 1
+
+#include "cpu.h"
+
+extern void cc_compile(ins2_t** p, const char* src);
+
+#endif
@@ -6,12 +6,100 @@
  * 256 register
  * fixed size instructions
  * aligned memory access
+ *
+ * closures are records of two words, code and static link:
+ *
+ * CLO a b c	store closure of code b and static link c at a
+ * CAL a b c	call closure at b with stack pointer a: push
+ *		the static link and the address of the CAL,
+ *		which is what ret() expects, then jump. c is
+ *		not used.
+ *
+ * version 2 adds immediates, with k the signed byte c and o the
+ * signed 16 bit number in b and c:
+ *
+ * ADDI a b k	a = b + k
+ * LDD a b k	a = mem[b + k]
+ * STD a b k	mem[a + k] = b
+ * BNZ a o	if a != 0, IP += o
+ * BLZ a o	if a < 0, IP += o
+ * LIW a	a = the word after the instruction, which is skipped
+ *
+ * Branch offsets are relative to the next instruction. Version 1
+ * code runs unchanged.
+ *
+ * Words have TVM_WORD bits, 32 or 64. LIT shifts by the word size
+ * minus 16 and its literal l is everything after the register, 16
+ * bits or 48 bits, so that two LITs load any word:
+ *
+ * LIT a l	a = (a << (TVM_WORD - 16)) + l
+ *
+ * SYS a b	a = host call for the ring at b, -1 if there is no
+ *		host. c is not used.
+ *
+ * Hardware threads share memory and have registers of their own:
+ *
+ * CAS a b c	if mem[b] == a, mem[b] = c; a = the old mem[b]
+ * XADD a b c	a = mem[b]; mem[b] += c
+ * FENCE	full memory barrier
+ * SPAWN a b c	start a thread with a copy of the registers, except
+ *		that IP = b and a = c, and set a to its number,
+ *		or to -1 if none can be started. The thread ends
+ *		at STP.
+ *
+ * Memory model: aligned words are loaded and stored as a whole,
+ * LOD and STO (and everything else which accesses data) are
+ * relaxed atomic accesses, so they are not ordered with respect
+ * to other threads. Instructions are fetched with plain loads,
+ * code must not change while another thread may run it. CAS and
+ * XADD are sequentially consistent read-modify-write operations
+ * and FENCE is a sequentially consistent fence, as in C11, which
+ * is what implements them. A relaxed load which sees the value
+ * of a CAS or XADD and a FENCE after it synchronize with it, as
+ * do a FENCE and a relaxed store after it with an atomic which
+ * sees the value of that store. Everything a thread did before
+ * SPAWN is visible to the new thread.
  */
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
 
 #include "cpu.h"
+#ifdef VM_PROFILE
+#include "prof.h"
+#endif
+
+
+vm_host_fun_t* vm_host_call = NULL;
+vm_spawn_fun_t* vm_spawn_call = NULL;
+
+#define ATOMIC(x) ((_Atomic mem_t*)&(x))
+
+static reg_t cas(mem_t* x, reg_t a, reg_t c)
+{
+	atomic_compare_exchange_strong(ATOMIC(*x), &a, c);
+	return a;
+}
+
+// kept out of line, the registers of the new thread take 1 KiB
+
+static __attribute__((noinline)) reg_t spawn(const reg_t regs[256], mem_t* mem, ins2_t i)
+{
+	if (NULL == vm_spawn_call)
+		return -1;
+
+	reg_t r[256];
+
+	for (int k = 0; k < 256; k++)
+		r[k] = regs[k];
+
+	r[0] = regs[i.b[2]];
+	r[i.b[1]] = regs[i.b[3]];
+
+	return vm_spawn_call(mem, r);
+}
 
 
 #if 1
@@ -28,7 +116,9 @@ int vm_step(reg_t regs[256], mem_t* mem)
 #define A regs[i.b[1]]
 #define B regs[i.b[2]]
 #define C regs[i.b[3]]
-#define L (((reg_t)(i.b[3]) << 8) + ((reg_t)i.b[2]))
+#define L ((reg_t)((ureg_t)i.w >> 16))
+#define K ((reg_t)(int8_t)i.b[3])
+#define O ((reg_t)(int16_t)(((unsigned int)i.b[3] << 8) | i.b[2]))
 
 	switch(I) {
 	case ADD: A = B + C; break;
@@ -39,10 +129,34 @@ int vm_step(reg_t regs[256], mem_t* mem)
 	case AND: A = B & C; break;
 	case OR:  A = B | C; break;
 	case XOR: A = B ^ C; break;
-	case LIT: A = (A << 16) + L; break;
+	case LIT: A = (A << (TVM_WORD - 16)) + L; break;
 	case MOV: if (A) B = C; break;
-	case LOD: A = mem[B + C]; break;
-	case STO: mem[A + C] = B; break;
+	case LOD: A = VM_LOAD(mem[B + C]); break;
+	case STO: VM_STORE(mem[A + C], B); break;
+	case CLO: VM_STORE(mem[A], B); VM_STORE(mem[A + 1], C); break;
+	case CAL:
+		{
+			reg_t f = B;
+			reg_t e = VM_LOAD(mem[f + 1]);
+			reg_t t = VM_LOAD(mem[f]);
+
+			VM_STORE(mem[A + 1], e);
+			VM_STORE(mem[A + 2], regs[0] - 1);
+			A += 2;
+			regs[0] = t;
+		}
+		break;
+	case ADDI: A = B + K; break;
+	case LDD: A = VM_LOAD(mem[B + K]); break;
+	case STD: VM_STORE(mem[A + K], B); break;
+	case BNZ: if (A) regs[0] += O; break;
+	case BLZ: if (A < 0) regs[0] += O; break;
+	case LIW: { reg_t x = mem[regs[0]++]; A = x; } break;
+	case SYS: A = (NULL != vm_host_call) ? vm_host_call(mem, B) : -1; break;
+	case CAS: A = cas(&mem[B], A, C); break;
+	case XADD: A = atomic_fetch_add(ATOMIC(mem[B]), C); break;
+	case FENCE: atomic_thread_fence(memory_order_seq_cst); break;
+	case SPAWN: A = spawn(regs, mem, i); break;
 	case STP:
 	default: return 0;
 	}
@@ -52,7 +166,182 @@ int vm_step(reg_t regs[256], mem_t* mem)
 
 void vm(reg_t regs[256], mem_t* mem)
 {
+#ifdef VM_PROFILE
+	if (NULL != vm_prof) {
+
+		prof_run(vm_prof, regs, mem);
+		return;
+	}
+#endif
 	while(vm_step(regs, mem))
 		;
 }
 
+#undef vm_step
+
+int vm_step(reg_t regs[256], mem_t* mem)
+{
+	return vm_step2(regs, mem);
+}
+
+// run at most n instructions with the switch engine. The caller
+// sets the status of the context to VM_RUNNING before the first
+// slice, it is only changed here when the program stops.
+
+enum vm_status vm_slice(struct vm_ctx* ctx, long n)
+{
+	long k = 0;
+
+	while (k < n) {
+
+		k++;
+
+		if (!vm_step2(ctx->regs, ctx->mem)) {
+
+			ctx->status = VM_STOPPED;
+			break;
+		}
+	}
+
+	ctx->retired += k;
+
+	return ctx->status;
+}
+
+long vm_count(reg_t regs[256], mem_t* mem)
+{
+	long n = 1;
+
+	while (vm_step2(regs, mem))
+		n++;
+
+	return n;
+}
+
+
+
+/*
+ * direct threaded code
+ *
+ * Every handler ends with its own indirect jump and IP lives in
+ * a local variable. Instructions which name register 0 in any of
+ * their operand bytes are sent to a second set of handlers which
+ * write IP back to the register file before and reload it after.
+ * LIT immediates with a zero byte take the slow path too, which
+ * is harmless. Branches and LIW change IP themselves.
+ *
+ * The other registers stay in the register file, which is in the
+ * first level cache. Operands are register numbers in the word,
+ * so a local only helps handlers which know their register, and
+ * nearly every instruction names SP, AR, C0 or C1. Keeping those
+ * in locals as well sends it to the slow path, which made this
+ * engine two to three times slower.
+ */
+
+void vm_threaded(reg_t regs[256], mem_t* mem)
+{
+	static const ins2_t opmask = { .b = { 0xFF, 0, 0, 0 } };
+
+#define HANDLERS(x) 									\
+	[0 ... 255] = &&stop,								\
+	[ADD] = &&x##add, [SUB] = &&x##sub, [MUL] = &&x##mul, [DIV] = &&x##div,	\
+	[MOD] = &&x##mod, [AND] = &&x##and, [OR] = &&x##or, [XOR] = &&x##xor,	\
+	[LIT] = &&x##lit, [MOV] = &&x##mov, [LOD] = &&x##lod, [STO] = &&x##sto,	\
+	[CLO] = &&x##clo, [CAL] = &&x##cal,					\
+	[ADDI] = &&x##addi, [LDD] = &&x##ldd, [STD] = &&x##std,			\
+	[BNZ] = &&x##bnz, [BLZ] = &&x##blz, [LIW] = &&x##liw,			\
+	[SYS] = &&x##sys, [CAS] = &&x##cas, [XADD] = &&x##xadd,		\
+	[FENCE] = &&x##fence, [SPAWN] = &&x##spawn
+
+	static const void* fast[256] = { HANDLERS(f_) };
+	static const void* sync[256] = { HANDLERS(s_) };
+#undef HANDLERS
+
+	// true if one of the three operand bytes is zero
+#define ZBYTE(x) ((((uint32_t)(x) | (uint32_t)opmask.w) - 0x01010101u) & ~((uint32_t)(x) | (uint32_t)opmask.w) & 0x80808080u)
+
+#define NEXT	do {						\
+		i.w = mem[ip++];				\
+		goto *(ZBYTE(i.w) ? sync : fast)[I];		\
+	} while (0)
+
+#define OP(x, stmt)							\
+	f_##x: stmt; NEXT;						\
+	s_##x: regs[0] = ip; stmt; ip = regs[0]; NEXT;
+
+	reg_t ip = regs[0];
+	ins2_t i;
+
+	NEXT;
+
+	OP(add, A = B + C);
+	OP(sub, A = B - C);
+	OP(mul, A = B * C);
+	OP(div, A = B / C);
+	OP(mod, A = B % C);
+	OP(and, A = B & C);
+	OP(or, A = B | C);
+	OP(xor, A = B ^ C);
+	OP(lit, A = (A << (TVM_WORD - 16)) + L);
+	OP(mov, if (A) B = C);
+	OP(lod, A = VM_LOAD(mem[B + C]));
+	OP(sto, VM_STORE(mem[A + C], B));
+	OP(clo, VM_STORE(mem[A], B); VM_STORE(mem[A + 1], C));
+
+	// IP is written, the sync version only saves it
+s_cal:
+	regs[0] = ip;
+f_cal:
+	{
+		reg_t f = B;
+		reg_t e = VM_LOAD(mem[f + 1]);
+		reg_t t = VM_LOAD(mem[f]);
+
+		VM_STORE(mem[A + 1], e);
+		VM_STORE(mem[A + 2], ip - 1);
+		A += 2;
+		ip = t;
+	}
+	NEXT;
+
+	OP(addi, A = B + K);
+	OP(ldd, A = VM_LOAD(mem[B + K]));
+	OP(std, VM_STORE(mem[A + K], B));
+
+s_bnz:
+	regs[0] = ip;
+f_bnz:
+	if (A)
+		ip += O;
+	NEXT;
+
+s_blz:
+	regs[0] = ip;
+f_blz:
+	if (A < 0)
+		ip += O;
+	NEXT;
+
+s_liw:
+	regs[0] = ip + 1;
+	A = mem[ip];
+	ip = regs[0];
+	NEXT;
+f_liw:
+	A = mem[ip++];
+	NEXT;
+
+	OP(sys, A = (NULL != vm_host_call) ? vm_host_call(mem, B) : -1);
+	OP(cas, A = cas(&mem[B], A, C));
+	OP(xadd, A = atomic_fetch_add(ATOMIC(mem[B]), C));
+	OP(fence, atomic_thread_fence(memory_order_seq_cst));
+	OP(spawn, A = spawn(regs, mem, i));
+
+stop:
+	regs[0] = ip;
+
+#undef OP
+#undef NEXT
+#undef ZBYTE
+}
+
@@ -3,10 +3,28 @@
 #define __CPU_H 1
 
 #include <stdint.h>
+#include <stdatomic.h>
 
+// word size in bits, one instruction per word. Only the
+// interpreters in cpu.c and the assembler support 64 bit words.
+
+#ifndef TVM_WORD
+#define TVM_WORD 32
+#endif
+
+#if 32 == TVM_WORD
 typedef int32_t ins_t;
 typedef int32_t reg_t;
 typedef int32_t mem_t;
+typedef uint32_t ureg_t;
+#elif 64 == TVM_WORD
+typedef int64_t ins_t;
+typedef int64_t reg_t;
+typedef int64_t mem_t;
+typedef uint64_t ureg_t;
+#else
+#error "TVM_WORD must be 32 or 64"
+#endif
 
 
 enum byte_code { 
@@ -14,16 +32,71 @@ enum byte_code {
         STP,
 	ADD, SUB, MUL, DIV, MOD,
         AND, OR, XOR, LIT,
-        STO, LOD, MOV
+        STO, LOD, MOV,
+	CLO, CAL,
+
+	// version 2
+	ADDI, LDD, STD, BNZ, BLZ, LIW,
+
+	// host calls
+	SYS,
+
+	// threads
+	CAS, XADD, FENCE, SPAWN
 };
 
+// data accesses are relaxed atomics, a plain move on x86
+
+#define VM_LOAD(x) atomic_load_explicit((_Atomic mem_t*)&(x), memory_order_relaxed)
+#define VM_STORE(x, v) atomic_store_explicit((_Atomic mem_t*)&(x), (v), memory_order_relaxed)
+
 typedef union ins2_u {
-	unsigned char b[4];
+	unsigned char b[sizeof(ins_t)];
 	ins_t w;
 } ins2_t;
 
+typedef void vm_fun_t(reg_t regs[256], mem_t* mem);
+
 extern void vm(reg_t regs[256], mem_t* mem);
+extern void vm_threaded(reg_t regs[256], mem_t* mem);
+#if 32 == TVM_WORD
+extern void vm_bbc(reg_t regs[256], mem_t* mem);
+extern void vm_bbc_fuel(reg_t regs[256], mem_t* mem);
+#ifdef __x86_64__
+extern void vm_jit(reg_t regs[256], mem_t* mem);
+#endif
+#endif
 extern int vm_step(reg_t regs[256], mem_t* mem);
+extern long vm_count(reg_t regs[256], mem_t* mem);
+
+// called by SYS, see host.c
+typedef reg_t vm_host_fun_t(mem_t* mem, reg_t ring);
+extern vm_host_fun_t* vm_host_call;
+
+// called by SPAWN with the registers of the new thread, see smp.c
+typedef reg_t vm_spawn_fun_t(mem_t* mem, const reg_t regs[256]);
+extern vm_spawn_fun_t* vm_spawn_call;
+
+enum vm_status { VM_RUNNING, VM_STOPPED, VM_FAULT, VM_FUEL };
+
+struct vm_ctx {
+
+	reg_t regs[256];
+	mem_t* mem;
+	enum vm_status status;
+	long retired;		// instructions
+};
+
+extern enum vm_status vm_slice(struct vm_ctx* ctx, long n);
+
+struct vm_engine {
+
+	const char* name;
+	vm_fun_t* run;
+};
+
+extern const struct vm_engine vm_engines[];
+extern vm_fun_t* vm_engine(const char* name);
 
 
 #endif
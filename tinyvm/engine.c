@@ -0,0 +1,34 @@
+/*
+ * execution engines for tiny cpu
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ */
+
+#include <string.h>
+
+#include "cpu.h"
+
+
+const struct vm_engine vm_engines[] = {
+
+	{ "switch", vm },
+	{ "threaded", vm_threaded },
+#if 32 == TVM_WORD
+	{ "bbc", vm_bbc },
+	{ "bbc-fuel", vm_bbc_fuel },
+#ifdef __x86_64__
+	{ "jit", vm_jit },
+#endif
+#endif
+	{ NULL, NULL },
+};
+
+vm_fun_t* vm_engine(const char* name)
+{
+	for (const struct vm_engine* e = vm_engines; NULL != e->name; e++)
+		if (0 == strcmp(e->name, name))
+			return e->run;
+
+	return NULL;
+}
+
@@ -0,0 +1,427 @@
+/*
+ * asynchronous host calls for tiny cpu
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ *
+ * A guest talks to the host through rings of submissions and
+ * completions in its own memory, one word per field:
+ *
+ * submission	op fd addr len
+ * completion	tag res
+ *
+ * The guest fills submissions, advances the submission tail and
+ * executes SYS with the address of the ring. This only wakes
+ * the host thread, the guest goes on. The host takes everything
+ * submitted since, performs it and writes completions, and then
+ * advances both its heads once per batch. The tag of a completion
+ * is the number of the submission, its result the number of bytes
+ * or -errno. The guest polls the completion tail and advances the
+ * completion head. The host takes a submission only if there is
+ * room for its completion, the guest has to execute SYS again
+ * after it made room.
+ *
+ * READ and WRITE use the bytes at addr (a word address) directly,
+ * nothing is copied. fd is an index into the table given to
+ * vm_host_create(). TIMER completes after len microseconds.
+ * Rings and buffers must lie within the first size words, which
+ * have to be writable, and must not overlap code.
+ *
+ * The words which belong to the host are written with release
+ * semantics and the submission tail and the completion head are
+ * read with acquire semantics. Loads and stores of the guest are
+ * relaxed, so it has to execute FENCE before it advances the
+ * submission tail or the completion head, and after it sees the
+ * completion tail advance and before it reads the completions.
+ * Without them the host may see a submission which is not yet
+ * filled in, or the guest completions which are not yet written.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "cpu.h"
+#include "host.h"
+
+
+#define MAX_RINGS 8
+
+struct timer {
+
+	reg_t ring;
+	reg_t tag;
+	struct timespec when;
+};
+
+struct vm_host {
+
+	mem_t* mem;
+	long size;
+	int nfds;
+	int* fds;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t bell;
+	bool rung;
+	bool quit;
+
+	int nrings;
+	reg_t rings[MAX_RINGS];
+
+	// only used by the host thread
+	int ntimers;
+	int mtimers;
+	struct timer* timers;
+
+	atomic_long batches;
+	atomic_long requests;
+
+	struct vm_host* next;
+};
+
+
+// hosts by guest memory, for SYS
+
+static pthread_mutex_t hosts_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct vm_host* hosts = NULL;
+
+
+static mem_t get(mem_t* x)
+{
+	return atomic_load_explicit((_Atomic mem_t*)x, memory_order_acquire);
+}
+
+static void put(mem_t* x, mem_t v)
+{
+	atomic_store_explicit((_Atomic mem_t*)x, v, memory_order_release);
+}
+
+static bool inside(const struct vm_host* h, reg_t addr, long words)
+{
+	return (addr >= 0) && (words >= 0) && (addr + words <= h->size);
+}
+
+// the ring at r, or NULL if it does not fit
+
+static mem_t* ring(const struct vm_host* h, reg_t r)
+{
+	if (!inside(h, r, RING_SQ))
+		return NULL;
+
+	mem_t* m = h->mem + r;
+	reg_t n = m[RING_SIZE];
+
+	if ((n <= 0) || (0 != (n & (n - 1))) || !inside(h, r, RING_SQ + (long)n * (RING_SQE + RING_CQE)))
+		return NULL;
+
+	return m;
+}
+
+static void complete(mem_t* m, reg_t* tail, reg_t tag, reg_t res)
+{
+	reg_t n = m[RING_SIZE];
+	mem_t* c = m + RING_SQ + n * RING_SQE + (*tail & (n - 1)) * RING_CQE;
+
+	c[0] = tag;
+	c[1] = res;
+	(*tail)++;
+}
+
+static reg_t io(struct vm_host* h, const mem_t* s)
+{
+	reg_t fd = s[1];
+	reg_t addr = s[2];
+	reg_t len = s[3];
+
+	if ((fd < 0) || (fd >= h->nfds))
+		return -EBADF;
+
+	if ((len < 0) || !inside(h, addr, (len + (long)sizeof(mem_t) - 1) / (long)sizeof(mem_t)))
+		return -EFAULT;
+
+	char* buf = (char*)(h->mem + addr);
+
+	ssize_t r = (HOST_READ == s[0]) ? read(h->fds[fd], buf, len) : write(h->fds[fd], buf, len);
+
+	return (-1 == r) ? -errno : r;
+}
+
+static void timer(struct vm_host* h, reg_t r, reg_t tag, reg_t usec)
+{
+	if (h->ntimers == h->mtimers) {
+
+		h->mtimers = h->mtimers ? 2 * h->mtimers : 16;
+		h->timers = realloc(h->timers, h->mtimers * sizeof(struct timer));
+	}
+
+	struct timer* t = &h->timers[h->ntimers++];
+
+	clock_gettime(CLOCK_MONOTONIC, &t->when);
+
+	long ns = t->when.tv_nsec + 1000l * (usec > 0 ? usec : 0);
+
+	t->ring = r;
+	t->tag = tag;
+	t->when.tv_sec += ns / 1000000000;
+	t->when.tv_nsec = ns % 1000000000;
+}
+
+static bool before(const struct timespec* a, const struct timespec* b)
+{
+	return (a->tv_sec < b->tv_sec) || ((a->tv_sec == b->tv_sec) && (a->tv_nsec < b->tv_nsec));
+}
+
+// take all submissions of one ring
+
+static void drain(struct vm_host* h, reg_t r)
+{
+	mem_t* m = ring(h, r);
+
+	if (NULL == m)
+		return;
+
+	reg_t n = m[RING_SIZE];
+	reg_t head = m[RING_SQ_HEAD];
+	reg_t tail = get(&m[RING_SQ_TAIL]);
+	reg_t ctail = m[RING_CQ_TAIL];
+	reg_t chead = get(&m[RING_CQ_HEAD]);
+
+	if (head == tail)
+		return;
+
+	long k = 0;
+
+	for (; (head != tail) && (head - chead < n); head++, k++) {
+
+		const mem_t* s = m + RING_SQ + (head & (n - 1)) * RING_SQE;
+
+		switch (s[0]) {
+		case HOST_NOP:
+			complete(m, &ctail, head, 0);
+			break;
+		case HOST_READ:
+		case HOST_WRITE:
+			complete(m, &ctail, head, io(h, s));
+			break;
+		case HOST_TIMER:
+			timer(h, r, head, s[3]);
+			break;
+		default:
+			complete(m, &ctail, head, -EINVAL);
+			break;
+		}
+	}
+
+	put(&m[RING_SQ_HEAD], head);
+	put(&m[RING_CQ_TAIL], ctail);
+
+	h->batches++;
+	h->requests += k;
+}
+
+// complete expired timers, true if some are left with the
+// earliest deadline in next
+
+static bool expire(struct vm_host* h, struct timespec* next)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	bool any = false;
+
+	for (int i = 0; i < h->ntimers; ) {
+
+		struct timer* t = &h->timers[i];
+
+		if (!before(&now, &t->when)) {
+
+			mem_t* m = ring(h, t->ring);
+
+			if (NULL != m) {
+
+				reg_t ctail = m[RING_CQ_TAIL];
+				complete(m, &ctail, t->tag, 0);
+				put(&m[RING_CQ_TAIL], ctail);
+			}
+
+			*t = h->timers[--h->ntimers];
+			continue;
+		}
+
+		if (!any || before(&t->when, next))
+			*next = t->when;
+
+		any = true;
+		i++;
+	}
+
+	return any;
+}
+
+
+static void* worker(void* _h)
+{
+	struct vm_host* h = _h;
+	reg_t rings[MAX_RINGS];
+
+	pthread_mutex_lock(&h->lock);
+
+	while (!h->quit) {
+
+		struct timespec next;
+		bool wait = expire(h, &next);
+
+		if (!h->rung) {
+
+			if (wait) {
+
+				// the condition variable uses the realtime clock
+
+				struct timespec now, rt;
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				clock_gettime(CLOCK_REALTIME, &rt);
+
+				long ns = rt.tv_nsec + (next.tv_sec - now.tv_sec) * 1000000000l + (next.tv_nsec - now.tv_nsec);
+
+				rt.tv_sec += ns / 1000000000;
+				rt.tv_nsec = ns % 1000000000;
+
+				pthread_cond_timedwait(&h->bell, &h->lock, &rt);
+
+			} else {
+
+				pthread_cond_wait(&h->bell, &h->lock);
+			}
+
+			continue;
+		}
+
+		h->rung = false;
+
+		int n = h->nrings;
+		memcpy(rings, h->rings, n * sizeof(reg_t));
+
+		pthread_mutex_unlock(&h->lock);
+
+		for (int i = 0; i < n; i++)
+			drain(h, rings[i]);
+
+		pthread_mutex_lock(&h->lock);
+	}
+
+	pthread_mutex_unlock(&h->lock);
+
+	return NULL;
+}
+
+
+// SYS: ring the bell of the host of this memory
+
+static reg_t doorbell(mem_t* mem, reg_t r)
+{
+	reg_t ret = -1;
+
+	pthread_mutex_lock(&hosts_lock);
+
+	for (struct vm_host* h = hosts; NULL != h; h = h->next) {
+
+		if (h->mem != mem)
+			continue;
+
+		pthread_mutex_lock(&h->lock);
+
+		int i = 0;
+
+		while ((i < h->nrings) && (h->rings[i] != r))
+			i++;
+
+		if ((i == h->nrings) && (i < MAX_RINGS))
+			h->rings[h->nrings++] = r;
+
+		if (i < h->nrings) {
+
+			h->rung = true;
+			pthread_cond_signal(&h->bell);
+			ret = 0;
+		}
+
+		pthread_mutex_unlock(&h->lock);
+		break;
+	}
+
+	pthread_mutex_unlock(&hosts_lock);
+
+	return ret;
+}
+
+
+struct vm_host* vm_host_create(mem_t* mem, long size, int nfds, const int fds[])
+{
+	struct vm_host* h = calloc(1, sizeof(struct vm_host));
+
+	h->mem = mem;
+	h->size = size;
+	h->nfds = nfds;
+	h->fds = malloc(nfds * sizeof(int));
+	memcpy(h->fds, fds, nfds * sizeof(int));
+
+	pthread_mutex_init(&h->lock, NULL);
+	pthread_cond_init(&h->bell, NULL);
+	pthread_create(&h->thread, NULL, worker, h);
+
+	pthread_mutex_lock(&hosts_lock);
+	h->next = hosts;
+	hosts = h;
+	vm_host_call = doorbell;
+	pthread_mutex_unlock(&hosts_lock);
+
+	return h;
+}
+
+void vm_host_free(struct vm_host* h)
+{
+	pthread_mutex_lock(&hosts_lock);
+
+	for (struct vm_host** x = &hosts; NULL != *x; x = &(*x)->next) {
+
+		if (*x == h) {
+
+			*x = h->next;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&hosts_lock);
+
+	pthread_mutex_lock(&h->lock);
+	h->quit = true;
+	pthread_cond_signal(&h->bell);
+	pthread_mutex_unlock(&h->lock);
+
+	pthread_join(h->thread, NULL);
+
+	pthread_mutex_destroy(&h->lock);
+	pthread_cond_destroy(&h->bell);
+
+	free(h->timers);
+	free(h->fds);
+	free(h);
+}
+
+long vm_host_batches(const struct vm_host* h)
+{
+	return atomic_load(&h->batches);
+}
+
+long vm_host_requests(const struct vm_host* h)
+{
+	return atomic_load(&h->requests);
+}
+
@@ -0,0 +1,36 @@
+/*
+ * asynchronous host calls for tiny cpu
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ */
+
+#ifndef __HOST_H
+#define __HOST_H 1
+
+#include "cpu.h"
+
+// ring header, in words from the start of the ring
+
+enum host_ring {
+
+	RING_SQ_HEAD,	// written by the host
+	RING_SQ_TAIL,	// written by the guest
+	RING_CQ_HEAD,	// written by the guest
+	RING_CQ_TAIL,	// written by the host
+	RING_SIZE,	// entries, a power of two
+	RING_SQ = 8,	// submissions, followed by completions
+};
+
+#define RING_SQE 4	// op fd addr len
+#define RING_CQE 2	// tag res
+
+enum host_op { HOST_NOP, HOST_READ, HOST_WRITE, HOST_TIMER };
+
+struct vm_host;
+
+extern struct vm_host* vm_host_create(mem_t* mem, long size, int nfds, const int fds[]);
+extern void vm_host_free(struct vm_host* h);
+extern long vm_host_batches(const struct vm_host* h);
+extern long vm_host_requests(const struct vm_host* h);
+
+#endif
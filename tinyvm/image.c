@@ -0,0 +1,220 @@
+/*
+ * binary images for tiny cpu
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ *
+ * An image is a header, a table of sections and a table of
+ * relocations, followed by the contents of the sections, each
+ * at a file offset aligned like its address in the vm. Loading
+ * maps every section privately into the address space of the
+ * vm, so nothing is parsed or copied and all processes running
+ * the same image share its pages until they write to them.
+ *
+ * A relocation is the address of a pair of LITs or of a LIW which
+ * holds an absolute code address, as emitted by cnsta() and cnstl(). Only
+ * if an image is loaded at another address than the one it was
+ * assembled for the pairs are changed, which costs a private
+ * copy of the pages they are on.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cpu.h"
+#include "mem.h"
+#include "image.h"
+
+#if 32 != TVM_WORD
+#error "only for 32 bit words"
+#endif
+
+
+#define ALIGN_BYTES (IMG_ALIGN * sizeof(mem_t))
+#define MAX_SECTIONS 64
+#define MAX_RELOCS (1 << 24)
+
+
+int img_write(const char* path, const mem_t* mem, reg_t entry,
+		int nsections, const struct img_section sections[], int nrelocs, const int32_t relocs[])
+{
+	FILE* fp = fopen(path, "w");
+
+	if (NULL == fp)
+		return -1;
+
+	struct img_header h = {
+
+		.magic = IMG_MAGIC,
+		.version = IMG_VERSION,
+		.entry = entry,
+		.nsections = nsections,
+		.nrelocs = nrelocs,
+		.relocs = sizeof(h) + nsections * sizeof(struct img_section),
+	};
+
+	struct img_section s[nsections];
+
+	long off = h.relocs + nrelocs * sizeof(int32_t);
+
+	for (int i = 0; i < nsections; i++) {
+
+		if (0 != sections[i].addr % IMG_ALIGN)
+			goto err;
+
+		off = (off + ALIGN_BYTES - 1) / ALIGN_BYTES * ALIGN_BYTES;
+
+		s[i] = sections[i];
+		s[i].offset = off;
+
+		off += s[i].size * sizeof(mem_t);
+	}
+
+	if (   (1 != fwrite(&h, sizeof(h), 1, fp))
+	    || (nsections != (int)fwrite(s, sizeof(struct img_section), nsections, fp))
+	    || (nrelocs != (int)fwrite(relocs, sizeof(int32_t), nrelocs, fp)))
+		goto err;
+
+	for (int i = 0; i < nsections; i++) {
+
+		if (   (0 != fseek(fp, s[i].offset, SEEK_SET))
+		    || (s[i].size != fwrite(mem + s[i].addr, sizeof(mem_t), s[i].size, fp)))
+			goto err;
+	}
+
+	// pad, so that the last page can be mapped
+
+	if ((0 != fseek(fp, 0, SEEK_END)) || (0 != ftruncate(fileno(fp), (off + ALIGN_BYTES - 1) / ALIGN_BYTES * ALIGN_BYTES)))
+		goto err;
+
+	return fclose(fp);
+
+err:
+	fclose(fp);
+	return -1;
+}
+
+
+static void relocate(mem_t* mem, reg_t at, reg_t delta)
+{
+	if (LIW == ((ins2_t*)&mem[at])->b[0]) {
+
+		mem[at + 1] = (reg_t)((uint32_t)mem[at + 1] + delta);
+		return;
+	}
+
+	ins2_t* hi = (ins2_t*)&mem[at];
+	ins2_t* lo = (ins2_t*)&mem[at + 1];
+
+	uint32_t v = ((uint32_t)hi->b[3] << 24) | ((uint32_t)hi->b[2] << 16) | ((uint32_t)lo->b[3] << 8) | lo->b[2];
+
+	v += delta;
+
+	hi->b[2] = (v >> 16) % 256;
+	hi->b[3] = (v >> 24) % 256;
+	lo->b[2] = (v >> 0) % 256;
+	lo->b[3] = (v >> 8) % 256;
+}
+
+// true if [at, at + len) is in the file contents of a section
+
+static bool inside(int n, const struct img_section s[n], long at, long len)
+{
+	for (int i = 0; i < n; i++)
+		if ((at >= s[i].addr) && (at + len <= (long)s[i].addr + s[i].size))
+			return true;
+
+	return false;
+}
+
+// map an image moved by delta words, returns the entry or -1.
+// Nothing in the file is trusted: all addresses must stay in
+// the 32 bit space of the vm and the file, and relocations in
+// the sections.
+
+reg_t img_load(struct vm_mem* m, const char* path, reg_t delta)
+{
+	int fd = open(path, O_RDONLY);
+
+	if (-1 == fd)
+		return -1;
+
+	reg_t entry = -1;
+	struct img_header h;
+
+	struct stat st;
+
+	if (   (sizeof(h) != read(fd, &h, sizeof(h)))
+	    || (IMG_MAGIC != h.magic) || (IMG_VERSION != h.version)
+	    || (h.nsections > MAX_SECTIONS) || (h.nrelocs > MAX_RELOCS)
+	    || (h.relocs != sizeof(h) + h.nsections * sizeof(struct img_section))
+	    || (0 != delta % IMG_ALIGN) || (0 != fstat(fd, &st)))
+		goto out;
+
+	// the tables are small, the contents are not read
+
+	size_t tsize = h.nsections * sizeof(struct img_section) + h.nrelocs * sizeof(int32_t);
+	struct img_section* s = malloc(tsize);
+
+	if (NULL == s)
+		goto out;
+
+	int32_t* r = (int32_t*)(s + h.nsections);
+
+	if (tsize != (size_t)pread(fd, s, tsize, sizeof(h)))
+		goto out2;
+
+	for (unsigned int i = 0; i < h.nsections; i++) {
+
+		long a = (long)s[i].addr + delta;
+		long e = a + ((s[i].msize > s[i].size) ? s[i].msize : s[i].size);
+
+		if (   (0 != s[i].addr % IMG_ALIGN) || (a < INT32_MIN) || (e > (long)INT32_MAX + 1)
+		    || ((long)s[i].offset + (long)s[i].size * (long)sizeof(mem_t) > st.st_size))
+			goto out2;
+	}
+
+	// a relocation changes the word at and the one after it
+
+	for (unsigned int i = 0; i < h.nrelocs; i++)
+		if (!inside(h.nsections, s, r[i], 2))
+			goto out2;
+
+	mem_t* mem = vm_mem_base(m);
+
+	for (unsigned int i = 0; i < h.nsections; i++) {
+
+		bool write = (0 != (s[i].flags & IMG_WRITE));
+
+		if (!vm_mem_map_file(m, s[i].addr + delta, s[i].size, fd, s[i].offset, write || (0 != delta)))
+			goto out2;
+
+		// zero fill behind the file contents
+
+		if (s[i].msize > s[i].size)
+			vm_mem_map(m, s[i].addr + delta + s[i].size, s[i].msize - s[i].size, write);
+	}
+
+	if (0 != delta) {
+
+		for (unsigned int i = 0; i < h.nrelocs; i++)
+			relocate(mem, r[i] + delta, delta);
+
+		for (unsigned int i = 0; i < h.nsections; i++)
+			if (0 == (s[i].flags & IMG_WRITE))
+				vm_mem_protect(m, s[i].addr + delta, s[i].size, false);
+	}
+
+	entry = h.entry + delta;
+
+out2:
+	free(s);
+out:
+	close(fd);
+	return entry;
+}
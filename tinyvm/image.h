@@ -0,0 +1,44 @@
+/*
+ * binary images for tiny cpu
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ */
+
+#ifndef __IMAGE_H
+#define __IMAGE_H 1
+
+#include <stdint.h>
+
+#include "cpu.h"
+#include "mem.h"
+
+#define IMG_MAGIC 0x494d5654u	// "TVMI"
+#define IMG_VERSION 1
+#define IMG_ALIGN 16384		// words, 64 KiB
+
+enum img_flags { IMG_CODE = 1, IMG_DATA = 2, IMG_WRITE = 4 };
+
+struct img_header {
+
+	uint32_t magic;
+	uint32_t version;
+	int32_t entry;
+	uint32_t nsections;
+	uint32_t nrelocs;
+	uint32_t relocs;	// file offset of the table
+};
+
+struct img_section {
+
+	uint32_t flags;
+	int32_t addr;		// words, aligned to IMG_ALIGN
+	uint32_t size;		// words in the file
+	uint32_t msize;		// words in memory, the rest is zero
+	uint32_t offset;	// file offset, aligned to IMG_ALIGN words
+};
+
+extern int img_write(const char* path, const mem_t* mem, reg_t entry,
+		int nsections, const struct img_section sections[], int nrelocs, const int32_t relocs[]);
+extern reg_t img_load(struct vm_mem* m, const char* path, reg_t delta);
+
+#endif
@@ -0,0 +1,883 @@
+/*
+ * x86-64 jit for tiny cpu
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ *
+ * Code is translated one basic block at a time. A block ends
+ * at the first instruction which writes IP or at a page boundary
+ * (64 words). Conditional moves into IP leave the block only if
+ * the condition holds. Reads of IP are constants.
+ *
+ * host registers:
+ *
+ * r15		memory
+ * r14		register file
+ * rax rcx rdx	scratch
+ * rbx rbp rsi rdi r8-r13	SP AR C0 C1 FP RR U1 U2 A1 A2
+ *
+ * All other registers live in the register file. Blocks are
+ * chained through a direct-mapped table which is searched by
+ * native code. Everything the translator does not know (STP,
+ * SYS, atomics, SPAWN, unknown opcodes, LIT into IP) is left
+ * to the interpreter.
+ *
+ * A store into a page which contains translated code leaves the
+ * block and drops all translations of that page, as for the
+ * block cache. This handles the trampolines created by tramp().
+ * CLO and CAL store two words, which may be in two pages. The
+ * branches of version 2 leave the block if they are taken, LIW
+ * at the end of a page is left to the interpreter.
+ *
+ * The code buffer is mapped twice, once writable and once
+ * executable, so that no page is both.
+ *
+ * In diff mode each instruction increments a counter, blocks
+ * are not chained, and jit_diff() runs vm_step() on a copy
+ * of the machine the same number of steps after each block.
+ */
+
+#ifdef __x86_64__
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "cpu.h"
+#include "asm.h"
+#include "jit.h"
+
+#if 32 != TVM_WORD
+#error "only for 32 bit words"
+#endif
+
+
+#define PAGE_BITS 6
+#define HASH_BITS 12
+#define TABLE_BITS 12
+#define CODE_SIZE (16 << 20)
+#define BLOCK_MAX (64 * 128)	// bound for the code of one block
+
+enum exit_kind { X_CONT, X_STORE, X_STORE2, X_INTERP };
+
+struct tentry {
+
+	int32_t pc;
+	int32_t pad;
+	const void* code;
+};
+
+struct tblock {
+
+	struct tblock* next;
+	reg_t addr;
+	const void* code;
+};
+
+struct jit {
+
+	mem_t* mem;
+	bool diff;
+
+	unsigned char* buf;	// code buffer, executable
+	long wdelta;		// to the writable mapping of buf
+	unsigned char* out;	// free space in buf
+	unsigned char* start;	// first block after the stubs
+
+	unsigned char* ptr;	// emit here
+	long delta;		// distance from ptr to the final location
+
+	uint64_t (*enter)(reg_t* regs, mem_t* mem, const void* code);
+	unsigned char* exit;
+	unsigned char* miss;
+	unsigned char* dispatch;
+
+	uint8_t* code;		// pages with translated code
+	int32_t aux;
+	int32_t count;
+
+	struct tblock* hash[1 << HASH_BITS];
+	struct tentry table[1 << TABLE_BITS];
+};
+
+
+// x86 registers
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+static const signed char host[256] = {
+
+	[0 ... 255] = -1,
+	[SP] = RBX, [AR] = RBP, [C0] = RSI, [C1] = RDI, [FP] = R8, [RR] = R9,
+	[U1] = R10, [U2] = R11, [A1] = R12, [A2] = R13,
+};
+
+
+static void b1(struct jit* j, uint8_t x)
+{
+	*j->ptr++ = x;
+}
+
+static void d32(struct jit* j, uint32_t x)
+{
+	memcpy(j->ptr, &x, 4);
+	j->ptr += 4;
+}
+
+static void d64(struct jit* j, uint64_t x)
+{
+	memcpy(j->ptr, &x, 8);
+	j->ptr += 8;
+}
+
+static void bytes(struct jit* j, int n, const uint8_t* x)
+{
+	memcpy(j->ptr, x, n);
+	j->ptr += n;
+}
+
+#define B(...) bytes(j, sizeof((uint8_t[]){ __VA_ARGS__ }), (uint8_t[]){ __VA_ARGS__ })
+
+
+// 32-bit operation with register r and VM register v
+
+static void rm(struct jit* j, int n, const uint8_t* opc, int r, int v)
+{
+	int h = host[v];
+
+	if (-1 != h) {
+
+		uint8_t rex = 0x40 | ((r >> 3) << 2) | (h >> 3);
+
+		if (0x40 != rex)
+			b1(j, rex);
+
+		bytes(j, n, opc);
+		b1(j, 0xC0 | ((r & 7) << 3) | (h & 7));
+
+	} else {
+
+		b1(j, 0x41 | ((r >> 3) << 2));
+		bytes(j, n, opc);
+		b1(j, 0x80 | ((r & 7) << 3) | (R14 & 7));
+		d32(j, 4 * v);
+	}
+}
+
+// same with a register file slot
+
+static void rf(struct jit* j, uint8_t opc, int r, int v)
+{
+	b1(j, 0x41 | ((r >> 3) << 2));
+	b1(j, opc);
+	b1(j, 0x80 | ((r & 7) << 3) | (R14 & 7));
+	d32(j, 4 * v);
+}
+
+static void op(struct jit* j, uint8_t opc, int r, int v)
+{
+	rm(j, 1, (uint8_t[]){ opc }, r, v);
+}
+
+static void ld(struct jit* j, int r, reg_t pc, int v)
+{
+	if (IP == v) {
+
+		// mov r, imm32
+		if (r >= 8)
+			b1(j, 0x41);
+
+		b1(j, 0xB8 + (r & 7));
+		d32(j, pc + 1);
+
+	} else {
+
+		op(j, 0x8B, r, v);
+	}
+}
+
+static void st(struct jit* j, int v, int r)
+{
+	op(j, 0x89, r, v);
+}
+
+
+static void jmp(struct jit* j, const unsigned char* target)
+{
+	b1(j, 0xE9);
+	d32(j, (uint32_t)(target - (j->ptr + j->delta + 4)));
+}
+
+// leave the block, pc in eax
+
+static void jmp_next(struct jit* j)
+{
+	jmp(j, j->diff ? j->miss : j->dispatch);
+}
+
+static void exit_to(struct jit* j, reg_t pc)
+{
+	B(0xB8); d32(j, pc);		// mov eax, pc
+	jmp_next(j);
+}
+
+static void exit_kind(struct jit* j, reg_t pc, enum exit_kind k)
+{
+	B(0xB8); d32(j, pc);		// mov eax, pc
+	B(0xBA); d32(j, k);		// mov edx, k
+	jmp(j, j->exit);
+}
+
+// store eax into VM register v, ends the block for IP
+
+static bool result(struct jit* j, int v)
+{
+	if (IP == v) {
+
+		jmp_next(j);
+		return true;
+	}
+
+	st(j, v, RAX);
+	return false;
+}
+
+// eax = b + c
+
+static void sum(struct jit* j, reg_t pc, int b, int c)
+{
+	ld(j, RAX, pc, b);
+
+	if (IP == c) {
+
+		ld(j, RCX, pc, c);
+		B(0x01, 0xC8);			// add eax, ecx
+
+	} else {
+
+		op(j, 0x03, RAX, c);
+	}
+}
+
+
+// store ecx at eax, leave the block if it was code
+
+static void st_mem(struct jit* j, reg_t pc)
+{
+	B(0x48, 0x63, 0xD0);		// movsxd rdx, eax
+	B(0x41, 0x89, 0x0C, 0x97);	// mov [r15 + rdx * 4], ecx
+
+	B(0x89, 0xC1);			// mov ecx, eax
+	B(0xC1, 0xE9, PAGE_BITS);	// shr ecx, PAGE_BITS
+	B(0x48, 0xBA); d64(j, (uint64_t)j->code);	// mov rdx, code
+	B(0x80, 0x3C, 0x0A, 0x00);	// cmp byte [rdx + rcx], 0
+	B(0x74, 0x00);			// jz skip
+
+	unsigned char* skip = j->ptr;
+
+	B(0x89, 0xC1);			// mov ecx, eax
+	exit_kind(j, pc + 1, X_STORE);
+
+	skip[-1] = (uint8_t)(j->ptr - skip);
+}
+
+
+/*
+ * The block is assembled into a temporary buffer and copied
+ * in one go, as storing byte by byte into pages the CPU is
+ * executing from is slow.
+ */
+static const void* translate(struct jit* j, reg_t pc)
+{
+	unsigned char tmp[BLOCK_MAX];
+
+	j->ptr = tmp;
+	j->delta = j->out - tmp;
+
+	uint32_t end = (((uint32_t)pc >> PAGE_BITS) + 1) << PAGE_BITS;
+
+	mem_t* mem = j->mem;
+
+	while (true) {
+
+		if ((uint32_t)pc == end) {
+
+			exit_to(j, pc);
+			break;
+		}
+
+		if (j->diff) {
+
+			B(0x48, 0xBA); d64(j, (uint64_t)&j->count);	// mov rdx, &count
+			B(0xFF, 0x02);					// inc dword [rdx]
+		}
+
+		ins2_t i = { .w = mem[pc] };
+
+		int a = i.b[1];
+		int b = i.b[2];
+		int c = i.b[3];
+
+		switch (i.b[0]) {
+		case ADD ... XOR:
+
+			ld(j, RAX, pc, b);
+			ld(j, RCX, pc, c);
+
+			switch (i.b[0]) {
+			case ADD: B(0x01, 0xC8); break;		// add eax, ecx
+			case SUB: B(0x29, 0xC8); break;		// sub eax, ecx
+			case MUL: B(0x0F, 0xAF, 0xC1); break;	// imul eax, ecx
+			case DIV: B(0x99, 0xF7, 0xF9); break;	// cdq; idiv ecx
+			case MOD: B(0x99, 0xF7, 0xF9, 0x89, 0xD0); break; // mov eax, edx
+			case AND: B(0x21, 0xC8); break;		// and eax, ecx
+			case OR:  B(0x09, 0xC8); break;		// or eax, ecx
+			case XOR: B(0x31, 0xC8); break;		// xor eax, ecx
+			}
+
+			if (result(j, a))
+				goto out;
+
+			break;
+
+		case LIT:
+
+			if (IP == a) {
+
+				exit_kind(j, pc, X_INTERP);
+				goto out;
+			}
+
+			ld(j, RAX, pc, a);
+			B(0xC1, 0xE0, 0x10);		// shl eax, 16
+			B(0x05); d32(j, ((uint32_t)c << 8) + b);	// add eax, imm32
+			st(j, a, RAX);
+			break;
+
+		case MOV:
+		{
+			ld(j, RAX, pc, a);
+			B(0x85, 0xC0);			// test eax, eax
+			B(0x0F, 0x84); d32(j, 0);	// jz skip
+			unsigned char* skip = j->ptr;
+
+			ld(j, RAX, pc, c);
+			bool done = result(j, b);
+
+			uint32_t rel = (uint32_t)(j->ptr - skip);
+			memcpy(skip - 4, &rel, 4);
+
+			// jump
+			if (done && (C1 == a)) {
+
+				exit_to(j, pc + 1);
+				goto out;
+			}
+
+			break;
+		}
+
+		case LOD:
+
+			sum(j, pc, b, c);
+			B(0x48, 0x63, 0xC0);		// movsxd rax, eax
+			B(0x41, 0x8B, 0x04, 0x87);	// mov eax, [r15 + rax * 4]
+
+			if (result(j, a))
+				goto out;
+
+			break;
+
+		case STO:
+
+			sum(j, pc, a, c);
+			ld(j, RCX, pc, b);
+			st_mem(j, pc);
+			break;
+
+		case ADDI:
+
+			ld(j, RAX, pc, b);
+			B(0x05); d32(j, (int8_t)c);	// add eax, imm32
+
+			if (result(j, a))
+				goto out;
+
+			break;
+
+		case LDD:
+
+			ld(j, RAX, pc, b);
+			B(0x48, 0x63, 0xC0);		// movsxd rax, eax
+			B(0x41, 0x8B, 0x84, 0x87); d32(j, 4 * (int8_t)c);	// mov eax, [r15 + rax * 4 + 4 * k]
+
+			if (result(j, a))
+				goto out;
+
+			break;
+
+		case STD:
+
+			ld(j, RAX, pc, a);
+			B(0x05); d32(j, (int8_t)c);	// add eax, imm32
+			ld(j, RCX, pc, b);
+			st_mem(j, pc);
+			break;
+
+		case BNZ:
+		case BLZ:
+		{
+			ld(j, RAX, pc, a);
+			B(0x85, 0xC0);			// test eax, eax
+			B((BNZ == i.b[0]) ? 0x74 : 0x79, 0x00);	// jz / jns skip
+			unsigned char* skip = j->ptr;
+
+			exit_to(j, (reg_t)((uint32_t)pc + 1 + (uint32_t)(int16_t)((c << 8) | b)));
+
+			skip[-1] = (uint8_t)(j->ptr - skip);
+			break;
+		}
+
+		case LIW:
+
+			if ((IP == a) || ((uint32_t)pc + 1 == end)) {
+
+				exit_kind(j, pc, X_INTERP);
+				goto out;
+			}
+
+			B(0xB8); d32(j, mem[pc + 1]);	// mov eax, imm32
+			st(j, a, RAX);
+			pc++;
+			break;
+
+		case CLO:
+		{
+			ld(j, RAX, pc, a);
+			ld(j, RCX, pc, b);
+			B(0x48, 0x63, 0xD0);		// movsxd rdx, eax
+			B(0x41, 0x89, 0x0C, 0x97);	// mov [r15 + rdx * 4], ecx
+			ld(j, RCX, pc, c);
+			B(0x41, 0x89, 0x4C, 0x97, 0x04);	// mov [r15 + rdx * 4 + 4], ecx
+
+			B(0x89, 0xC1);			// mov ecx, eax
+			B(0xC1, 0xE9, PAGE_BITS);	// shr ecx, PAGE_BITS
+			B(0x48, 0xBA); d64(j, (uint64_t)j->code);	// mov rdx, code
+			B(0x80, 0x3C, 0x0A, 0x00);	// cmp byte [rdx + rcx], 0
+			B(0x75, 0x00);			// jnz hit
+			unsigned char* hit = j->ptr;
+
+			B(0x8D, 0x48, 0x01);		// lea ecx, [rax + 1]
+			B(0xC1, 0xE9, PAGE_BITS);	// shr ecx, PAGE_BITS
+			B(0x80, 0x3C, 0x0A, 0x00);	// cmp byte [rdx + rcx], 0
+			B(0x74, 0x00);			// jz skip
+			unsigned char* skip = j->ptr;
+
+			hit[-1] = (uint8_t)(j->ptr - hit);
+
+			B(0x89, 0xC1);			// mov ecx, eax
+			exit_kind(j, pc + 1, X_STORE2);
+
+			skip[-1] = (uint8_t)(j->ptr - skip);
+			break;
+		}
+
+		case CAL:
+		{
+			if ((IP == a) || (IP == b)) {
+
+				exit_kind(j, pc, X_INTERP);
+				goto out;
+			}
+
+			ld(j, RAX, pc, b);
+			B(0x48, 0x63, 0xC0);		// movsxd rax, eax
+			B(0x41, 0x8B, 0x4C, 0x87, 0x04);	// mov ecx, [r15 + rax * 4 + 4]
+			B(0x41, 0x8B, 0x04, 0x87);	// mov eax, [r15 + rax * 4]
+
+			ld(j, RDX, pc, a);
+			B(0x48, 0x63, 0xD2);		// movsxd rdx, edx
+			B(0x41, 0x89, 0x4C, 0x97, 0x04);	// mov [r15 + rdx * 4 + 4], ecx
+			B(0x41, 0xC7, 0x44, 0x97, 0x08); d32(j, pc);	// mov dword [r15 + rdx * 4 + 8], pc
+			B(0x83, 0xC2, 0x02);		// add edx, 2
+			st(j, a, RDX);
+
+			// target in eax
+			B(0x8D, 0x4A, 0xFF);		// lea ecx, [rdx - 1]
+			B(0xC1, 0xE9, PAGE_BITS);	// shr ecx, PAGE_BITS
+			B(0x48, 0xBA); d64(j, (uint64_t)j->code);	// mov rdx, code
+			B(0x80, 0x3C, 0x0A, 0x00);	// cmp byte [rdx + rcx], 0
+			B(0x75, 0x00);			// jnz hit
+			unsigned char* hit = j->ptr;
+
+			ld(j, RCX, pc, a);
+			B(0xC1, 0xE9, PAGE_BITS);	// shr ecx, PAGE_BITS
+			B(0x80, 0x3C, 0x0A, 0x00);	// cmp byte [rdx + rcx], 0
+			B(0x74, 0x00);			// jz skip
+			unsigned char* skip = j->ptr;
+
+			hit[-1] = (uint8_t)(j->ptr - hit);
+
+			ld(j, RCX, pc, a);
+			B(0x83, 0xE9, 0x01);		// sub ecx, 1
+			B(0xBA); d32(j, X_STORE2);	// mov edx, X_STORE2
+			jmp(j, j->exit);
+
+			skip[-1] = (uint8_t)(j->ptr - skip);
+
+			jmp_next(j);
+			goto out;
+		}
+
+		default:
+
+			exit_kind(j, pc, X_INTERP);
+			goto out;
+		}
+
+		pc++;
+	}
+
+out:	;
+	long n = j->ptr - tmp;
+	unsigned char* code = j->out;
+
+	memcpy(code + j->wdelta, tmp, n);
+
+	j->out += n;
+	j->delta = 0;
+
+	return code;
+}
+
+
+
+static void stubs(struct jit* j)
+{
+	static const int saved[] = { RBX, RBP, R12, R13, R14, R15 };
+
+	j->ptr = j->buf + j->wdelta;
+	j->delta = -j->wdelta;
+
+	// uint64_t enter(reg_t* regs, mem_t* mem, const void* code)
+
+	j->enter = (void*)(j->ptr + j->delta);
+
+	for (int i = 0; i < 6; i++) {
+
+		if (saved[i] >= 8)
+			b1(j, 0x41);
+
+		b1(j, 0x50 + (saved[i] & 7));		// push
+	}
+
+	B(0x49, 0x89, 0xFE);		// mov r14, rdi
+	B(0x49, 0x89, 0xF7);		// mov r15, rsi
+	B(0x48, 0x89, 0xD0);		// mov rax, rdx
+
+	for (int v = 0; v < 256; v++)
+		if (-1 != host[v])
+			rf(j, 0x8B, host[v], v);
+
+	B(0xFF, 0xE0);			// jmp rax
+
+	// block not found, pc in eax
+
+	j->miss = j->ptr + j->delta;
+	B(0x31, 0xD2);			// xor edx, edx
+
+	// exit with pc in eax, kind in edx, aux in ecx
+
+	j->exit = j->ptr + j->delta;
+
+	for (int v = 0; v < 256; v++)
+		if (-1 != host[v])
+			rf(j, 0x89, host[v], v);
+
+	B(0x48, 0xBE); d64(j, (uint64_t)&j->aux);	// mov rsi, &aux
+	B(0x89, 0x0E);			// mov [rsi], ecx
+	B(0x48, 0xC1, 0xE2, 0x20);	// shl rdx, 32
+	B(0x89, 0xC0);			// mov eax, eax
+	B(0x48, 0x09, 0xD0);		// or rax, rdx
+
+	for (int i = 5; i >= 0; i--) {
+
+		if (saved[i] >= 8)
+			b1(j, 0x41);
+
+		b1(j, 0x58 + (saved[i] & 7));		// pop
+	}
+
+	B(0xC3);			// ret
+
+	// look up pc in eax
+
+	j->dispatch = j->ptr + j->delta;
+	B(0x89, 0xC1);			// mov ecx, eax
+	B(0x81, 0xE1); d32(j, (1 << TABLE_BITS) - 1);	// and ecx, mask
+	B(0x48, 0xC1, 0xE1, 0x04);	// shl rcx, 4
+	B(0x48, 0xBA); d64(j, (uint64_t)j->table);	// mov rdx, table
+	B(0x48, 0x01, 0xCA);		// add rdx, rcx
+	B(0x39, 0x02);			// cmp [rdx], eax
+	B(0x0F, 0x85); d32(j, (uint32_t)(j->miss - (j->ptr + j->delta + 4)));	// jne miss
+	B(0xFF, 0x62, 0x08);		// jmp [rdx + 8]
+
+	j->start = j->ptr + j->delta;
+	j->delta = 0;
+}
+
+
+static unsigned int hash(reg_t addr)
+{
+	return ((uint32_t)addr * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static void table_clear(struct jit* j, unsigned int i)
+{
+	j->table[i].pc = i + 1;	// never matches
+	j->table[i].code = NULL;
+}
+
+static void flush(struct jit* j)
+{
+	for (int i = 0; i < (1 << HASH_BITS); i++) {
+
+		while (NULL != j->hash[i]) {
+
+			struct tblock* b = j->hash[i];
+			j->hash[i] = b->next;
+			free(b);
+		}
+	}
+
+	for (int i = 0; i < (1 << TABLE_BITS); i++)
+		table_clear(j, i);
+
+	madvise(j->code, 1ul << (32 - PAGE_BITS), MADV_DONTNEED);
+
+	j->out = j->start;
+}
+
+struct jit* jit_create(mem_t* mem, bool diff)
+{
+	struct jit* j = calloc(1, sizeof(struct jit));
+
+	j->mem = mem;
+	j->diff = diff;
+
+	int fd = memfd_create("jit", MFD_CLOEXEC);
+
+	if ((-1 == fd) || (0 != ftruncate(fd, CODE_SIZE))) {
+
+		perror("jit");
+		abort();
+	}
+
+	unsigned char* wbuf = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	j->buf = mmap(NULL, CODE_SIZE, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+	j->code = mmap(NULL, 1ul << (32 - PAGE_BITS), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	close(fd);
+
+	if ((MAP_FAILED == wbuf) || (MAP_FAILED == j->buf) || (MAP_FAILED == j->code)) {
+
+		perror("jit");
+		abort();
+	}
+
+	j->wdelta = wbuf - j->buf;
+
+	stubs(j);
+	flush(j);
+
+	return j;
+}
+
+void jit_free(struct jit* j)
+{
+	flush(j);
+	munmap(j->buf + j->wdelta, CODE_SIZE);
+	munmap(j->buf, CODE_SIZE);
+	munmap(j->code, 1ul << (32 - PAGE_BITS));
+	free(j);
+}
+
+
+static const void* lookup(struct jit* j, reg_t pc)
+{
+	struct tblock* b;
+
+	for (b = j->hash[hash(pc)]; NULL != b; b = b->next)
+		if (b->addr == pc)
+			goto found;
+
+	if (j->out + BLOCK_MAX > j->buf + CODE_SIZE)
+		flush(j);
+
+	b = malloc(sizeof(struct tblock));
+	b->addr = pc;
+	b->code = translate(j, pc);
+	b->next = j->hash[hash(pc)];
+	j->hash[hash(pc)] = b;
+
+	j->code[(uint32_t)pc >> PAGE_BITS] = 1;
+
+found:	;
+	struct tentry* e = &j->table[(uint32_t)pc % (1 << TABLE_BITS)];
+	e->pc = pc;
+	e->code = b->code;
+
+	return b->code;
+}
+
+static void invalidate(struct jit* j, reg_t addr)
+{
+	uint32_t p = (uint32_t)addr >> PAGE_BITS;
+
+	j->code[p] = 0;
+
+	for (uint32_t a = p << PAGE_BITS; a < (p + 1) << PAGE_BITS; a++) {
+
+		struct tblock** bp = &j->hash[hash(a)];
+
+		while (NULL != *bp) {
+
+			struct tblock* b = *bp;
+
+			if (b->addr == (reg_t)a) {
+
+				*bp = b->next;
+				free(b);
+
+			} else {
+
+				bp = &b->next;
+			}
+		}
+
+		if (j->table[a % (1 << TABLE_BITS)].pc == (reg_t)a)
+			table_clear(j, a % (1 << TABLE_BITS));
+	}
+}
+
+
+// run one block, returns exit kind or -1 on stop
+
+static int step(struct jit* j, reg_t regs[256])
+{
+	uint64_t r = j->enter(regs, j->mem, lookup(j, regs[0]));
+	int k = r >> 32;
+
+	regs[0] = (reg_t)(uint32_t)r;
+
+	switch (k) {
+	case X_STORE:
+		invalidate(j, j->aux);
+		break;
+	case X_STORE2:
+		invalidate(j, j->aux);
+		invalidate(j, j->aux + 1);
+		break;
+	case X_INTERP:
+	{
+		ins2_t i = { .w = j->mem[regs[0]] };
+		reg_t x = (IP == i.b[2]) ? (regs[0] + 1) : regs[i.b[2]];
+
+		if (!vm_step(regs, j->mem))
+			return -1;
+
+		// atomics may store into code
+		if (((CAS == i.b[0]) || (XADD == i.b[0])) && j->code[(uint32_t)x >> PAGE_BITS])
+			invalidate(j, x);
+
+		break;
+	}
+	}
+
+	return k;
+}
+
+void jit_run(struct jit* j, reg_t regs[256])
+{
+	while (-1 != step(j, regs))
+		;
+}
+
+// The engine for vm_fun_t keeps one jit per thread, so that only
+// its translations are dropped between calls, which may change
+// the code from outside. Users which run the same code many times
+// keep translations with jit_create() and jit_run().
+
+static _Thread_local struct jit* warm;
+
+void vm_jit(reg_t regs[256], mem_t* mem)
+{
+	if (NULL == warm)
+		warm = jit_create(mem, false);
+	else
+		flush(warm);
+
+	warm->mem = mem;
+	jit_run(warm, regs);
+}
+
+
+// run jit and interpreter in lockstep, returns number of blocks or -1
+
+long jit_diff(reg_t regs[256], mem_t* mem, long size)
+{
+	mem_t* mem2 = malloc(size * sizeof(mem_t));
+	memcpy(mem2, mem, size * sizeof(mem_t));
+
+	reg_t regs2[256];
+	memcpy(regs2, regs, sizeof(regs2));
+
+	struct jit* j = jit_create(mem, true);
+
+	long blocks = 0;
+	int k;
+
+	do {
+		reg_t pc = regs[0];
+
+		j->count = 0;
+		k = step(j, regs);
+
+		// includes an instruction left to the interpreter
+		for (int i = 0; i < j->count; i++)
+			vm_step(regs2, mem2);
+
+		blocks++;
+
+		for (int r = 0; r < 256; r++) {
+
+			if (regs[r] != regs2[r]) {
+
+				fprintf(stderr, "jit: block %ld at %d: r%d is %d, expected %d\n",
+					blocks, pc, r, regs[r], regs2[r]);
+
+				blocks = -1;
+				goto out;
+			}
+		}
+
+	} while (-1 != k);
+
+	if (0 != memcmp(mem, mem2, size * sizeof(mem_t))) {
+
+		fprintf(stderr, "jit: memory differs\n");
+		blocks = -1;
+	}
+
+out:
+	jit_free(j);
+	free(mem2);
+
+	return blocks;
+}
+
+#endif
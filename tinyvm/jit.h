@@ -0,0 +1,24 @@
+/*
+ * x86-64 jit for tiny cpu
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ */
+
+#ifndef __JIT_H
+#define __JIT_H 1
+
+#include <stdbool.h>
+
+#include "cpu.h"
+
+struct jit;
+
+// translations are kept from one jit_run() to the next, the
+// code must only be changed by the program itself in between
+
+extern struct jit* jit_create(mem_t* mem, bool diff);
+extern void jit_free(struct jit* j);
+extern void jit_run(struct jit* j, reg_t regs[256]);
+extern long jit_diff(reg_t regs[256], mem_t* mem, long size);
+
+#endif
@@ -0,0 +1,400 @@
+/*
+ * sparse guarded memory for tiny cpu
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ *
+ * The whole space a 32 bit index can reach is reserved without
+ * access rights and without swap, so it costs address space but
+ * no memory. Regions are opened with vm_mem_map() and the kernel
+ * commits their pages when they are first touched. Everything
+ * else is a guard: a load or store there raises SIGSEGV, which
+ * vm_mem_run() turns into VM_FAULT. The engines need no checks.
+ *
+ * Indices may be sign or zero extended by an engine, so the
+ * reservation covers [-2^31, 2^32) words around the base.
+ *
+ * After a fault only vm() leaves exact registers behind (with
+ * IP after the faulting instruction). The other engines keep
+ * state in host registers. A fault leaves them by siglongjmp(),
+ * past any cleanup: vm_bbc() and vm_bbc_fuel() leak their block
+ * cache, a jit or block cache made with jit_create() or
+ * bbc_create() has to be freed by its user, and vm_jit() keeps
+ * the jit of the thread for the next call.
+ *
+ * A snapshot copies the registers and all pages of all regions
+ * into a memory file, pages which are zero stay holes. Residency
+ * says nothing about the contents: a page may be swapped out or
+ * belong to an image which is not in the page cache. Reading a
+ * page which was never touched maps the zero page and commits
+ * nothing. A fork maps that file privately at the same places,
+ * so it shares all pages with the snapshot until it writes to
+ * them and costs a few system calls no matter how large the
+ * memory is.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "cpu.h"
+#include "mem.h"
+
+#if 32 != TVM_WORD
+#error "only for 32 bit words"
+#endif
+
+
+#define LOW (1l << 31)		// words below the base
+#define HIGH (1l << 32)		// words above the base
+
+struct region {
+
+	long start;	// in words, page aligned
+	long size;
+	bool write;
+};
+
+struct vm_mem {
+
+	char* res;
+	mem_t* base;
+	long page;	// in words
+
+	int nregions;
+	int mregions;
+	struct region* regions;
+
+	long fault;
+};
+
+
+static _Thread_local struct vm_mem* current;
+static _Thread_local sigjmp_buf* env;
+static struct sigaction old;
+
+
+static void handler(int sig, siginfo_t* si, void* uc)
+{
+	struct vm_mem* m = current;
+	char* a = si->si_addr;
+
+	if ((NULL != m) && (a >= m->res) && (a < m->res + (LOW + HIGH) * sizeof(mem_t))) {
+
+		m->fault = ((mem_t*)a - m->base);
+		siglongjmp(*env, 1);
+	}
+
+	// not ours
+
+	if (old.sa_flags & SA_SIGINFO) {
+
+		old.sa_sigaction(sig, si, uc);
+		return;
+	}
+
+	if ((SIG_DFL == old.sa_handler) || (SIG_IGN == old.sa_handler)) {
+
+		signal(sig, SIG_DFL);	// fault again and die
+		return;
+	}
+
+	old.sa_handler(sig);
+}
+
+static void install(void)
+{
+	static bool done = false;
+
+	if (done)
+		return;
+
+	struct sigaction sa = { .sa_sigaction = handler, .sa_flags = SA_SIGINFO | SA_NODEFER };
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGSEGV, &sa, &old);
+
+	done = true;
+}
+
+
+struct vm_mem* vm_mem_create(void)
+{
+	size_t len = (LOW + HIGH) * sizeof(mem_t);
+
+	char* res = mmap(NULL, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if (MAP_FAILED == res)
+		return NULL;
+
+	struct vm_mem* m = calloc(1, sizeof(struct vm_mem));
+
+	m->res = res;
+	m->base = (mem_t*)res + LOW;
+	m->page = sysconf(_SC_PAGESIZE) / sizeof(mem_t);
+	m->fault = -1;
+
+	install();
+
+	return m;
+}
+
+void vm_mem_free(struct vm_mem* m)
+{
+	munmap(m->res, (LOW + HIGH) * sizeof(mem_t));
+	free(m->regions);
+	free(m);
+}
+
+mem_t* vm_mem_base(struct vm_mem* m)
+{
+	return m->base;
+}
+
+// record a region, there may be any number
+
+static void add(struct vm_mem* m, struct region r)
+{
+	if (m->nregions == m->mregions) {
+
+		m->mregions = m->mregions ? 2 * m->mregions : 16;
+		m->regions = realloc(m->regions, m->mregions * sizeof(struct region));
+
+		if (NULL == m->regions)
+			abort();
+	}
+
+	m->regions[m->nregions++] = r;
+}
+
+// make [start, start + size) accessible, rounded out to whole pages
+
+void vm_mem_map(struct vm_mem* m, reg_t start, long size, bool write)
+{
+	long s = start - ((start % m->page + m->page) % m->page);
+	long e = start + size;
+
+	e += (m->page - (e % m->page + m->page) % m->page) % m->page;
+
+	if (0 != mprotect(m->base + s, (e - s) * sizeof(mem_t), PROT_READ | (write ? PROT_WRITE : 0)))
+		abort();
+
+	add(m, (struct region){ s, e - s, write });
+}
+
+// change the access rights of pages which are already mapped
+
+void vm_mem_protect(struct vm_mem* m, reg_t start, long size, bool write)
+{
+	long s = start - ((start % m->page + m->page) % m->page);
+	long e = start + size;
+
+	e += (m->page - (e % m->page + m->page) % m->page) % m->page;
+
+	if (0 != mprotect(m->base + s, (e - s) * sizeof(mem_t), PROT_READ | (write ? PROT_WRITE : 0)))
+		abort();
+
+	for (int i = 0; i < m->nregions; i++) {
+
+		struct region* r = &m->regions[i];
+
+		if ((r->start >= s) && (r->start + r->size <= e))
+			r->write = write;
+	}
+}
+
+// map size words of a file at start, private and copy on write
+
+bool vm_mem_map_file(struct vm_mem* m, reg_t start, long size, int fd, long offset, bool write)
+{
+	long pb = m->page * sizeof(mem_t);
+
+	if ((0 != start % m->page) || (0 != offset % pb))
+		return false;
+
+	long len = ((size * (long)sizeof(mem_t) + pb - 1) / pb) * pb;
+
+	if (MAP_FAILED == mmap(m->base + start, len, PROT_READ | (write ? PROT_WRITE : 0),
+				MAP_PRIVATE | MAP_FIXED, fd, offset))
+		return false;
+
+	add(m, (struct region){ start, len / sizeof(mem_t), write });
+
+	return true;
+}
+
+// run an engine, faults in the reservation stop it
+
+enum vm_status vm_mem_run(struct vm_mem* m, vm_fun_t* run, reg_t regs[256])
+{
+	sigjmp_buf jb;
+
+	struct vm_mem* old_current = current;
+	sigjmp_buf* old_env = env;
+
+	current = m;
+	env = &jb;
+	m->fault = -1;
+
+	enum vm_status st = VM_STOPPED;
+
+	if (0 == sigsetjmp(jb, 1))
+		run(regs, m->base);
+	else
+		st = VM_FAULT;
+
+	current = old_current;
+	env = old_env;
+
+	return st;
+}
+
+// word address of the last fault, or -1
+
+long vm_mem_fault(const struct vm_mem* m)
+{
+	return m->fault;
+}
+
+// words in memory
+
+long vm_mem_resident(const struct vm_mem* m)
+{
+	long n = 0;
+
+	for (int i = 0; i < m->nregions; i++) {
+
+		const struct region* r = &m->regions[i];
+		long np = r->size / m->page;
+		unsigned char* v = malloc(np);
+
+		if (0 == mincore(m->base + r->start, r->size * sizeof(mem_t), v))
+			for (long k = 0; k < np; k++)
+				n += (v[k] & 1) * m->page;
+
+		free(v);
+	}
+
+	return n;
+}
+
+
+struct vm_snap {
+
+	int fd;
+	reg_t regs[256];
+	long page;
+
+	int nregions;
+	struct region* regions;
+	long* offset;	// in bytes
+};
+
+static bool zero(const mem_t* p, long n)
+{
+	for (long i = 0; i < n; i++)
+		if (0 != p[i])
+			return false;
+
+	return true;
+}
+
+// copy registers and memory, pages which are zero stay holes
+
+struct vm_snap* vm_mem_snapshot(const struct vm_mem* m, const reg_t regs[256])
+{
+	int fd = memfd_create("tinyvm", MFD_CLOEXEC);
+
+	if (-1 == fd)
+		return NULL;
+
+	struct vm_snap* s = calloc(1, sizeof(struct vm_snap));
+
+	s->fd = fd;
+	s->page = m->page;
+	s->nregions = m->nregions;
+	s->regions = malloc(m->nregions * sizeof(struct region));
+	s->offset = malloc(m->nregions * sizeof(long));
+	memcpy(s->regs, regs, sizeof(s->regs));
+
+	if ((m->nregions > 0) && ((NULL == s->regions) || (NULL == s->offset)))
+		goto fail;
+
+	long pb = m->page * sizeof(mem_t);
+	long off = 0;
+
+	for (int i = 0; i < m->nregions; i++) {
+
+		const struct region* r = &m->regions[i];
+
+		s->regions[i] = *r;
+		s->offset[i] = off;
+		off += r->size * sizeof(mem_t);
+	}
+
+	if (0 != ftruncate(fd, off))
+		goto fail;
+
+	for (int i = 0; i < m->nregions; i++) {
+
+		const struct region* r = &m->regions[i];
+		long np = r->size / m->page;
+
+		for (long k = 0; k < np; k++) {
+
+			const mem_t* p = m->base + r->start + k * m->page;
+
+			if (!zero(p, m->page) && (pb != pwrite(fd, p, pb, s->offset[i] + k * pb)))
+				goto fail;
+		}
+	}
+
+	return s;
+
+fail:
+	close(fd);
+	free(s->regions);
+	free(s->offset);
+	free(s);
+	return NULL;
+}
+
+void vm_snap_free(struct vm_snap* s)
+{
+	close(s->fd);
+	free(s->regions);
+	free(s->offset);
+	free(s);
+}
+
+// a new memory sharing all pages with the snapshot until written
+
+struct vm_mem* vm_snap_fork(const struct vm_snap* s, reg_t regs[256])
+{
+	struct vm_mem* m = vm_mem_create();
+
+	if (NULL == m)
+		return NULL;
+
+	for (int i = 0; i < s->nregions; i++) {
+
+		const struct region* r = &s->regions[i];
+
+		if (MAP_FAILED == mmap(m->base + r->start, r->size * sizeof(mem_t), PROT_READ | (r->write ? PROT_WRITE : 0),
+					MAP_PRIVATE | MAP_FIXED, s->fd, s->offset[i])) {
+
+			vm_mem_free(m);
+			return NULL;
+		}
+
+		add(m, *r);
+	}
+
+	memcpy(regs, s->regs, sizeof(s->regs));
+
+	return m;
+}
@@ -0,0 +1,31 @@
+/*
+ * sparse guarded memory for tiny cpu
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ */
+
+#ifndef __MEM_H
+#define __MEM_H 1
+
+#include <stdbool.h>
+
+#include "cpu.h"
+
+struct vm_mem;
+struct vm_snap;
+
+extern struct vm_mem* vm_mem_create(void);
+extern void vm_mem_free(struct vm_mem* m);
+extern mem_t* vm_mem_base(struct vm_mem* m);
+extern void vm_mem_map(struct vm_mem* m, reg_t start, long size, bool write);
+extern void vm_mem_protect(struct vm_mem* m, reg_t start, long size, bool write);
+extern bool vm_mem_map_file(struct vm_mem* m, reg_t start, long size, int fd, long offset, bool write);
+extern enum vm_status vm_mem_run(struct vm_mem* m, vm_fun_t* run, reg_t regs[256]);
+extern long vm_mem_fault(const struct vm_mem* m);
+extern long vm_mem_resident(const struct vm_mem* m);
+
+extern struct vm_snap* vm_mem_snapshot(const struct vm_mem* m, const reg_t regs[256]);
+extern struct vm_mem* vm_snap_fork(const struct vm_snap* s, reg_t regs[256]);
+extern void vm_snap_free(struct vm_snap* s);
+
+#endif
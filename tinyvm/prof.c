@@ -0,0 +1,285 @@
+/*
+ * profiler for tiny cpu
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ *
+ * prof_run() steps the interpreter and counts every instruction
+ * by opcode and by address. Calls and returns are recognized by
+ * the code the assembler generates for them:
+ *
+ * call:	sto sp ip c0; mov c1 ip a	(after push(IP))
+ *		std sp ip 0; mov c1 ip a
+ *		cal sp a c0
+ * ret:		add ip ar c1
+ *		addi ip ar 1
+ * tail jump:	mov c1 ip a			(not after cjmp or call)
+ *
+ * A shadow stack of function entry points gives the function
+ * each instruction belongs to and the edges of the call graph.
+ * Tail jumps, e.g. out of a trampoline, replace the function on
+ * top of the shadow stack.
+ *
+ * Build with -DVM_PROFILE to make vm() run under the profiler
+ * set in vm_prof. Without it, vm() is not changed at all.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+#include "asm.h"
+#include "prof.h"
+
+
+#define HASH_BITS 10
+#define HASH_SIZE (1 << HASH_BITS)
+
+// functions and call graph edges
+
+struct fun {
+
+	reg_t entry;
+	reg_t caller;	// entry of caller, -1 for functions
+	long count;	// instructions for functions, calls for edges
+};
+
+struct prof {
+
+	long size;
+	long* pc;
+	long other;	// outside of [0, size)
+	long ops[256];
+	long total;
+
+	struct fun funs[HASH_SIZE];
+	long lost;	// table full
+
+	int depth;
+	int max;
+	reg_t* stack;
+};
+
+
+#ifdef VM_PROFILE
+struct prof* vm_prof = NULL;
+#endif
+
+
+struct prof* prof_create(long size)
+{
+	struct prof* p = calloc(1, sizeof(struct prof));
+
+	p->size = size;
+	p->pc = calloc(size, sizeof(long));
+
+	for (int i = 0; i < HASH_SIZE; i++)
+		p->funs[i].entry = -1;
+
+	return p;
+}
+
+void prof_free(struct prof* p)
+{
+	free(p->stack);
+	free(p->pc);
+	free(p);
+}
+
+
+static struct fun* lookup(struct prof* p, reg_t caller, reg_t entry)
+{
+	unsigned int h = ((uint32_t)entry * 2654435761u + (uint32_t)caller) >> (32 - HASH_BITS);
+
+	for (int i = 0; i < HASH_SIZE; i++) {
+
+		struct fun* f = &p->funs[(h + i) % HASH_SIZE];
+
+		if ((entry == f->entry) && (caller == f->caller))
+			return f;
+
+		if (-1 == f->entry) {
+
+			f->entry = entry;
+			f->caller = caller;
+			return f;
+		}
+	}
+
+	p->lost++;
+	return NULL;
+}
+
+static void edge(struct prof* p, reg_t caller, reg_t callee)
+{
+	struct fun* f = lookup(p, caller, callee);
+
+	if (NULL != f)
+		f->count++;
+}
+
+static void shadow_push(struct prof* p, reg_t entry)
+{
+	if (p->depth == p->max) {
+
+		p->max = p->max ? 2 * p->max : 64;
+		p->stack = realloc(p->stack, p->max * sizeof(reg_t));
+	}
+
+	p->stack[p->depth++] = entry;
+}
+
+static bool is(ins2_t i, enum byte_code op, int a, int b, int c)
+{
+	return (op == i.b[0]) && (a == i.b[1]) && (b == i.b[2]) && (c == i.b[3]);
+}
+
+
+void prof_run(struct prof* p, reg_t regs[256], mem_t* mem)
+{
+	ins2_t prev = { .w = 0 };
+	struct fun* cur = NULL;
+	reg_t fun = regs[IP];
+
+	p->depth = 0;
+	shadow_push(p, fun);
+	cur = lookup(p, -1, fun);
+
+	while (true) {
+
+		reg_t pc = regs[IP];
+		ins2_t i = { .w = mem[pc] };
+
+		p->ops[i.b[0]]++;
+		p->total++;
+
+		if ((pc >= 0) && (pc < p->size))
+			p->pc[pc]++;
+		else
+			p->other++;
+
+		if (NULL != cur)
+			cur->count++;
+
+		if (!vm_step(regs, mem))
+			break;
+
+		bool jump = (MOV == i.b[0]) && (C1 == i.b[1]) && (IP == i.b[2]);
+		bool change = false;
+
+		if ((jump && (is(prev, STO, SP, IP, C0) || is(prev, STD, SP, IP, 0))) || (CAL == i.b[0])) {
+
+			edge(p, fun, regs[IP]);
+			shadow_push(p, regs[IP]);
+			change = true;
+
+		} else if (jump && !is(prev, ADD, AR, IP, AR)) {
+
+			edge(p, fun, regs[IP]);
+			p->stack[p->depth - 1] = regs[IP];
+			change = true;
+
+		} else if ((is(i, ADD, IP, AR, C1) || is(i, ADDI, IP, AR, 1)) && (p->depth > 1)) {
+
+			p->depth--;
+			change = true;
+		}
+
+		if (change) {
+
+			fun = p->stack[p->depth - 1];
+			cur = lookup(p, -1, fun);
+		}
+
+		prev = i;
+	}
+}
+
+
+static int cmp_count(const void* _a, const void* _b)
+{
+	const struct fun* a = _a;
+	const struct fun* b = _b;
+
+	return (a->count < b->count) - (a->count > b->count);
+}
+
+static void annotate(const struct prof* p, const mem_t* mem)
+{
+	bool gap = false;
+
+	for (long pc = 0; pc < p->size; pc++) {
+
+		if (0 == p->pc[pc]) {
+
+			gap = true;
+			continue;
+		}
+
+		if (gap)
+			printf("\t...\n");
+
+		gap = false;
+
+		printf("%10ld %5.1f%% %6ld:\t", p->pc[pc], 100. * p->pc[pc] / p->total, pc);
+		insn_print((ins2_t){ .w = mem[pc] });
+	}
+}
+
+
+// flat profile, call graph and annotated disassembly
+
+void prof_print(const struct prof* p, const mem_t* mem)
+{
+	extern const char* instr_names[];
+
+	printf("%ld instructions\n\nopcodes:\n", p->total);
+
+	for (int i = 0; i < 256; i++) {
+
+		if (0 == p->ops[i])
+			continue;
+
+		if (i <= SPAWN)
+			printf("%10ld %5.1f%%  %s\n", p->ops[i], 100. * p->ops[i] / p->total, instr_names[i]);
+		else
+			printf("%10ld %5.1f%%  (%d)\n", p->ops[i], 100. * p->ops[i] / p->total, i);
+	}
+
+	struct fun f[HASH_SIZE];
+	int n = 0;
+
+	for (int i = 0; i < HASH_SIZE; i++)
+		if ((-1 != p->funs[i].entry) && (-1 == p->funs[i].caller))
+			f[n++] = p->funs[i];
+
+	qsort(f, n, sizeof(struct fun), cmp_count);
+
+	printf("\nfunctions:\n");
+
+	for (int i = 0; i < n; i++)
+		printf("%10ld %5.1f%%  %d\n", f[i].count, 100. * f[i].count / p->total, f[i].entry);
+
+	n = 0;
+
+	for (int i = 0; i < HASH_SIZE; i++)
+		if ((-1 != p->funs[i].entry) && (-1 != p->funs[i].caller))
+			f[n++] = p->funs[i];
+
+	qsort(f, n, sizeof(struct fun), cmp_count);
+
+	printf("\ncalls:\n");
+
+	for (int i = 0; i < n; i++)
+		printf("%10ld  %d -> %d\n", f[i].count, f[i].caller, f[i].entry);
+
+	if (p->lost)
+		printf("(%ld not recorded)\n", p->lost);
+
+	printf("\ncode:\n");
+
+	annotate(p, mem);
+
+	if (p->other)
+		printf("%10ld %5.1f%% outside\n", p->other, 100. * p->other / p->total);
+}
@@ -0,0 +1,24 @@
+/*
+ * profiler for tiny cpu
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ */
+
+#ifndef __PROF_H
+#define __PROF_H 1
+
+#include "cpu.h"
+
+struct prof;
+
+extern struct prof* prof_create(long size);
+extern void prof_free(struct prof* p);
+extern void prof_run(struct prof* p, reg_t regs[256], mem_t* mem);
+extern void prof_print(const struct prof* p, const mem_t* mem);
+
+#ifdef VM_PROFILE
+// if set, vm() runs under this profiler
+extern struct prof* vm_prof;
+#endif
+
+#endif
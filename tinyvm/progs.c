@@ -0,0 +1,668 @@
+/*
+ * factorial and man-or-boy-test for tiny vm
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ */
+
+#include <string.h>
+
+#include "cpu.h"
+#include "asm.h"
+#include "host.h"
+#include "cc.h"
+#include "svm.h"
+#include "progs.h"
+
+
+
+void prelude(ins2_t** p, unsigned int start)
+{
+	cnst(p, C0, 0);
+	cnst(p, C1, 1);
+	cnst(p, SP, 32);	// stack starts at 32
+	cnst(p, FP, 32);
+	push(p, RR);
+	cnsta(p, 10, start);	// jump to start
+	call(p, 1, 10);
+	stop(p);
+}
+
+void factorial(ins2_t** p, unsigned int start)
+{
+struct label f = { 0 };
+struct label j = { 0 };
+
+bind(p, &f);
+
+	enter(p, 0);
+	arg(p, U1, 0);
+	sub(p, U1, U1, C1);
+
+	cjmpl(p, U1, &j);
+	leave(p, C1);
+
+bind(p, &j);
+
+	push(p, U1);
+	cnstl(p, U2, &f);
+	call(p, 1, U2); 
+	arg(p, U2, 0);
+	mul(p, U2, U2, RR);
+	leave(p, U2);
+}
+
+
+
+// function values are closures, records of code and static link
+
+void manorboy(ins2_t** p, unsigned int start)
+{
+struct label j = { 0 };
+struct label po = { 0 };
+struct label mo = { 0 };
+struct label zo = { 0 };
+struct label b = { 0 };
+struct label mob = { 0 };
+struct label d = { 0 };
+
+	jumpl(p, &j);
+
+bind(p, &po);
+	move(p, RR, C1);
+	ret(p);
+
+bind(p, &mo);
+	sub(p, RR, C0, C1);
+	ret(p);
+
+bind(p, &zo);
+	move(p, RR, C0);
+	ret(p);
+
+bind(p, &b);
+	enter(p, 0);
+
+	fp(p, 1); 		// get stack frame
+	load(p, A1, 0);
+	sub(p, A1, A1, C1);
+	store(p, 0, A1);
+
+	closurel(p, A2, &b, FP);
+
+	// prepare call to manorboy
+
+	load(p, A3, 1);
+	load(p, A4, 2);
+	load(p, U1, 3);
+	push(p, U1);
+	arg(p, U1, 1);
+	push(p, U1);
+
+	cnstl(p, U1, &mob);
+	call(p, 2, U1);
+
+	addi(p, SP, SP, -2);	// drop the closure
+	pop(p, FP);
+	ret(p);
+
+
+bind(p, &mob);
+
+	// store first arguments as local variables
+
+	enter(p, 4);
+	store(p, 0, A1);
+	store(p, 1, A2);
+	store(p, 2, A3);
+	store(p, 3, A4);
+
+
+	sub(p, U1, C0, A1);
+	cjmpnl(p, U1, &d);
+
+	// k <= 0
+	arg(p, U1, 1);
+	callc(p, 0, U1);
+	push(p, RR);
+	arg(p, U1, 0);
+	callc(p, 0, U1);
+	pop(p, U2);
+	add(p, RR, U2, RR);
+	leave(p, RR);
+
+bind(p, &d); // k > 0
+	cnstl(p, U1, &b);
+	call2(p, 0, U1);
+	leave(p, RR);
+
+bind(p, &j);
+
+	enter(p, 0);
+	arg(p, A1, 0);		// k
+	closurel(p, A2, &po, C0);
+	closurel(p, A3, &mo, C0);
+	move(p, A4, A3);
+	closurel(p, U1, &zo, C0);
+	push(p, A2);
+	push(p, U1);
+	cnstl(p, U2, &mob); // manorboy
+	call(p, 2, U2);
+	leave(p, RR);
+}
+
+
+// the same with closures built as code on the stack
+
+void manorboy_tramp(ins2_t** p, unsigned int start)
+{
+ins2_t* base = here(p);
+
+struct label j = { 0 };
+struct label po = { 0 };
+struct label mo = { 0 };
+struct label zo = { 0 };
+struct label b = { 0 };
+struct label mob = { 0 };
+struct label d = { 0 };
+
+	jumpl(p, &j);
+
+bind(p, &po);
+	move(p, RR, C1);
+	ret(p);
+
+bind(p, &mo);
+	sub(p, RR, C0, C1);
+	ret(p);
+
+bind(p, &zo);
+	move(p, RR, C0);
+	ret(p);
+
+bind(p, &b);
+	enter(p, 0);
+
+//	move(p, U2, FP); // save frame pointer 
+// -- we don't need to because we restore SP directly
+
+	fp(p, 1); 		// get stack frame
+	load(p, A1, 0);
+	sub(p, A1, A1, C1);
+	store(p, 0, A1);
+
+int t = tramp(p, A2, start + (b.at - base));
+
+	// prepare call to manorboy
+
+	load(p, A3, 1);
+	load(p, A4, 2);
+	load(p, U1, 3);
+	push(p, U1);
+	arg(p, U1, 1);
+	push(p, U1);
+
+//	move(p, FP, U2); // restore frame pointer
+
+	cnstl(p, U1, &mob);
+	call(p, 2, U1);
+
+	//leave(p, RR);
+
+	cnst(p, AR, t);
+	sub(p, SP, SP, AR);
+	pop(p, FP);
+	ret(p);
+
+
+bind(p, &mob);
+
+	// store first arguments as local variables
+
+	enter(p, 4);
+	store(p, 0, A1);
+	store(p, 1, A2);
+	store(p, 2, A3);
+	store(p, 3, A4);
+
+
+	sub(p, U1, C0, A1);
+	cnst(p, U2, SIGN_BIT);
+	and(p, U1, U1, U2);
+
+	cjmpl(p, U1, &d);
+
+	// k <= 0
+	arg(p, U1, 1);
+	call(p, 0, U1);
+	push(p, RR);
+	arg(p, U1, 0);
+	call(p, 0, U1);
+	pop(p, U2);
+	add(p, RR, U2, RR);
+	leave(p, RR);
+
+bind(p, &d); // k > 0
+	cnstl(p, U1, &b);
+	call2(p, 0, U1);
+	leave(p, RR);
+
+bind(p, &j);
+
+	enter(p, 0);
+	arg(p, A1, 0);		// k
+	cnstl(p, A2, &po);
+	cnstl(p, A3, &mo);
+	cnstl(p, A4, &mo);
+	cnstl(p, U1, &po);
+	push(p, U1);
+	cnstl(p, U1, &zo);
+	push(p, U1);
+	cnstl(p, U2, &mob); // manorboy
+	call(p, 2, U2);
+	leave(p, RR);
+}
+
+
+// counts down in a tight loop
+
+void count(ins2_t** p, unsigned int start)
+{
+struct label l = { 0 };
+
+	enter(p, 0);
+	arg(p, U1, 0);
+	xor(p, RR, RR, RR);
+
+bind(p, &l);
+
+	add(p, RR, RR, C1);
+	sub(p, U1, U1, C1);
+	cjmpl(p, U1, &l);
+	leave(p, RR);
+}
+
+
+// fills an array on the stack with 0, 1, ... n - 1 and sums it up
+
+void stream(ins2_t** p, unsigned int start)
+{
+struct label l1 = { 0 };
+struct label l2 = { 0 };
+
+	enter(p, 0);
+	arg(p, U1, 0);		// n
+	add(p, SP, SP, U1);	// array at FP + 1
+	add(p, U3, FP, C1);
+	xor(p, U2, U2, U2);
+
+bind(p, &l1);
+
+	add(p, U4, U3, U2);
+	poke(p, U4, U2);
+	add(p, U2, U2, C1);
+	sub(p, U4, U1, U2);
+	cjmpl(p, U4, &l1);
+
+	xor(p, RR, RR, RR);
+	xor(p, U2, U2, U2);
+
+bind(p, &l2);
+
+	add(p, U4, U3, U2);
+	peek(p, U4, U4);
+	add(p, RR, RR, U4);
+	add(p, U2, U2, C1);
+	sub(p, U4, U1, U2);
+	cjmpl(p, U4, &l2);
+
+	leave(p, RR);
+}
+
+
+// naive recursive fibonacci
+
+void fib(ins2_t** p, unsigned int start)
+{
+struct label f = { 0 };
+struct label s = { 0 };
+
+bind(p, &f);
+
+	enter(p, 1);
+	arg(p, U1, 0);
+	addi(p, U2, U1, -2);
+	cjmpnl(p, U2, &s);	// n < 2
+
+	sub(p, U1, U1, C1);
+	push(p, U1);
+	cnstl(p, U2, &f);
+	call(p, 1, U2);
+	store(p, 0, RR);
+
+	arg(p, U1, 0);
+	sub(p, U1, U1, C1);
+	sub(p, U1, U1, C1);
+	push(p, U1);
+	cnstl(p, U2, &f);
+	call(p, 1, U2);
+	load(p, U1, 0);
+	add(p, RR, RR, U1);
+	leave(p, RR);
+
+bind(p, &s);
+
+	arg(p, U1, 0);
+	leave(p, U1);
+}
+
+
+
+// factorial and fib by the compiler
+
+void factorial_cc(ins2_t** p, unsigned int start)
+{
+	cc_compile(p,
+		"fact(n) {\n"
+		"	if (n == 1)\n"
+		"		return 1;\n"
+		"	return n * fact(n - 1);\n"
+		"}\n");
+}
+
+void fib_cc(ins2_t** p, unsigned int start)
+{
+	cc_compile(p,
+		"fib(n) {\n"
+		"	if (n < 2)\n"
+		"		return n;\n"
+		"	return fib(n - 1) + fib(n - 2);\n"
+		"}\n");
+}
+
+
+
+// factorial of stackvm.c, translated
+
+const int svm_factorial[] = {
+
+	SVM_LIT, 1,
+	SVM_LOD, 1,
+	SVM_SUB,
+	SVM_JPC, 10,
+	SVM_LIT, 1,
+	SVM_RET,
+	SVM_CAL, 0,	// 10:
+	SVM_LOD, 1,
+	SVM_MUL,
+	SVM_RET
+};
+
+const int svm_factorial_len = sizeof(svm_factorial) / sizeof(svm_factorial[0]);
+
+void factorial_svm(ins2_t** p, unsigned int start)
+{
+	svm_compile(p, svm_factorial, svm_factorial_len);
+}
+
+
+
+// writes a message through the host call ring and polls until
+// it and a timer of arg microseconds have completed, returns the
+// sum of the results or -1 if no host is attached
+
+void hello(ins2_t** p, unsigned int start)
+{
+struct label l = { 0 };
+struct label f = { 0 };
+
+	static const char msg[16] = "hello, world\n";
+
+	enum { N = 2, CQ = RING_SQ + N * RING_SQE, BUF = CQ + N * RING_CQE };
+
+	enter(p, BUF + sizeof(msg) / sizeof(mem_t));	// ring at FP + 1
+
+	for (unsigned int i = 0; i < sizeof(msg) / sizeof(mem_t); i++) {
+
+		ureg_t w = 0;
+
+		for (int j = sizeof(mem_t) - 1; j >= 0; j--)
+			w = (w << 8) | msg[sizeof(mem_t) * i + j];
+
+		cnst(p, U1, w);
+		store(p, BUF + i, U1);
+	}
+
+	for (int i = 0; i < RING_SQ; i++)
+		store(p, i, C0);
+
+	cnst(p, U1, N);
+	store(p, RING_SIZE, U1);
+
+	// timer
+
+	cnst(p, U1, HOST_TIMER);
+	store(p, RING_SQ + 0, U1);
+	arg(p, U1, 0);
+	store(p, RING_SQ + 3, U1);
+
+	// write to fd 1
+
+	cnst(p, U1, HOST_WRITE);
+	store(p, RING_SQ + RING_SQE + 0, U1);
+	store(p, RING_SQ + RING_SQE + 1, C1);
+	addi(p, U1, FP, BUF + 1);
+	store(p, RING_SQ + RING_SQE + 2, U1);
+	cnst(p, U1, strlen(msg));
+	store(p, RING_SQ + RING_SQE + 3, U1);
+
+	fence(p);		// the submissions before the tail
+	cnst(p, U1, 2);
+	store(p, RING_SQ_TAIL, U1);
+
+	addi(p, U3, FP, 1);
+	sys(p, U1, U3);
+	cjmpnl(p, U1, &f);	// no host
+
+	cnst(p, U2, 2);
+
+bind(p, &l);
+
+	load(p, U1, RING_CQ_TAIL);
+	sub(p, U1, U1, U2);
+	cjmpl(p, U1, &l);
+
+	fence(p);		// the completions after the tail
+
+	load(p, U1, CQ + 1);
+	load(p, RR, CQ + RING_CQE + 1);
+	add(p, RR, RR, U1);
+
+	fence(p);		// read before the host may reuse them
+	store(p, RING_CQ_HEAD, U2);
+
+	leave(p, RR);
+
+bind(p, &f);
+
+	cnst(p, RR, -1);
+	leave(p, RR);
+}
+
+
+
+// sums a[i] = i % 16 over an array of n words on the stack. All
+// threads which can be started take chunks from a shared counter,
+// fill them and add them up.
+
+void psum(ins2_t** p, unsigned int start)
+{
+struct label s = { 0 };
+struct label c = { 0 };
+struct label w = { 0 };
+struct label k = { 0 };
+struct label g = { 0 };
+struct label l1 = { 0 };
+struct label l2 = { 0 };
+struct label e = { 0 };
+struct label d = { 0 };
+struct label l3 = { 0 };
+
+	enum { CH = 16, I, T, END, M, X, B };
+
+	enter(p, 3);		// total, done, next
+	arg(p, U1, 0);		// n
+	store(p, 0, C0);
+	store(p, 1, C0);
+	store(p, 2, C0);
+	addi(p, A1, FP, 1);
+	addi(p, A4, FP, 2);
+	addi(p, A3, FP, 3);
+	addi(p, A2, FP, 4);	// array
+	add(p, SP, SP, U1);
+	cnst(p, CH, 1024);
+	cnst(p, M, 15);
+	cnstl(p, U3, &c);
+	xor(p, U4, U4, U4);	// threads started
+
+bind(p, &s);
+
+	add(p, U2, U4, C1);
+	cnst(p, X, 256);
+	mul(p, X, X, U2);
+	add(p, X, X, SP);
+	spawn(p, U2, U3, X);	// with a stack of its own
+	cjmpnl(p, U2, &w);
+	add(p, U4, U4, C1);
+	jumpl(p, &s);
+
+bind(p, &c);
+
+	move(p, SP, U2);
+	move(p, FP, U2);
+
+bind(p, &w);
+
+	xor(p, RR, RR, RR);
+
+bind(p, &k);		// take a chunk
+
+	xadd(p, I, A3, CH);
+	sub(p, T, I, U1);
+	cjmpnl(p, T, &g);
+	jumpl(p, &e);		// none left
+
+bind(p, &g);
+
+	move(p, B, I);
+	add(p, END, I, CH);
+	sub(p, T, END, U1);
+	cjmpnl(p, T, &l1);
+	move(p, END, U1);
+
+bind(p, &l1);		// fill
+
+	and(p, T, I, M);
+	add(p, X, A2, I);
+	poke(p, X, T);
+	add(p, I, I, C1);
+	sub(p, T, END, I);
+	cjmpl(p, T, &l1);
+
+	move(p, I, B);
+
+bind(p, &l2);		// add up
+
+	add(p, X, A2, I);
+	peek(p, T, X);
+	add(p, RR, RR, T);
+	add(p, I, I, C1);
+	sub(p, T, END, I);
+	cjmpl(p, T, &l2);
+
+	jumpl(p, &k);
+
+bind(p, &e);
+
+	xadd(p, T, A1, RR);
+	xadd(p, T, A4, C1);
+	cjmpnl(p, U2, &d);	// the first thread waits for the others
+	stop(p);
+
+bind(p, &d);
+
+	add(p, X, U4, C1);
+
+bind(p, &l3);
+
+	load(p, T, 1);
+	sub(p, T, T, X);
+	cjmpl(p, T, &l3);
+
+	fence(p);
+	load(p, RR, 0);
+	leave(p, RR);
+}
+
+
+
+const struct prog progs[] = {
+
+	{ "factorial", factorial, 7, 5040 },
+	{ "manorboy", manorboy, 10, -67 },
+	{ "manorboy-tramp", manorboy_tramp, 10, -67 },
+	{ "count", count, 1000000, 1000000 },
+	{ "stream", stream, 8192, 8192 * 8191 / 2 },
+	{ "fib", fib, 20, 6765 },
+	{ "factorial-cc", factorial_cc, 7, 5040 },
+	{ "fib-cc", fib_cc, 20, 6765 },
+	{ "factorial-svm", factorial_svm, 7, 5040 },
+	{ "hello", hello, 1000, 13 },
+	{ "psum", psum, 4096, 4096 / 16 * 120 },
+	{ NULL, NULL, 0, 0 },
+};
+
+const struct prog* prog_find(const char* name)
+{
+	for (const struct prog* q = progs; NULL != q->name; q++)
+		if (0 == strcmp(q->name, name))
+			return q;
+
+	return NULL;
+}
+
+
+// assemble prelude at 0 and program at start, returns size of program
+
+int assemble(ins2_t* mm, unsigned int start, prog_f* fun)
+{
+	ins2_t* p = &mm[0];
+
+	asm_origin(mm);
+
+	prelude(&p, start);
+
+	p = &mm[start];
+
+	fun(&p, start);
+
+	return p - &mm[start];
+}
+
+// the same with constants as short as possible
+
+int assemble_relax(ins2_t* mm, unsigned int start, prog_f* fun)
+{
+	int n;
+
+	relax_begin();
+
+	do {
+		n = assemble(mm, start, fun);
+
+	} while (relax_next());
+
+	relax_end();
+
+	return n;
+}
+
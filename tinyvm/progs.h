@@ -0,0 +1,45 @@
+/*
+ * sample programs for tiny cpu
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ */
+
+#ifndef __PROGS_H
+#define __PROGS_H 1
+
+#include "cpu.h"
+
+typedef void prog_f(ins2_t** p, unsigned int start);
+
+struct prog {
+
+	const char* name;
+	prog_f* fun;
+	reg_t arg;	// passed in RR
+	reg_t result;	// expected in RR
+};
+
+extern const struct prog progs[];
+extern const struct prog* prog_find(const char* name);
+
+extern void prelude(ins2_t** p, unsigned int start);
+extern void factorial(ins2_t** p, unsigned int start);
+extern void manorboy(ins2_t** p, unsigned int start);
+extern void manorboy_tramp(ins2_t** p, unsigned int start);
+extern void count(ins2_t** p, unsigned int start);
+extern void stream(ins2_t** p, unsigned int start);
+extern void fib(ins2_t** p, unsigned int start);
+extern void factorial_cc(ins2_t** p, unsigned int start);
+extern void fib_cc(ins2_t** p, unsigned int start);
+extern void factorial_svm(ins2_t** p, unsigned int start);
+extern void hello(ins2_t** p, unsigned int start);
+extern void psum(ins2_t** p, unsigned int start);
+
+// byte code of stackvm.c
+extern const int svm_factorial[];
+extern const int svm_factorial_len;
+
+extern int assemble(ins2_t* mm, unsigned int start, prog_f* fun);
+extern int assemble_relax(ins2_t* mm, unsigned int start, prog_f* fun);
+
+#endif
@@ -0,0 +1,290 @@
+/*
+ * scheduler for many tiny cpus
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ *
+ * A pool of worker threads runs contexts in slices of a fixed
+ * number of instructions. Each worker has a queue of its own.
+ * A preempted context goes to the end of the queue of the worker
+ * which ran it, so long running programs cannot starve short
+ * ones. A worker with an empty queue steals from the others.
+ * Contexts run on the switch engine only, through vm_slice().
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "cpu.h"
+#include "sched.h"
+
+
+struct queue {
+
+	pthread_mutex_t lock;
+	struct vm_ctx** buf;
+	int size;
+	int head;
+	atomic_int count;
+};
+
+struct worker {
+
+	struct sched* s;
+	int id;
+	pthread_t thread;
+	struct queue q;
+};
+
+struct sched {
+
+	int nthreads;
+	long slice;
+	struct worker* w;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	atomic_int idle;
+	bool quit;
+
+	atomic_long pending;
+	atomic_long retired;
+	atomic_uint next;
+};
+
+
+static void put(struct queue* q, struct vm_ctx* c)
+{
+	pthread_mutex_lock(&q->lock);
+
+	if (q->count == q->size) {
+
+		int n = q->size ? 2 * q->size : 64;
+		struct vm_ctx** b = malloc(n * sizeof(struct vm_ctx*));
+
+		for (int i = 0; i < q->count; i++)
+			b[i] = q->buf[(q->head + i) % q->size];
+
+		free(q->buf);
+		q->buf = b;
+		q->size = n;
+		q->head = 0;
+	}
+
+	q->buf[(q->head + q->count) % q->size] = c;
+	q->count++;
+
+	pthread_mutex_unlock(&q->lock);
+}
+
+// the owner takes from the front
+
+static struct vm_ctx* take(struct queue* q)
+{
+	struct vm_ctx* c = NULL;
+
+	pthread_mutex_lock(&q->lock);
+
+	if (q->count > 0) {
+
+		c = q->buf[q->head];
+		q->head = (q->head + 1) % q->size;
+		q->count--;
+	}
+
+	pthread_mutex_unlock(&q->lock);
+
+	return c;
+}
+
+// thieves take from the back
+
+static struct vm_ctx* steal(struct queue* q)
+{
+	struct vm_ctx* c = NULL;
+
+	if (0 == atomic_load_explicit(&q->count, memory_order_relaxed))
+		return NULL;
+
+	pthread_mutex_lock(&q->lock);
+
+	if (q->count > 0) {
+
+		c = q->buf[(q->head + q->count - 1) % q->size];
+		q->count--;
+	}
+
+	pthread_mutex_unlock(&q->lock);
+
+	return c;
+}
+
+static struct vm_ctx* find(struct sched* s, struct worker* w)
+{
+	struct vm_ctx* c = take(&w->q);
+
+	for (int i = 1; (NULL == c) && (i < s->nthreads); i++)
+		c = steal(&s->w[(w->id + i) % s->nthreads].q);
+
+	return c;
+}
+
+static bool have_work(struct sched* s)
+{
+	bool r = false;
+
+	for (int i = 0; i < s->nthreads; i++) {
+
+		pthread_mutex_lock(&s->w[i].q.lock);
+		r |= (s->w[i].q.count > 0);
+		pthread_mutex_unlock(&s->w[i].q.lock);
+	}
+
+	return r;
+}
+
+static void wake(struct sched* s)
+{
+	pthread_mutex_lock(&s->lock);
+
+	if (s->idle > 0)
+		pthread_cond_signal(&s->work);
+
+	pthread_mutex_unlock(&s->lock);
+}
+
+
+static void* worker(void* _w)
+{
+	struct worker* w = _w;
+	struct sched* s = w->s;
+
+	while (true) {
+
+		struct vm_ctx* c = find(s, w);
+
+		if (NULL == c) {
+
+			pthread_mutex_lock(&s->lock);
+
+			if (s->quit) {
+
+				pthread_mutex_unlock(&s->lock);
+				break;
+			}
+
+			if (!have_work(s)) {
+
+				s->idle++;
+				pthread_cond_wait(&s->work, &s->lock);
+				s->idle--;
+			}
+
+			pthread_mutex_unlock(&s->lock);
+			continue;
+		}
+
+		long r = c->retired;
+
+		enum vm_status st = vm_slice(c, s->slice);
+
+		atomic_fetch_add_explicit(&s->retired, c->retired - r, memory_order_relaxed);
+
+		if (VM_RUNNING == st) {
+
+			put(&w->q, c);
+
+			if (atomic_load_explicit(&s->idle, memory_order_relaxed) > 0)
+				wake(s);
+
+			continue;
+		}
+
+		if (1 == atomic_fetch_sub(&s->pending, 1)) {
+
+			pthread_mutex_lock(&s->lock);
+			pthread_cond_broadcast(&s->done);
+			pthread_mutex_unlock(&s->lock);
+		}
+	}
+
+	return NULL;
+}
+
+
+
+struct sched* sched_create(int nthreads, long slice)
+{
+	struct sched* s = calloc(1, sizeof(struct sched));
+
+	s->nthreads = nthreads;
+	s->slice = slice;
+	s->w = calloc(nthreads, sizeof(struct worker));
+
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->work, NULL);
+	pthread_cond_init(&s->done, NULL);
+
+	for (int i = 0; i < nthreads; i++) {
+
+		s->w[i].s = s;
+		s->w[i].id = i;
+		pthread_mutex_init(&s->w[i].q.lock, NULL);
+	}
+
+	for (int i = 0; i < nthreads; i++)
+		pthread_create(&s->w[i].thread, NULL, worker, &s->w[i]);
+
+	return s;
+}
+
+void sched_free(struct sched* s)
+{
+	pthread_mutex_lock(&s->lock);
+	s->quit = true;
+	pthread_cond_broadcast(&s->work);
+	pthread_mutex_unlock(&s->lock);
+
+	for (int i = 0; i < s->nthreads; i++) {
+
+		pthread_join(s->w[i].thread, NULL);
+		pthread_mutex_destroy(&s->w[i].q.lock);
+		free(s->w[i].q.buf);
+	}
+
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->work);
+	pthread_cond_destroy(&s->done);
+
+	free(s->w);
+	free(s);
+}
+
+void sched_submit(struct sched* s, struct vm_ctx* ctx)
+{
+	atomic_fetch_add(&s->pending, 1);
+
+	put(&s->w[atomic_fetch_add(&s->next, 1) % s->nthreads].q, ctx);
+
+	wake(s);
+}
+
+// wait until all submitted contexts stopped
+
+void sched_wait(struct sched* s)
+{
+	pthread_mutex_lock(&s->lock);
+
+	while (atomic_load(&s->pending) > 0)
+		pthread_cond_wait(&s->done, &s->lock);
+
+	pthread_mutex_unlock(&s->lock);
+}
+
+long sched_retired(struct sched* s)
+{
+	return atomic_load(&s->retired);
+}
+
@@ -0,0 +1,20 @@
+/*
+ * scheduler for many tiny cpus
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ */
+
+#ifndef __SCHED_H
+#define __SCHED_H 1
+
+#include "cpu.h"
+
+struct sched;
+
+extern struct sched* sched_create(int nthreads, long slice);
+extern void sched_free(struct sched* s);
+extern void sched_submit(struct sched* s, struct vm_ctx* ctx);
+extern void sched_wait(struct sched* s);
+extern long sched_retired(struct sched* s);
+
+#endif
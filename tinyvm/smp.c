@@ -0,0 +1,161 @@
+/*
+ * hardware threads for tiny cpu
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ *
+ * SPAWN in a memory which has a vm_smp starts a host thread which
+ * runs the new hardware thread with the given engine, up to the
+ * number of threads given to vm_smp_create(). Thread numbers start
+ * at 1, the thread which was started by the embedder is 0. A thread
+ * which ends is not replaced until vm_smp_join() has waited for all
+ * of them. Every thread has a cache of its own if the engine has
+ * one, so code must not change while more than one thread runs.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "cpu.h"
+#include "smp.h"
+
+
+struct thread {
+
+	struct vm_smp* s;
+	pthread_t thread;
+	reg_t regs[256];
+};
+
+struct vm_smp {
+
+	mem_t* mem;
+	vm_fun_t* run;
+
+	pthread_mutex_t lock;
+	int nthreads;
+	int started;
+	struct thread* threads;
+
+	struct vm_smp* next;
+};
+
+
+// by memory, for SPAWN
+
+static pthread_mutex_t smps_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct vm_smp* smps = NULL;
+
+
+static void* thread(void* _t)
+{
+	struct thread* t = _t;
+
+	t->s->run(t->regs, t->s->mem);
+
+	return NULL;
+}
+
+static reg_t spawn(mem_t* mem, const reg_t regs[256])
+{
+	reg_t ret = -1;
+
+	pthread_mutex_lock(&smps_lock);
+
+	struct vm_smp* s = smps;
+
+	while ((NULL != s) && (s->mem != mem))
+		s = s->next;
+
+	if (NULL != s) {
+
+		pthread_mutex_lock(&s->lock);
+
+		if (s->started < s->nthreads) {
+
+			struct thread* t = &s->threads[s->started];
+
+			t->s = s;
+
+			for (int i = 0; i < 256; i++)
+				t->regs[i] = regs[i];
+
+			if (0 == pthread_create(&t->thread, NULL, thread, t))
+				ret = ++s->started;
+		}
+
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	pthread_mutex_unlock(&smps_lock);
+
+	return ret;
+}
+
+
+struct vm_smp* vm_smp_create(mem_t* mem, vm_fun_t* run, int nthreads)
+{
+	struct vm_smp* s = calloc(1, sizeof(struct vm_smp));
+
+	s->mem = mem;
+	s->run = run;
+	s->nthreads = nthreads;
+	s->threads = calloc(nthreads, sizeof(struct thread));
+
+	pthread_mutex_init(&s->lock, NULL);
+
+	pthread_mutex_lock(&smps_lock);
+	s->next = smps;
+	smps = s;
+	vm_spawn_call = spawn;
+	pthread_mutex_unlock(&smps_lock);
+
+	return s;
+}
+
+// wait for all threads, including the ones they started
+
+void vm_smp_join(struct vm_smp* s)
+{
+	int i = 0;
+
+	while (true) {
+
+		pthread_mutex_lock(&s->lock);
+
+		int n = s->started;
+
+		if (i == n)
+			s->started = 0;
+
+		pthread_mutex_unlock(&s->lock);
+
+		if (i == n)
+			break;
+
+		pthread_join(s->threads[i++].thread, NULL);
+	}
+}
+
+void vm_smp_free(struct vm_smp* s)
+{
+	vm_smp_join(s);
+
+	pthread_mutex_lock(&smps_lock);
+
+	for (struct vm_smp** x = &smps; NULL != *x; x = &(*x)->next) {
+
+		if (*x == s) {
+
+			*x = s->next;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&smps_lock);
+
+	pthread_mutex_destroy(&s->lock);
+
+	free(s->threads);
+	free(s);
+}
@@ -0,0 +1,18 @@
+/*
+ * hardware threads for tiny cpu
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ */
+
+#ifndef __SMP_H
+#define __SMP_H 1
+
+#include "cpu.h"
+
+struct vm_smp;
+
+extern struct vm_smp* vm_smp_create(mem_t* mem, vm_fun_t* run, int nthreads);
+extern void vm_smp_join(struct vm_smp* s);
+extern void vm_smp_free(struct vm_smp* s);
+
+#endif
@@ -0,0 +1,348 @@
+/*
+ * translator from the byte code of stackvm.c to tiny vm
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ *
+ * The code must be valid as checked by vm_verify() in stackvm.c.
+ * Then the height of the stack at every instruction of a function
+ * is known and every slot of the stack gets a fixed place: the
+ * first eight slots of a frame are U1-U4 and A1-A4, the others
+ * are locals of the frame. The accumulator lives in the slot
+ * above the top, so that LIT and the arithmetic become single
+ * instructions and pushes and pops disappear.
+ *
+ * Every function which is called is compiled with enter() and
+ * leave(), the accumulator is its only argument, which the caller
+ * pushes, and its result comes back in RR, so the first one can
+ * be called by the prelude. The slots in registers are stored in
+ * the frame before a call and loaded after it.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "cpu.h"
+#include "asm.h"
+#include "svm.h"
+
+
+// scratch for slots in the frame
+#define T0 16u
+#define T1 17u
+
+#define MAX_FUNS 32
+
+static const unsigned char slots[] = { U1, U2, U3, U4, A1, A2, A3, A4 };
+
+#define NSLOTS (int)(sizeof(slots) / sizeof(slots[0]))
+
+
+struct fun {
+
+	int entry;
+	int size;		// slots of the frame
+	int* height;		// at each instruction, -1 if not part of it
+	bool* target;		// of a jump
+	struct label start;
+	struct label* at;
+};
+
+static int nfuns;
+static struct fun funs[MAX_FUNS];
+
+
+static bool operand(int op)
+{
+	return (SVM_JPC == op) || (SVM_JMP == op) || (SVM_CAL == op)
+		|| (SVM_LIT == op) || (SVM_INT == op) || (SVM_LOD == op)
+		|| ((SVM_ADDI <= op) && (op <= SVM_XORL));
+}
+
+static struct fun* fun_find(int entry)
+{
+	for (int i = 0; i < nfuns; i++)
+		if (entry == funs[i].entry)
+			return &funs[i];
+
+	assert(nfuns < MAX_FUNS);
+
+	struct fun* f = &funs[nfuns++];
+
+	*f = (struct fun){ .entry = entry };
+
+	return f;
+}
+
+
+// height of the stack at each instruction, as in vm_verify()
+
+static void heights(const int* code, int len, struct fun* f)
+{
+	int work[len];
+	int n = 0;
+
+	f->height = malloc(len * sizeof(int));
+	f->target = calloc(len, sizeof(bool));
+	f->at = calloc(len, sizeof(struct label));
+	f->size = 0;
+
+	for (int i = 0; i < len; i++)
+		f->height[i] = -1;
+
+	f->height[f->entry] = 0;
+	work[n++] = f->entry;
+
+	void succ(int l, int h)
+	{
+		assert((0 <= l) && (l < len));
+
+		if (-1 == f->height[l]) {
+
+			f->height[l] = h;
+			work[n++] = l;
+		}
+
+		assert(h == f->height[l]);
+
+		if (h > f->size)
+			f->size = h;
+	}
+
+	while (n > 0) {
+
+		int i = work[--n];
+		int h = f->height[i];
+		int k = operand(code[i]) ? code[i + 1] : 0;
+
+		switch (code[i]) {
+		case SVM_ADD ... SVM_XOR:
+			assert(h >= 1);
+			succ(i + 1, h - 1);
+			break;
+		case SVM_NOT:
+			succ(i + 1, h);
+			break;
+		case SVM_JPC:
+			f->target[k] = true;
+			succ(k, h);
+			succ(i + 2, h);
+			break;
+		case SVM_JMP:
+			f->target[k] = true;
+			succ(k, h);
+			break;
+		case SVM_CAL:
+			fun_find(k);
+			succ(i + 2, h);
+			break;
+		case SVM_RET:
+			break;
+		case SVM_LIT:
+			succ(i + 2, h + 1);
+			break;
+		case SVM_LOD:
+			assert((0 <= k) && (k <= h));
+			succ(i + 2, h + 1);
+			break;
+		case SVM_ADDI ... SVM_XORI:
+			succ(i + 2, h);
+			break;
+		case SVM_ADDL ... SVM_XORL:
+			assert((1 <= k) && (k <= h));
+			succ(i + 2, h);
+			break;
+		case SVM_INT:
+			assert(h - k >= 0);
+			succ(i + 2, h - k);
+			break;
+		default:
+			assert(0);
+		}
+	}
+}
+
+
+// register holding slot j, loaded into t if it lives in the frame
+
+static unsigned char get(ins2_t** p, int j, unsigned char t)
+{
+	if (j < NSLOTS)
+		return slots[j];
+
+	load(p, t, j);
+	return t;
+}
+
+// register to compute slot j in, put() it there afterwards
+
+static unsigned char dst(int j, unsigned char t)
+{
+	return (j < NSLOTS) ? slots[j] : t;
+}
+
+static void put(ins2_t** p, int j, unsigned char a)
+{
+	if (j >= NSLOTS)
+		store(p, j, a);
+	else if (a != slots[j])
+		move(p, slots[j], a);
+}
+
+
+static void fun_compile(ins2_t** p, const int* code, int len, struct fun* f)
+{
+	typedef void arith_f(ins2_t** p, unsigned char a, unsigned char b, unsigned char c);
+
+	static arith_f* const arith[] = {
+
+		[SVM_ADD] = add, [SVM_SUB] = sub, [SVM_MUL] = mul, [SVM_DIV] = adiv,
+		[SVM_AND] = and, [SVM_OR] = or, [SVM_XOR] = xor,
+	};
+
+	bind(p, &f->start);
+
+	// the accumulator is slot h
+	enter(p, f->size + 1);
+
+	unsigned char d = dst(0, T0);
+	arg(p, d, 0);
+	put(p, 0, d);
+
+	int first = 0;
+
+	while (-1 == f->height[first])
+		first++;
+
+	if (first != f->entry) {
+
+		f->target[f->entry] = true;
+		jumpl(p, &f->at[f->entry]);
+	}
+
+	for (int i = first; i < len; i++) {
+
+		int h = f->height[i];
+
+		if (-1 == h)
+			continue;
+
+		if (f->target[i])
+			bind(p, &f->at[i]);
+
+		int k = operand(code[i]) ? code[i + 1] : 0;
+		unsigned char x, y;
+
+		switch (code[i]) {
+		case SVM_ADD ... SVM_XOR:
+
+			x = get(p, h, T0);
+			y = get(p, h - 1, T1);
+			d = dst(h - 1, T0);
+			arith[code[i]](p, d, x, y);
+			put(p, h - 1, d);
+			break;
+
+		case SVM_NOT:
+
+			x = get(p, h, T0);
+			cnst(p, T1, -1);
+			d = dst(h, T0);
+			xor(p, d, x, T1);
+			put(p, h, d);
+			break;
+
+		case SVM_JPC:
+
+			cjmpl(p, get(p, h, T0), &f->at[k]);
+			break;
+
+		case SVM_JMP:
+
+			jumpl(p, &f->at[k]);
+			break;
+
+		case SVM_CAL:
+
+			for (int j = 0; (j < h) && (j < NSLOTS); j++)
+				store(p, j, slots[j]);
+
+			push(p, get(p, h, T0));
+			cnstl(p, T0, &fun_find(k)->start);
+			call(p, 1, T0);
+			put(p, h, RR);
+
+			for (int j = 0; (j < h) && (j < NSLOTS); j++)
+				load(p, slots[j], j);
+
+			break;
+
+		case SVM_RET:
+
+			leave(p, get(p, h, T0));
+			break;
+
+		case SVM_LIT:
+
+			d = dst(h + 1, T0);
+			cnst(p, d, (ureg_t)k);
+			put(p, h + 1, d);
+			break;
+
+		case SVM_LOD:
+
+			put(p, h + 1, get(p, h - k, T0));
+			break;
+
+		case SVM_ADDI ... SVM_XORI:
+
+			cnst(p, T1, (ureg_t)k);
+			x = get(p, h, T0);
+			d = dst(h, T0);
+			arith[code[i] - SVM_ADDI](p, d, T1, x);
+			put(p, h, d);
+			break;
+
+		case SVM_ADDL ... SVM_XORL:
+
+			y = get(p, h - k, T1);
+			x = get(p, h, T0);
+			d = dst(h, T0);
+			arith[code[i] - SVM_ADDL](p, d, y, x);
+			put(p, h, d);
+			break;
+
+		case SVM_INT:
+
+			if (0 != k)
+				put(p, h - k, get(p, h, T0));
+
+			break;
+		}
+
+		if (operand(code[i]))
+			i++;
+	}
+}
+
+
+void svm_compile(ins2_t** p, const int* code, int len)
+{
+	nfuns = 0;
+	fun_find(0);
+
+	// calls add functions while we go
+
+	for (int i = 0; i < nfuns; i++)
+		heights(code, len, &funs[i]);
+
+	for (int i = 0; i < nfuns; i++)
+		fun_compile(p, code, len, &funs[i]);
+
+	for (int i = 0; i < nfuns; i++) {
+
+		free(funs[i].height);
+		free(funs[i].target);
+		free(funs[i].at);
+	}
+}
@@ -0,0 +1,19 @@
+/*
+ * translator from the byte code of stackvm.c to tiny vm
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ */
+
+#ifndef __SVM_H
+#define __SVM_H 1
+
+#include "cpu.h"
+
+// the byte code of stackvm.c, whose names collide with ours
+
+#define SVM_PREFIX
+#include "../stackvm.h"
+
+extern void svm_compile(ins2_t** p, const int* code, int len);
+
+#endif
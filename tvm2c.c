@@ -0,0 +1,403 @@
+/*
+ * translate a tiny vm image into C
+ *
+   gcc -std=gnu11 -Wall -O2 -otvm2c tvm2c.c tinyvm/cpu.c tinyvm/asm.c tinyvm/progs.c tinyvm/cc.c tinyvm/svm.c
+   ./tvm2c factorial [isa] > fact.c
+   gcc -std=gnu11 -O2 -I. -ofact fact.c tinyvm/cpu.c
+ *
+ * Every word of the image becomes a labelled statement. Jumps
+ * go through one dense table of label addresses per segment, a
+ * relative jump built by cjmp() is tested against its target
+ * first so that the compiler can turn it into a direct branch.
+ * Branches of version 2 are direct jumps.
+ * Reads of IP are constants. Code outside of the image, e.g.
+ * trampolines created on the stack by tramp(), is run by the
+ * interpreter until control returns to the image, and so are
+ * SPAWN and the rare writes to IP which are not jumps, e.g. by
+ * LIT. The image itself must not be modified at run time.
+ * The word after LIW is data. It is only translated into a jump
+ * to the interpreter, in case control goes there anyway. At the
+ * end of a segment control continues at the address after it.
+ *
+ * Registers 1 to 15 are kept in local variables. The generated
+ * program attaches no host, so SYS returns -1 (hello).
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "tinyvm/cpu.h"
+#include "tinyvm/asm.h"
+#include "tinyvm/progs.h"
+
+
+#define MEM_SIZE 100000
+
+struct seg {
+
+	reg_t start;
+	int size;
+};
+
+static int nsegs;
+static struct seg segs[2];
+
+static bool in_image(long pc)
+{
+	for (int k = 0; k < nsegs; k++)
+		if ((pc >= segs[k].start) && (pc < segs[k].start + segs[k].size))
+			return true;
+
+	return false;
+}
+
+
+static void reg(char* buf, reg_t pc, int r)
+{
+	if (IP == r)
+		sprintf(buf, "%d", pc + 1);
+	else if (r < 16)
+		sprintf(buf, "x%d", r);
+	else
+		sprintf(buf, "regs[%d]", r);
+}
+
+static bool is(ins2_t i, enum byte_code op, int a, int b, int c)
+{
+	return (op == i.b[0]) && (a == i.b[1]) && (b == i.b[2]) && (c == i.b[3]);
+}
+
+// relative jump target of the cjmp() which ends at pc, or -1
+
+static long cjmp_target(const mem_t* mm, reg_t pc)
+{
+	ins2_t i = { .w = mm[pc] };
+
+	if (!in_image(pc - 3) || (MOV != i.b[0]) || (IP != i.b[2]) || (IP == i.b[3]))
+		return -1;
+
+	ins2_t hi = { .w = mm[pc - 3] };
+	ins2_t lo = { .w = mm[pc - 2] };
+	ins2_t ad = { .w = mm[pc - 1] };
+
+	int r = i.b[3];
+
+	if (!is(ad, ADD, r, IP, r) || (LIT != hi.b[0]) || (LIT != lo.b[0]) || (r != hi.b[1]) || (r != lo.b[1]))
+		return -1;
+
+	uint32_t off = ((uint32_t)hi.b[3] << 24) | ((uint32_t)hi.b[2] << 16) | ((uint32_t)lo.b[3] << 8) | lo.b[2];
+
+	reg_t t = (reg_t)((uint32_t)pc + off);
+
+	return in_image(t) ? t : -1;
+}
+
+
+// leave the word at pc to the interpreter
+
+static void interp(reg_t pc)
+{
+	// the interpreter copies the registers
+	printf("SAVE; regs[0] = %d; vm_step(regs, mem); LOAD; ip = regs[0]; goto dispatch;\n", pc);
+}
+
+static void insn(const mem_t* mm, reg_t pc)
+{
+	ins2_t i = { .w = mm[pc] };
+
+	char a[16], b[16], c[16];
+
+	reg(a, pc, i.b[1]);
+	reg(b, pc, i.b[2]);
+	reg(c, pc, i.b[3]);
+
+	static const char* ops[] = { [ADD] = "+", [SUB] = "-", [MUL] = "*", [DIV] = "/", [MOD] = "%",
+					[AND] = "&", [OR] = "|", [XOR] = "^" };
+
+	printf("L%d:\t", pc);
+
+	switch (i.b[0]) {
+	case ADD ... XOR:
+
+		if (IP == i.b[1])
+			printf("ip = %s %s %s; goto dispatch;\n", b, ops[i.b[0]], c);
+		else
+			printf("%s = %s %s %s;\n", a, b, ops[i.b[0]], c);
+
+		break;
+
+	case LIT:
+
+		if (IP == i.b[1])
+			goto step;
+
+		printf("%s = (%s << 16) + %d;\n", a, a, ((reg_t)(i.b[3]) << 8) + ((reg_t)i.b[2]));
+		break;
+
+	case MOV:
+
+		if (IP == i.b[2]) {
+
+			long t = cjmp_target(mm, pc);
+
+			if (-1 != t)
+				printf("if (%s) { ip = %s; if (%ld == ip) goto L%ld; goto dispatch; }\n", a, c, t, t);
+			else
+				printf("if (%s) { ip = %s; goto dispatch; }\n", a, c);
+
+		} else {
+
+			printf("if (%s) %s = %s;\n", a, b, c);
+		}
+
+		break;
+
+	case LOD:
+
+		if (IP == i.b[1])
+			printf("ip = VM_LOAD(mem[%s + %s]); goto dispatch;\n", b, c);
+		else
+			printf("%s = VM_LOAD(mem[%s + %s]);\n", a, b, c);
+
+		break;
+
+	case STO:
+
+		printf("VM_STORE(mem[%s + %s], %s);\n", a, c, b);
+		break;
+
+	case CLO:
+
+		printf("VM_STORE(mem[%s], %s); VM_STORE(mem[%s + 1], %s);\n", a, b, a, c);
+		break;
+
+	case CAL:
+
+		printf("{ reg_t f = %s; reg_t e = VM_LOAD(mem[f + 1]); ip = VM_LOAD(mem[f]); VM_STORE(mem[%s + 1], e); VM_STORE(mem[%s + 2], %d); %s += 2; goto dispatch; }\n",
+			b, a, a, pc, a);
+		break;
+
+	case ADDI:
+
+		if (IP == i.b[1])
+			printf("ip = %s + %d; goto dispatch;\n", b, (int8_t)i.b[3]);
+		else
+			printf("%s = %s + %d;\n", a, b, (int8_t)i.b[3]);
+
+		break;
+
+	case LDD:
+
+		if (IP == i.b[1])
+			printf("ip = VM_LOAD(mem[%s + %d]); goto dispatch;\n", b, (int8_t)i.b[3]);
+		else
+			printf("%s = VM_LOAD(mem[%s + %d]);\n", a, b, (int8_t)i.b[3]);
+
+		break;
+
+	case STD:
+
+		printf("VM_STORE(mem[%s + %d], %s);\n", a, (int8_t)i.b[3], b);
+		break;
+
+	case BNZ:
+	case BLZ:
+	{
+		long t = (uint32_t)pc + 1 + (int16_t)((i.b[3] << 8) | i.b[2]);
+
+		printf((BNZ == i.b[0]) ? "if (%s) " : "if (%s < 0) ", a);
+
+		if (in_image(t))
+			printf("goto L%ld;\n", t);
+		else
+			printf("{ ip = %ld; goto dispatch; }\n", t);
+
+		break;
+	}
+
+	case LIW:
+
+		if (IP == i.b[1])
+			goto step;
+
+		if (in_image(pc + 2))
+			printf("%s = %d; goto L%d;\n", a, mm[pc + 1], pc + 2);
+		else
+			printf("%s = %d; ip = %d; goto dispatch;\n", a, mm[pc + 1], pc + 2);
+
+		break;
+
+	case SYS:
+
+		if (IP == i.b[1])
+			goto step;
+
+		printf("%s = (NULL != vm_host_call) ? vm_host_call(mem, %s) : -1;\n", a, b);
+		break;
+
+	case CAS:
+
+		if (IP == i.b[1])
+			goto step;
+
+		printf("atomic_compare_exchange_strong((_Atomic mem_t*)&mem[%s], &%s, %s);\n", b, a, c);
+		break;
+
+	case XADD:
+
+		if (IP == i.b[1])
+			goto step;
+
+		printf("%s = atomic_fetch_add((_Atomic mem_t*)&mem[%s], %s);\n", a, b, c);
+		break;
+
+	case FENCE:
+
+		printf("atomic_thread_fence(memory_order_seq_cst);\n");
+		break;
+
+	case SPAWN:
+	step:
+		interp(pc);
+		break;
+
+	case STP:
+	default:
+		printf("ip = %d; goto stop;\n", pc);
+		break;
+	}
+}
+
+
+static void translate(const char* name, const mem_t* mm, reg_t arg)
+{
+	int nseg = nsegs;
+	const struct seg* s = segs;
+
+	printf("/* %s, generated by tvm2c */\n\n", name);
+	printf("#include <stdio.h>\n#include <stdlib.h>\n#include <stdint.h>\n#include <string.h>\n#include <stdatomic.h>\n\n");
+	printf("#include \"tinyvm/cpu.h\"\n\n");
+
+	for (int k = 0; k < nseg; k++) {
+
+		printf("static const mem_t image%d[%d] = {", k, s[k].size);
+
+		for (int i = 0; i < s[k].size; i++)
+			printf("%s%d,", (0 == i % 8) ? "\n\t" : " ", mm[s[k].start + i]);
+
+		printf("\n};\n\n");
+	}
+
+	printf("void vm_aot(reg_t regs[256], mem_t* mem)\n{\n");
+
+	for (int k = 0; k < nseg; k++) {
+
+		printf("\tstatic const void* const seg%d[%d] = {", k, s[k].size);
+
+		for (int i = 0; i < s[k].size; i++)
+			printf("%s&&L%d,", (0 == i % 8) ? "\n\t\t" : " ", s[k].start + i);
+
+		printf("\n\t};\n\n");
+	}
+
+	printf("\treg_t");
+
+	for (int r = 1; r < 16; r++)
+		printf(" x%d = regs[%d]%s", r, r, (15 == r) ? ";\n" : ",");
+
+	printf("\treg_t ip = regs[0];\n\n");
+
+	printf("#define SAVE");
+
+	for (int r = 1; r < 16; r++)
+		printf(" regs[%d] = x%d;", r, r);
+
+	printf("\n#define LOAD");
+
+	for (int r = 1; r < 16; r++)
+		printf(" x%d = regs[%d];", r, r);
+
+	printf("\n\ndispatch:\n");
+
+	for (int k = 0; k < nseg; k++)
+		printf("\tif ((uint32_t)(ip - %d) < %d)\n\t\tgoto *seg%d[ip - %d];\n", s[k].start, s[k].size, k, s[k].start);
+
+	printf("\n\t// not in the image\n\tSAVE;\n\tregs[0] = ip;\n\n\tdo {\n");
+	printf("\t\tif (!vm_step(regs, mem))\n\t\t\treturn;\n\n\t\tip = regs[0];\n\n\t} while (");
+
+	for (int k = 0; k < nseg; k++)
+		printf("%s((uint32_t)(ip - %d) >= %d)", (0 == k) ? "" : " && ", s[k].start, s[k].size);
+
+	printf(");\n\n\tLOAD;\n\tgoto dispatch;\n\n");
+
+	for (int k = 0; k < nseg; k++) {
+
+		bool data = false;
+
+		for (int i = 0; i < s[k].size; i++) {
+
+			reg_t pc = s[k].start + i;
+
+			if (data) {
+
+				printf("L%d:\t", pc);
+				interp(pc);
+
+			} else {
+
+				insn(mm, pc);
+			}
+
+			data = !data && (LIW == ((ins2_t){ .w = mm[pc] }).b[0]);
+		}
+
+		printf("\tip = %d; goto dispatch;\n", s[k].start + s[k].size);
+	}
+
+	printf("\nstop:\n\tSAVE;\n\tregs[0] = ip + 1;\n#undef SAVE\n#undef LOAD\n}\n\n");
+
+	printf("int main(int argc, char* argv[])\n{\n");
+	printf("\tmem_t* mem = calloc(%d, sizeof(mem_t));\n\n", MEM_SIZE);
+
+	for (int k = 0; k < nseg; k++)
+		printf("\tmemcpy(&mem[%d], image%d, sizeof(image%d));\n", s[k].start, k, k);
+
+	printf("\n\treg_t regs[256] = { 0 };\n");
+	printf("\tregs[%d] = (argc > 1) ? atoi(argv[1]) : %d;\n\n", RR, arg);
+	printf("\tvm_aot(regs, mem);\n\n");
+	printf("\tprintf(\"Result: %%d\\n\", regs[%d]);\n\treturn 0;\n}\n\n", RR);
+}
+
+
+int main(int argc, char* argv[])
+{
+	const struct prog* pr = prog_find((argc > 1) ? argv[1] : "factorial");
+
+	if (NULL == pr) {
+
+		fprintf(stderr, "unknown program: %s\n", argv[1]);
+		return 1;
+	}
+
+	if (argc > 2)
+		asm_isa(atoi(argv[2]));
+
+	mem_t* mm = calloc(MEM_SIZE, sizeof(mem_t));
+	ins2_t* p = (ins2_t*)mm;
+
+	unsigned int start = 50000;
+
+	prelude(&p, start);
+
+	nsegs = 2;
+	segs[0] = (struct seg){ 0, p - (ins2_t*)mm };
+	segs[1] = (struct seg){ start, assemble((ins2_t*)mm, start, pr->fun) };
+
+	translate(pr->name, mm, pr->arg);
+
+	return 0;
+}
+
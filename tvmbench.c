@@ -0,0 +1,285 @@
+/* 
+ * benchmark for the tiny vm execution engines
+ *
+   gcc -std=gnu11 -Wall -O2 -otvmbench tvmbench.c tinyvm/cpu.c tinyvm/asm.c tinyvm/bbc.c tinyvm/jit.c tinyvm/engine.c tinyvm/progs.c tinyvm/cc.c tinyvm/svm.c
+   gcc -std=gnu11 -Wall -O2 -DTVM_WORD=64 -otvmbench64 tvmbench.c tinyvm/cpu.c tinyvm/asm.c tinyvm/engine.c tinyvm/progs.c tinyvm/cc.c tinyvm/svm.c
+ *
+ * usage: tvmbench [-t seconds] [-e engine] [-i isa] [workload ...]
+ *
+ * Every workload is assembled for both instruction sets and runs
+ * under every engine for at least the given time (0.5 s). The
+ * output has one tab separated line per run, after a header, so
+ * that runs of different versions can be compared with the usual
+ * tools. Instructions and stack depth are counted by stepping the
+ * interpreter once per workload.
+ *
+ * The block cache and the jit are created once per workload and
+ * engine, so that only the translated code is timed and not how
+ * it is made. For the same reason the runs start at a second
+ * prelude on a page of its own: the first one shares its page
+ * with the stack, so every push would drop its translation.
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "tinyvm/cpu.h"
+#include "tinyvm/asm.h"
+#include "tinyvm/progs.h"
+#include "tinyvm/bbc.h"
+#include "tinyvm/jit.h"
+
+
+#define MEM_SIZE 100000
+#define START 50000
+#define ENTRY (START - 80)	// on a page of its own
+#define SLICE 100000		// fuel of bbc-fuel
+
+static const struct work {
+
+	const char* name;
+	const char* prog;
+	reg_t arg;
+	reg_t result;
+
+} works[] = {
+
+	{ "factorial", "factorial", 7, 5040 },
+	{ "manorboy5", "manorboy", 5, 0 },
+	{ "manorboy8", "manorboy", 8, -10 },
+	{ "manorboy10", "manorboy", 10, -67 },
+	{ "manorboy-tramp10", "manorboy-tramp", 10, -67 },
+	{ "count", "count", 1000000, 1000000 },
+	{ "stream", "stream", 8192, 8192 * 8191 / 2 },
+	{ "fib", "fib", 20, 6765 },
+	{ "fib-cc", "fib-cc", 20, 6765 },
+	{ "factorial-svm", "factorial-svm", 7, 5040 },
+	{ NULL, NULL, 0, 0 },
+};
+
+
+static double timestamp(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1.E-9;
+}
+
+
+static void init(reg_t reg[256], const struct work* w)
+{
+	for (int i = 0; i < 256; i++)
+		reg[i] = 0;
+
+	reg[IP] = ENTRY;
+	reg[RR] = w->arg;
+}
+
+
+// translations kept over the runs of one engine
+
+struct warm {
+
+	struct bbc* bbc;
+	struct jit* jit;
+};
+
+static void warm_create(struct warm* c, vm_fun_t* run, mem_t* mem)
+{
+	c->bbc = NULL;
+	c->jit = NULL;
+#if 32 == TVM_WORD
+	if ((vm_bbc == run) || (vm_bbc_fuel == run))
+		c->bbc = bbc_create(mem);
+#ifdef __x86_64__
+	if (vm_jit == run)
+		c->jit = jit_create(mem, false);
+#endif
+#endif
+}
+
+static void warm_run(const struct warm* c, vm_fun_t* run, reg_t reg[256], mem_t* mem)
+{
+#if 32 == TVM_WORD
+	if (vm_bbc_fuel == run) {
+
+		long fuel;
+
+		do {
+			fuel = SLICE;
+
+		} while (VM_FUEL == bbc_run_fuel(c->bbc, reg, &fuel));
+
+		return;
+	}
+
+	if (NULL != c->bbc) {
+
+		bbc_run(c->bbc, reg);
+		return;
+	}
+#ifdef __x86_64__
+	if (NULL != c->jit) {
+
+		jit_run(c->jit, reg);
+		return;
+	}
+#endif
+#endif
+	run(reg, mem);
+}
+
+static void warm_free(struct warm* c)
+{
+#if 32 == TVM_WORD
+	if (NULL != c->bbc)
+		bbc_free(c->bbc);
+#ifdef __x86_64__
+	if (NULL != c->jit)
+		jit_free(c->jit);
+#endif
+#endif
+}
+
+// instructions including the final STP, and the highest SP
+
+static long trace(reg_t reg[256], mem_t* mem, reg_t* sp)
+{
+	long n = 1;
+	reg_t max = reg[SP];
+
+	while (vm_step(reg, mem)) {
+
+		if (reg[SP] > max)
+			max = reg[SP];
+
+		n++;
+	}
+
+	*sp = max;
+	return n;
+}
+
+static bool selected(const char* name, int argc, char* argv[])
+{
+	if (0 == argc)
+		return true;
+
+	for (int i = 0; i < argc; i++)
+		if (0 == strcmp(name, argv[i]))
+			return true;
+
+	return false;
+}
+
+
+// all engines on one workload, false if a result is wrong
+
+static bool bench(const struct work* w, int isa, const char* engine, double secs)
+{
+	static ins2_t mm[MEM_SIZE];
+	reg_t reg[256];
+
+	asm_isa(isa);
+	assemble(mm, START, prog_find(w->prog)->fun);
+
+	ins2_t* p = mm + ENTRY;
+	prelude(&p, START);
+
+	reg_t sp;
+
+	init(reg, w);
+	long n = trace(reg, (mem_t*)mm, &sp);
+
+	for (const struct vm_engine* e = vm_engines; NULL != e->name; e++) {
+
+		if ((NULL != engine) && (0 != strcmp(engine, e->name)))
+			continue;
+
+		struct warm c;
+		warm_create(&c, e->run, (mem_t*)mm);
+
+		long reps = 0;
+		double t0 = timestamp();
+		double t1;
+
+		do {
+			init(reg, w);
+			warm_run(&c, e->run, reg, (mem_t*)mm);
+
+			if (reg[RR] != w->result) {
+
+				fprintf(stderr, "%s/%d/%s: wrong result %ld\n", w->name, isa, e->name, (long)reg[RR]);
+				warm_free(&c);
+				return false;
+			}
+
+			reps++;
+
+		} while ((t1 = timestamp()) - t0 < secs);
+
+		warm_free(&c);
+
+		// stack depth in words above the initial stack pointer
+
+		printf("%s\t%ld\t%d\t%s\t%ld\t%.3f\t%ld\n", w->name, (long)w->arg, isa, e->name, n,
+			1.E9 * (t1 - t0) / ((double)n * reps), (long)(sp - 32));
+
+		fflush(stdout);
+	}
+
+	return true;
+}
+
+
+int main(int argc, char* argv[])
+{
+	double secs = 0.5;
+	const char* engine = NULL;
+	int isa = 0;
+	int c;
+
+	while (-1 != (c = getopt(argc, argv, "t:e:i:"))) {
+
+		switch (c) {
+		case 't':
+			secs = atof(optarg);
+			break;
+		case 'e':
+			if (NULL == vm_engine(optarg)) {
+
+				fprintf(stderr, "unknown engine: %s\n", optarg);
+				return 1;
+			}
+
+			engine = optarg;
+			break;
+		case 'i':
+			isa = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t seconds] [-e engine] [-i isa] [workload ...]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	printf("workload\targ\tisa\tengine\tinsns\tns/insn\tstack\n");
+
+	for (const struct work* w = works; NULL != w->name; w++) {
+
+		if (!selected(w->name, argc - optind, argv + optind))
+			continue;
+
+		for (int v = 1; v <= 2; v++)
+			if (((0 == isa) || (v == isa)) && !bench(w, v, engine, secs))
+				return 1;
+	}
+
+	return 0;
+}
@@ -1,191 +1,256 @@
 /* 
  * factorial and man-or-boy-test for tiny vm
  *
-   gcc -std=gnu11 -Wall -O2 -otvmdemo tvmdemo.c tinyvm/asm.c tinyvm/cpu.c
+   gcc -std=gnu11 -Wall -O2 -otvmdemo tvmdemo.c tinyvm/cpu.c tinyvm/asm.c tinyvm/bbc.c tinyvm/jit.c tinyvm/engine.c tinyvm/progs.c tinyvm/cc.c tinyvm/svm.c tinyvm/prof.c tinyvm/mem.c tinyvm/image.c tinyvm/host.c -lpthread
+ *
+ * usage: tvmdemo [-e engine] [-d] [-p] [-r] [-O] [-i isa] [-w image | -l image] [-f forks] [factorial|manorboy]
+ *
+ * -d runs the jit and the interpreter in lockstep
+ * -p prints a profile
+ * -r assembles with short constants
+ * -O runs the peephole optimizer
+ * -i selects the instruction set (1 or 2)
+ * -w writes the program into an image, -l runs an image
+ * -f runs copy on write forks of a snapshot taken before the start
+ *
+ * Host calls of the program may use the stack region and the file
+ * descriptors 0, 1 and 2. -d and -p run without a host, as a host
+ * thread would make the lockstep runs differ, so hello returns -1.
  *
  * Author: Martin Uecker <uecker@eecs.berkeley.edu>
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
 #include <assert.h>
 
 #include "tinyvm/cpu.h"
 #include "tinyvm/asm.h"
+#include "tinyvm/progs.h"
+#include "tinyvm/jit.h"
+#include "tinyvm/prof.h"
+#include "tinyvm/mem.h"
+#include "tinyvm/image.h"
+#include "tinyvm/host.h"
 
 
 
-void prelude(ins2_t** p, unsigned int start)
+int main(int argc, char** argv)
 {
-	cnst(p, C0, 0);
-	cnst(p, C1, 1);
-	cnst(p, SP, 32);	// stack starts at 32
-	cnst(p, FP, 32);
-	push(p, RR);
-	cnst(p, 10, start);	// jump to start
-	call(p, 1, 10);
-	stop(p);
-}
+	vm_fun_t* run = vm;
+	bool diff = false;
+	bool prof = false;
+	bool opt = false;
+	const char* save = NULL;
+	const char* load = NULL;
+	int forks = 0;
+	int (*as)(ins2_t* mm, unsigned int start, prog_f* fun) = assemble;
+	int c;
+
+	while (-1 != (c = getopt(argc, argv, "e:dprOi:w:l:f:"))) {
+
+		switch (c) {
+		case 'e':
+			if (NULL == (run = vm_engine(optarg))) {
+
+				fprintf(stderr, "unknown engine: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'd':
+			diff = true;
+			break;
+		case 'p':
+			prof = true;
+			break;
+		case 'r':
+			as = assemble_relax;
+			break;
+		case 'O':
+			opt = true;
+			break;
+		case 'i':
+			asm_isa(atoi(optarg));
+			break;
+		case 'w':
+			save = optarg;
+			break;
+		case 'l':
+			load = optarg;
+			break;
+		case 'f':
+			forks = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-e engine] [-d] [-p] [-r] [-O] [-i isa] [-w image | -l image] [-f forks] [program]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	const struct prog* pr = prog_find((optind < argc) ? argv[optind] : "factorial");
+
+	if (NULL == pr) {
+
+		fprintf(stderr, "unknown program: %s\n", argv[optind]);
+		return 1;
+	}
 
-void factorial(ins2_t** p, unsigned int start)
-{
-ins2_t* base = here(p);
+	ins2_t* mm = malloc(100000 * sizeof(ins2_t));
 
-ins2_t* f = here(p);
+	unsigned int start = 3 * IMG_ALIGN;
 
-	enter(p, 0);
-	arg(p, U1, 0);
-	sub(p, U1, U1, C1);
+	peephole(opt);
 
-ins2_t* j = here(p);
+	int n = 0;
 
-	cjmp(p, U1, -1);
-	leave(p, C1);
+	if (NULL == load) {
 
-from(p, j);
+		n = as(mm, start, pr->fun);
 
-	push(p, U1);
-	cnst(p, U2, start + (f - base));
-	call(p, 1, U2); 
-	arg(p, U2, 0);
-	mul(p, U2, U2, RR);
-	leave(p, U2);
-}
+		printf("%d words.\n", n);
 
+		if (opt)
+			peep_report();
+	}
 
+	if (NULL != save) {
 
-void manorboy(ins2_t** p, unsigned int start)
-{
-ins2_t* base = here(p);
+		struct img_section sec = { .flags = IMG_CODE, .addr = start, .size = n, .msize = n };
 
-ins2_t* j = here(p);
-	jump(p, -1);
+		int nrel = 0;
+		int32_t rel[asm_nrelocs()];
 
-ins2_t* po = here(p);
-	move(p, RR, C1);
-	ret(p);
+		for (int i = 0; i < asm_nrelocs(); i++)
+			if (asm_reloc(i) >= (int)start)
+				rel[nrel++] = asm_reloc(i);
 
-ins2_t* mo = here(p);
-	sub(p, RR, C0, C1);
-	ret(p);
+		if (0 != img_write(save, (mem_t*)mm, start, 1, &sec, nrel, rel)) {
 
-ins2_t* zo = here(p);
-	move(p, RR, C0);
-	ret(p);
+			fprintf(stderr, "cannot write %s\n", save);
+			return 1;
+		}
 
-ins2_t* b = here(p);
-	enter(p, 0);
+		return 0;
+	}
+	
+	
+	reg_t reg[256] = { [0 ... 255] = 0 };
+	reg[0] = 0;
 
-//	move(p, U2, FP); // save frame pointer 
-// -- we don't need to because we restore SP directly
+	reg[RR] = pr->arg;
 
-	fp(p, 1); 		// get stack frame
-	load(p, A1, 0);
-	sub(p, A1, A1, C1);
-	store(p, 0, A1);
+	if (diff) {
+#ifdef __x86_64__
+		long n = jit_diff(reg, (mem_t*)mm, 100000);
 
-int t = tramp(p, A2, start + (b - base));
+		if (-1 == n)
+			return 1;
 
-	// prepare call to manorboy
+		printf("%ld blocks agree.\n", n);
+#else
+		fprintf(stderr, "no jit\n");
+		return 1;
+#endif
+	} else if (prof) {
 
-	load(p, A3, 1);
-	load(p, A4, 2);
-	load(p, U1, 3);
-	push(p, U1);
-	arg(p, U1, 1);
-	push(p, U1);
+		struct prof* p = prof_create(100000);
 
-//	move(p, FP, U2); // restore frame pointer
+		prof_run(p, reg, (mem_t*)mm);
+		prof_print(p, (mem_t*)mm);
+		prof_free(p);
 
-ins2_t* l = here(p);
-	cnst(p, U1, -1);
-	call(p, 2, U1);
+	} else {
 
-	//leave(p, RR);
+		// prelude and stack at the bottom, code above a guard
 
-	cnst(p, AR, t);
-	sub(p, SP, SP, AR);
-	pop(p, FP);
-	ret(p);
+		struct vm_mem* m = vm_mem_create();
 
+		if (NULL == m) {
 
-ins2_t* mob = here(p);
-	cnst(&l, U1, start + (mob - base));
+			fprintf(stderr, "cannot reserve memory\n");
+			return 1;
+		}
 
-	// store first arguments as local variables
+		vm_mem_map(m, 0, 32768, true);
 
-	enter(p, 4);
-	store(p, 0, A1);
-	store(p, 1, A2);
-	store(p, 2, A3);
-	store(p, 3, A4);
+		if (NULL != load) {
 
+			reg_t entry = img_load(m, load, 0);
 
-	sub(p, U1, C0, A1);
-	cnst(p, U2, (1u << 31));
-	and(p, U1, U1, U2);
+			if (-1 == entry) {
 
-ins2_t* d = here(p);
-	cjmp(p, U1, -1);
+				fprintf(stderr, "cannot load %s\n", load);
+				return 1;
+			}
 
-	// k <= 0
-	arg(p, U1, 1);
-	call(p, 0, U1);
-	push(p, RR);
-	arg(p, U1, 0);
-	call(p, 0, U1);
-	pop(p, U2);
-	add(p, RR, U2, RR);
-	leave(p, RR);
+			ins2_t* p = (ins2_t*)vm_mem_base(m);
 
-from(p, d); // k > 0
-	cnst(p, U1, start + (b - base));
-	call2(p, 0, U1);
-	leave(p, RR);
+			prelude(&p, entry);
 
-from(p, j);
+		} else {
 
-	cnst(p, A1, 10);
-	cnst(p, A2, start + (po - base));
-	cnst(p, A3, start + (mo - base));
-	cnst(p, A4, start + (mo - base));
-	cnst(p, U1, start + (po - base));
-	push(p, U1);
-	cnst(p, U1, start + (zo - base));
-	push(p, U1);
-	cnst(p, U2, start + (mob - base)); // manorboy
-	call(p, 2, U2);
-	ret(p);
-}
+			vm_mem_map(m, start, 16384, true);
 
+			as((ins2_t*)vm_mem_base(m), start, pr->fun);
+		}
 
+		if (0 < forks) {
 
-int main(int argc, char** argv)
-{
-	ins2_t* mm = malloc(100000 * sizeof(ins2_t));
-	ins2_t* p = &mm[0];
+			struct vm_snap* s = vm_mem_snapshot(m, reg);
 
+			if (NULL == s) {
 
-	unsigned int start = 50000;
-	prelude(&p, start);
+				fprintf(stderr, "cannot take snapshot\n");
+				return 1;
+			}
 
-	p = &mm[start];
+			for (int i = 0; i < forks; i++) {
 
-	factorial(&p, start);
-	//manorboy(&p, start);
+				reg_t r[256];
+				struct vm_mem* f = vm_snap_fork(s, r);
 
-	printf("%ld words.\n", p - &mm[start]);
-	
-	
-	reg_t reg[256] = { [0 ... 255] = 0 };
-	reg[0] = 0;
+				if (NULL == f) {
+
+					fprintf(stderr, "fork %d failed\n", i);
+					return 1;
+				}
+
+				struct vm_host* h = vm_host_create(vm_mem_base(f), 32768, 3, (int[]){ 0, 1, 2 });
+
+				if ((VM_FAULT == vm_mem_run(f, run, r)) || (r[RR] != pr->result)) {
+
+					fprintf(stderr, "fork %d failed\n", i);
+					return 1;
+				}
 
-	reg[RR] = 7;
-	vm(reg, (mem_t*)mm);
+				vm_host_free(h);
+				vm_mem_free(f);
+			}
+
+			vm_snap_free(s);
+
+			printf("%d forks agree.\n", forks);
+		}
+
+		struct vm_host* h = vm_host_create(vm_mem_base(m), 32768, 3, (int[]){ 0, 1, 2 });
+
+		if (VM_FAULT == vm_mem_run(m, run, reg)) {
+
+			fprintf(stderr, "memory fault at %ld\n", vm_mem_fault(m));
+			return 1;
+		}
+
+		if (0 < vm_host_requests(h))
+			printf("%ld host calls in %ld batches.\n", vm_host_requests(h), vm_host_batches(h));
+
+		vm_host_free(h);
+		vm_mem_free(m);
+	}
 
 	assert(32 == reg[SP]);
 
 	printf("Result: %d\n", reg[RR]);
 	return 0;
 }
-
@@ -0,0 +1,118 @@
+/*
+ * run many tiny vms on a pool of threads
+ *
+   gcc -std=gnu11 -Wall -O2 -otvmsched tvmsched.c tinyvm/cpu.c tinyvm/asm.c tinyvm/sched.c tinyvm/progs.c tinyvm/cc.c tinyvm/svm.c -lpthread
+ *
+ * usage: tvmsched [-n contexts] [-l long running] [-s slice] [-t max threads]
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "tinyvm/cpu.h"
+#include "tinyvm/asm.h"
+#include "tinyvm/sched.h"
+#include "tinyvm/progs.h"
+
+
+#define START 16384
+#define MEM_SIZE (START + 1024)
+
+
+static double timestamp(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1.E-9;
+}
+
+
+int main(int argc, char** argv)
+{
+	int n = 4096;
+	int l = 16;
+	long slice = 1000;
+	int maxt = sysconf(_SC_NPROCESSORS_ONLN);
+	int c;
+
+	while (-1 != (c = getopt(argc, argv, "n:l:s:t:"))) {
+
+		switch (c) {
+		case 'n': n = atoi(optarg); break;
+		case 'l': l = atoi(optarg); break;
+		case 's': slice = atol(optarg); break;
+		case 't': maxt = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-n contexts] [-l long running] [-s slice] [-t max threads]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	const struct prog* fac = prog_find("factorial");
+	const struct prog* mob = prog_find("manorboy");
+
+	mem_t* images[2];
+
+	for (int i = 0; i < 2; i++) {
+
+		images[i] = calloc(MEM_SIZE, sizeof(mem_t));
+		assemble((ins2_t*)images[i], START, (i ? mob : fac)->fun);
+	}
+
+	struct vm_ctx* ctx = malloc((n + l) * sizeof(struct vm_ctx));
+
+	for (int i = 0; i < n + l; i++)
+		ctx[i].mem = malloc(MEM_SIZE * sizeof(mem_t));
+
+	for (int t = 1; t <= maxt; t *= 2) {
+
+		// long running ones first
+
+		for (int i = 0; i < n + l; i++) {
+
+			const struct prog* pr = (i < l) ? mob : fac;
+
+			memcpy(ctx[i].mem, images[i >= l ? 0 : 1], MEM_SIZE * sizeof(mem_t));
+			memset(ctx[i].regs, 0, sizeof(ctx[i].regs));
+			ctx[i].regs[RR] = pr->arg;
+			ctx[i].status = VM_RUNNING;
+			ctx[i].retired = 0;
+		}
+
+		struct sched* s = sched_create(t, slice);
+
+		double t0 = timestamp();
+
+		for (int i = 0; i < n + l; i++)
+			sched_submit(s, &ctx[i]);
+
+		sched_wait(s);
+
+		double t1 = timestamp();
+
+		long total = sched_retired(s);
+
+		sched_free(s);
+
+		for (int i = 0; i < n + l; i++) {
+
+			const struct prog* pr = (i < l) ? mob : fac;
+
+			if (ctx[i].regs[RR] != pr->result) {
+
+				fprintf(stderr, "context %d: wrong result %d\n", i, ctx[i].regs[RR]);
+				return 1;
+			}
+		}
+
+		printf("%2d threads: %ld insn (%ld per context) %.3f s %8.1f Minsn/s\n", t, total,
+			ctx[n + l - 1].retired, t1 - t0, 1.E-6 * total / (t1 - t0));
+	}
+
+	return 0;
+}
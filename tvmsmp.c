@@ -0,0 +1,105 @@
+/*
+ * parallel reduction on the hardware threads of one tiny vm
+ *
+   gcc -std=gnu11 -Wall -O2 -otvmsmp tvmsmp.c tinyvm/cpu.c tinyvm/asm.c tinyvm/bbc.c tinyvm/jit.c tinyvm/engine.c tinyvm/smp.c tinyvm/progs.c tinyvm/cc.c tinyvm/svm.c -lpthread
+ *
+ * usage: tvmsmp [-e engine] [-i isa] [-n words] [-t max threads]
+ *
+ * Runs psum with 1, 2, 4, ... threads over one shared memory.
+ *
+ * Author: Martin Uecker <uecker@eecs.berkeley.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "tinyvm/cpu.h"
+#include "tinyvm/asm.h"
+#include "tinyvm/smp.h"
+#include "tinyvm/progs.h"
+
+
+static double timestamp(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1.E-9;
+}
+
+
+int main(int argc, char** argv)
+{
+	vm_fun_t* run = vm;
+	long n = 1 << 22;
+	int maxt = sysconf(_SC_NPROCESSORS_ONLN);
+	int c;
+
+	while (-1 != (c = getopt(argc, argv, "e:i:n:t:"))) {
+
+		switch (c) {
+		case 'e':
+			if (NULL == (run = vm_engine(optarg))) {
+
+				fprintf(stderr, "unknown engine: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'i': asm_isa(atoi(optarg)); break;
+		case 'n': n = atol(optarg); break;
+		case 't': maxt = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-e engine] [-i isa] [-n words] [-t max threads]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	// stack with the array and the stacks of the threads below the code
+
+	unsigned int start = (n + 256 * (maxt + 1) + 1024 + 4095) & ~4095;
+	long size = start + 4096;
+
+	mem_t* mem = calloc(size, sizeof(mem_t));
+
+	reg_t result = 0;
+
+	for (long i = 0; i < n; i++)
+		result += i % 16;
+
+	double t1 = 0.;
+
+	for (int t = 1; t <= maxt; t *= 2) {
+
+		assemble((ins2_t*)mem, start, psum);
+
+		reg_t regs[256] = { 0 };
+		regs[RR] = n;
+
+		struct vm_smp* s = vm_smp_create(mem, run, t - 1);
+
+		double t0 = timestamp();
+
+		run(regs, mem);
+		vm_smp_join(s);
+
+		double dt = timestamp() - t0;
+
+		vm_smp_free(s);
+
+		if (regs[RR] != result) {
+
+			fprintf(stderr, "%d threads: wrong result %d\n", t, regs[RR]);
+			return 1;
+		}
+
+		if (1 == t)
+			t1 = dt;
+
+		printf("%2d threads: %.3f s, speedup %.2f\n", t, dt, t1 / dt);
+	}
+
+	free(mem);
+
+	return 0;
+}